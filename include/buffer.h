@@ -5,13 +5,24 @@
 #include <stdint.h>
 
 /* Public function prototypes */
+void Buffer_Init();
 void Buffer_Reset();
 uint8_t* Buffer_Take_Element();
+void Buffer_Take_Span(uint32_t max, uint8_t** first, uint32_t* count);
+uint32_t Buffer_Span_Intact(uint32_t index);
+void Buffer_Release_Span(uint32_t count);
 uint8_t* Buffer_Add_Element();
+uint8_t* Buffer_Reserve_Element(uint32_t ahead);
 uint32_t Buffer_Can_Add_Element();
+void Buffer_Commit_Element();
+uint32_t Buffer_Get_Count();
+uint16_t Buffer_Calc_CRC(const uint8_t* data, uint32_t count);
 
-/** Buffer memory allocation */
-#define BUF_SIZE        0xA000
+/** Heap left free for the C library and USB stack when the buffer claims SRAM */
+#define BUF_HEAP_RESERVE	0x4000
+
+/** Smallest buffer memory allocation. Used if free SRAM can't be determined */
+#define BUF_MIN_SIZE		0x2000
 
 /** Smallest buffer data entry size. Real size is +10 bytes */
 #define BUF_MIN_ENTRY   2
@@ -19,9 +30,14 @@ uint32_t Buffer_Can_Add_Element();
 /** Largest buffer data entry size. Real size is +10 bytes */
 #define BUF_MAX_ENTRY   64
 
+/** Worst case compressed record size (length byte, two 5 byte timestamp varints, 3 bytes per word) */
+#define BUF_MAX_RECORD	(11 + 3 * ((BUF_MAX_ENTRY / 2) + 1))
+
+/** Number of compressed entries decoded per Buffer_Take_Span() call */
+#define BUF_DECODE_ENTRIES	8
+
 /* Public variables exported from module */
 extern uint32_t g_bufLastRegIndex;
-extern uint32_t g_bufCount;
 extern uint32_t g_bufNumWords32;
 
 #endif /* INC_BUFFER_H_ */
@@ -2,7 +2,10 @@
 #define DATA_CAPTURE_H_
 
 /* Public function prototypes */
+void Data_Capture_Init();
 void Data_Capture_Enable();
 void Data_Capture_Disable();
+void Data_Capture_Reset_Buffer();
+void Data_Capture_Update_SPI_Config();
 
 #endif // DATA_CAPTURE_H_
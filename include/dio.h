@@ -0,0 +1,22 @@
+#ifndef INC_DIO_H_
+#define INC_DIO_H_
+
+/* Header includes require for prototypes */
+#include <stdint.h>
+
+/** Number of DIO output pins */
+#define DIO_NUM_PINS		4
+
+/** GPIO for DIO1 (DIO2 - DIO4 follow) */
+#define DIO1_PIN			16
+
+/** Watermark interrupt pulse width (WATERMARK_INT_CONFIG pulse mode), us */
+#define DIO_PULSE_US		100
+
+/* Public function prototypes */
+void Dio_Init();
+void Dio_Update_Config();
+void Dio_Update_Watermark();
+void Dio_Service();
+
+#endif /* INC_DIO_H_ */
@@ -0,0 +1,22 @@
+#ifndef INC_FILTER_H_
+#define INC_FILTER_H_
+
+/* Header includes require for prototypes */
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Number of consecutive buffer data words filtered (gyro X/Y/Z, accel X/Y/Z) */
+#define FILT_WORDS			6
+
+/** Max FIR half length (one coefficient register each) */
+#define FILT_MAX_HALF		7
+
+/** Max FIR length */
+#define FILT_MAX_TAPS		(2 * FILT_MAX_HALF - 1)
+
+/* Public function prototypes */
+void Filter_Reset();
+bool Filter_Is_Enabled();
+bool Filter_Process(uint16_t* data);
+
+#endif /* INC_FILTER_H_ */
@@ -2,14 +2,102 @@
 #define IMU_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+
+/** IMU data ready pin */
+#define PIN_DR   0
+
+/** SCLK divider base. SCLK = IMU_SPI_SCLK_BASE_HZ / divider */
+#define IMU_SPI_SCLK_BASE_HZ    (16*1000*1000)
+
+/** Smallest SCLK divider (4MHz) */
+#define IMU_SPI_SCLK_MIN_DIV    4
+
+/** Burst SCLK calibration: starting divider (500kHz) and bursts per divider */
+#define IMU_SPI_CAL_START_DIV   32
+#define IMU_SPI_CAL_BURSTS      32
+
+/** Standard ADIS burst read command, and words returned (DIAG_STAT - DATA_CNTR, checksum) */
+#define IMU_BURST_CMD           0x6800
+#define IMU_BURST_WORDS         10
+
+/** Number of IMUs supported for multi IMU capture */
+#define IMU_MAX_DEVICES     3
+
+/** Max multi IMU samples in flight (reserved in the buffer but not yet committed) */
+#define IMU_MAX_IN_FLIGHT   (2 * IMU_MAX_DEVICES)
 
 void IMU_SPI_Init();
+void IMU_DMA_IRQ_Init();
 uint16_t IMU_SPI_Transfer(uint16_t MOSI);
 uint16_t IMU_Read_Register(uint8_t RegAddr);
+void IMU_Read_Registers(const uint8_t *RegAddrs, uint16_t *Values, uint32_t Count);
 uint16_t IMU_Write_Register(uint8_t RegAddr, uint8_t RegValue);
 void IMU_Reset();
+void IMU_Update_SPI_Config();
+void IMU_SPI_Set_Burst_Speed(bool burst);
+bool IMU_Calibrate_Burst_Speed();
+void IMU_Select_Device(uint32_t dev);
+uint32_t IMU_Get_DR_Pin(uint32_t dev);
+uint32_t IMU_Get_Device_From_DR(uint32_t gpio);
+bool IMU_DMA_Start_Device_Burst(uint32_t dev, uint8_t *buf, uint32_t words);
+
+/** Register transfer queue depth (power of 2) */
+#define IMU_XFER_QUEUE_SIZE     16
+
+/** Time without a burst after which a capture port is treated as idle (DR stopped).
+  * Cut to two data ready periods once the period has been measured */
+#define IMU_XFER_GAP_TIMEOUT_US 100000
+
+/** Slack left before the next expected burst when running several transfers in one gap */
+#define IMU_XFER_GAP_MARGIN_US  20
+
+/** Queued register transfer status */
+#define IMU_XFER_PENDING        0
+#define IMU_XFER_DONE           1
+#define IMU_XFER_ERROR          2
+#define IMU_XFER_BLOCKED        3   /* IMU port owned by a PIO capture engine */
+
+struct imu_xfer;
+typedef void (*imu_xfer_callback_t)(struct imu_xfer *xfer);
+
+/** Queued register transfer. Owned by the caller until status leaves IMU_XFER_PENDING */
+typedef struct imu_xfer {
+    uint16_t msg;                   /* Frame to send (read or write request) */
+    uint16_t result;                /* Response (register value for reads) */
+    uint32_t dev;                   /* IMU, set when queued */
+    volatile uint32_t status;       /* IMU_XFER_x */
+    imu_xfer_callback_t callback;   /* Called on the capture core when done, may be NULL */
+} imu_xfer_t;
+
+bool IMU_Queue_Read(imu_xfer_t *xfer, uint8_t RegAddr);
+bool IMU_Queue_Write(imu_xfer_t *xfer, uint8_t RegAddr, uint8_t RegValue);
+void IMU_Service_Queue();
+bool IMU_Queue_Blocked();
+bool IMU_SPI_Is_Capturing();
 
 void IMU_DMA_Start_Burst(uint8_t *buf);
+bool IMU_DMA_Is_Busy();
+void IMU_DMA_Enable_CRC(bool enable);
+uint16_t IMU_DMA_Get_CRC();
 void IMU_Hook_DR(void *callback);
 
+/** Buffer entry CRC (CRC-16-CCITT) seed */
+#define IMU_CRC_SEED        0xFFFF
+
+/** Number of slots in the ring capture DMA ring (power of 2) */
+#define IMU_DMA_RING_BITS   6
+#define IMU_DMA_RING_SIZE   (1 << IMU_DMA_RING_BITS)
+
+void IMU_DMA_Ring_Start(uint32_t *slots, uint32_t *timestamps, uint32_t *crcs, uint32_t watermark, void *callback);
+void IMU_DMA_Ring_Stop();
+uint32_t IMU_DMA_Ring_Position(const uint32_t *timestamps);
+void IMU_DMA_Ring_Clear_IRQ();
+
+void IMU_PIO_Start(bool risingEdge, void *callback);
+void IMU_PIO_Start_RegList();
+void IMU_PIO_Stop();
+void IMU_PIO_Clear_Start_IRQ();
+void IMU_PIO_Arm_Burst(uint8_t *buf);
+
 #endif // IMU_H_
@@ -0,0 +1,31 @@
+#ifndef INC_INTEGRATOR_H_
+#define INC_INTEGRATOR_H_
+
+/* Header includes require for prototypes */
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Integrated output: delta angle X/Y/Z then delta velocity X/Y/Z, 32 bits each (low word first) */
+#define INTEG_OUT_WORDS		12
+
+/** Output scaling. Delta angle LSB is 2^-28 rad, delta velocity LSB is 2^-20 m/s */
+#define INTEG_ANGLE_BITS	28
+#define INTEG_VEL_BITS		20
+
+/** Gyro LSB * us to delta angle LSB, Q24. ADIS16470 burst gyro is 0.1 deg/s per LSB:
+ * 0.1 * pi / 180 * 1e-6 * 2^28 * 2^24 */
+#define INTEG_GYRO_SCALE	7860264
+
+/** Accel LSB * us to delta velocity LSB, Q24. ADIS16470 burst accel is 1.25 mg per LSB:
+ * 1.25e-3 * 9.80665 * 1e-6 * 2^20 * 2^24 */
+#define INTEG_ACCL_SCALE	215651
+
+/** Sample spacing (us) treated as a gap in the data. Integration restarts after one */
+#define INTEG_MAX_DT		100000
+
+/* Public function prototypes */
+void Integrator_Reset();
+bool Integrator_Is_Enabled();
+bool Integrator_Process(uint8_t* element);
+
+#endif /* INC_INTEGRATOR_H_ */
@@ -3,9 +3,17 @@
 
 /* Header includes require for prototypes */
 #include <stdint.h>
+#include <stdbool.h>
 
 void ISR_Start_IMU_Burst();
-void ISR_Finish_IMU_Burst();
+void ISR_Finish_IMU_Burst(uint32_t dev);
+void ISR_Start_PIO_Capture(bool risingEdge);
+void ISR_Stop_PIO_Capture();
+void ISR_Start_Ring_Capture(bool risingEdge);
+void ISR_Stop_Ring_Capture();
+void ISR_Start_Multi_Capture(uint32_t numDevices);
+void ISR_Stop_Multi_Capture();
+void ISR_Start_Device_Burst(unsigned int gpio, uint32_t events);
 
 /* Public variables exported from module */
 extern volatile uint32_t g_wordsPerCapture;
@@ -42,8 +42,14 @@
 #define USER_SPI_CONFIG_REG			0x49
 #define CLI_CONFIG_REG				0x4A
 #define USER_COMMAND_REG			0x4B /* Clears automatically */
-#define SYNC_FREQ_REG				0x4C
-/* Space for 12 more regs here */
+#define SYNC_FREQ_REG				0x4C /* Hz, applied by CMD_SYNC_GEN */
+#define BUF_MAX_SIZE_REG			0x4D /* KB, 0 for no cap. Min 8 (BUF_MIN_SIZE) */
+#define IMU_DEV_CONFIG_REG			0x4E
+#define IMU_BURST_CONFIG_REG		0x4F
+#define USB_TX_SIZE_REG				0x50
+#define USB_TX_DEADLINE_REG			0x51
+#define FILT_CONFIG_REG				0x52
+#define FILT_COEF_0_REG				0x53 /* 7 regs, through 0x59 */
 #define USER_SCR_0_REG				0x5A
 #define USER_SCR_3_REG				0x5D
 #define UTC_TIMESTAMP_LWR_REG		0x5E
@@ -56,6 +62,7 @@
 #define FAULT_CODE_REG				0x61
 #define BUF_CNT_0_REG				0x62
 #define BUF_MAX_CNT_REG				0x63
+#define BUF_SIZE_REG				0x64
 
 /* Volatile time stamp and output data regs */
 #define TIMESTAMP_LWR_REG			0x65
@@ -63,6 +70,24 @@
 #define TEMP_REG					0x67
 #define VDD_REG						0x68
 
+/* Volatile DR interrupt latency regs (us, average in 1/16 us) */
+#define DR_LATENCY_MIN_REG			0x69
+#define DR_LATENCY_MAX_REG			0x6A
+#define DR_LATENCY_AVG_REG			0x6B
+
+/* Volatile PPS PLL regs (signed). Last phase error in 1/16 us, crystal
+ * drift estimate in 1/16 ppm (positive is fast) */
+#define PPS_PHASE_REG				0x6C
+#define PPS_DRIFT_REG				0x6D
+
+/* Volatile host time sync regs (see timesync.c). Host - device offset in us,
+ * latched on read of the lower word. Host clock skew in 1/16 ppm (signed),
+ * round trip of the last accepted exchange in us */
+#define TSYNC_OFFSET_LWR_REG		0x6E
+#define TSYNC_OFFSET_UPR_REG		0x6F
+#define TSYNC_SKEW_REG				0x70
+#define TSYNC_DELAY_REG				0x71
+
 /* Volatile script info regs */
 #define SCR_LINE_REG				0x72
 #define SCR_ERROR_REG				0x73
@@ -100,7 +125,11 @@
 #define DIO_OUTPUT_CONFIG_DEFAULT	0x8421
 #define WATER_INT_CONFIG_DEFAULT	0x0020
 #define ERROR_INT_CONFIG_DEFAULT	0xFFFC
-#define IMU_SPI_CONFIG_DEFAULT		0x100F
+#define IMU_SPI_CONFIG_DEFAULT		0x1010
+#define IMU_BURST_CONFIG_DEFAULT	0x1000
+#define USB_TX_SIZE_DEFAULT			512
+#define USB_TX_DEADLINE_DEFAULT		1000
+#define FILT_CONFIG_DEFAULT			0x2000
 #define USER_SPI_CONFIG_DEFAULT		0x0007
 #define CLI_CONFIG_DEFAULT			0x2000
 #define BTN_CONFIG_DEFAULT			0x8000
@@ -127,6 +156,7 @@
 #define CMD_STOP_SCRIPT				(1 << 7)
 #define CMD_WATERMARK_SET			(1 << 8)
 #define CMD_SYNC_GEN				(1 << 9)
+#define CMD_SPI_CALIBRATE			(1 << 10)
 #define CMD_BOOTLOADER				(1 << 13)
 #define CMD_IMU_RESET				(1 << 14)
 #define CMD_SOFTWARE_RESET			(1 << 15)
@@ -137,6 +167,23 @@
 #define SPI_CONF_MSB_FIRST			(1 << 2)
 #define SPI_CONF_MASK				(SPI_CONF_CPHA|SPI_CONF_CPOL|SPI_CONF_MSB_FIRST)
 
+/* FILT_CONFIG bits. Decimation ratio (0 or 1 disables the filter), FIR half
+ * length (0 for a boxcar average of each ratio samples, otherwise a symmetric
+ * FIR of 2N - 1 taps from FILT_COEF_x, Q15 with FILT_COEF_0 the center tap),
+ * and the first of the FILT_WORDS buffer data words which are filtered */
+#define FILT_RATIO_MASK				0x00FF
+#define FILT_TAPS_BITP				8
+#define FILT_TAPS_MASK				(0xF << FILT_TAPS_BITP)
+#define FILT_WORD_BITP				12
+#define FILT_WORD_MASK				(0xF << FILT_WORD_BITP)
+
+/* IMU SPI config register bits. IMU_SPI_CONFIG sets register access (stall in us,
+ * SCLK = 16MHz / divider). IMU_BURST_CONFIG uses the same divider field for burst reads */
+#define IMU_SPI_STALL_MASK			0x007F
+#define IMU_SPI_PIO_BITM			(1 << 7)
+#define IMU_SPI_SCLK_DIV_BITP		8
+#define IMU_SPI_SCLK_DIV_MASK		(0xFF << IMU_SPI_SCLK_DIV_BITP)
+
 /* Status register bits */
 #define STATUS_BUF_WATERMARK		(1 << 0)
 #define STATUS_BUF_FULL				(1 << 1)
@@ -146,6 +193,7 @@
 #define STATUS_DMA_ERROR			(1 << 5)
 #define STATUS_PPS_UNLOCK			(1 << 6)
 #define STATUS_TEMP_WARNING			(1 << 7)
+#define STATUS_IMU_BUSY				(1 << 8) /* IMU page access rejected, capture owns the IMU bus */
 #define STATUS_SCR_ERROR			(1 << 10)
 #define STATUS_SCR_RUNNING			(1 << 11)
 #define STATUS_FLASH_ERROR			(1 << 12)
@@ -156,19 +204,51 @@
 /* Status clear mask (defines status bits which are sticky) */
 #define STATUS_CLEAR_MASK			(STATUS_FLASH_ERROR|STATUS_FAULT|STATUS_FLASH_UPDATE|STATUS_WATCHDOG|STATUS_SCR_RUNNING)
 
-/* BUF_CONFIG bit definitions */
+/* SCR_ERROR values. SCR_LINE holds the script line the error was flagged on */
+#define SCR_ERROR_NONE				0
+#define SCR_ERROR_EMPTY				1 /* Start with no stored script */
+#define SCR_ERROR_FULL				2 /* Script store is full */
+#define SCR_ERROR_LOOP				3 /* Unbalanced or too deeply nested loop / endloop */
+#define SCR_ERROR_BUSY				4 /* Script upload while running */
+
+/* BUF_CONFIG bit definitions. With IMU_BURST clear, capture runs the BUF_WRITE
+ * register list on IMU 0 and takes precedence over the other capture modes: the
+ * IMU_DEV_CONFIG count, DMA_RING and the IMU_SPI_CONFIG PIO bit are ignored.
+ * COMPRESS, SUM_SIG, INTEGRATE and the filter still apply. Otherwise the order is
+ * multi IMU, then DMA_RING, then the PIO burst engine, then SPI DMA bursts */
 #define BUF_CFG_REPLACE_OLDEST		(1 << 0)
 #define BUF_CFG_IMU_BURST			(1 << 1)
 #define BUF_CFG_BUF_BURST			(1 << 2)
-#define BUF_CFG_MASK				(BUF_CFG_REPLACE_OLDEST|BUF_CFG_IMU_BURST|BUF_CFG_BUF_BURST)
+#define BUF_CFG_COMPRESS			(1 << 3)
+#define BUF_CFG_DMA_RING			(1 << 4)
+#define BUF_CFG_SUM_SIG				(1 << 5)
+#define BUF_CFG_INTEGRATE			(1 << 6)
+
+#define BUF_CFG_MASK				(BUF_CFG_REPLACE_OLDEST|BUF_CFG_IMU_BURST|BUF_CFG_BUF_BURST|BUF_CFG_COMPRESS|BUF_CFG_DMA_RING|BUF_CFG_SUM_SIG|BUF_CFG_INTEGRATE)
+
+/* IMU_DEV_CONFIG bits. With more than one IMU, data word 0 of each buffer entry is the
+ * IMU index and BUF_LEN includes it. Multi IMU capture uses the SPI DMA path with the
+ * legacy sum signature, and is not available with compression */
+#define IMU_DEV_COUNT_MASK			0x0003
+#define IMU_DEV_SELECT_BITP			8
+#define IMU_DEV_SELECT_MASK			(0x3 << IMU_DEV_SELECT_BITP)
 
 /* DIO_INPUT_CONFIG bit positions */
 #define DR_POLARITY_BITP            4
 #define PPS_POLARITY_BITP           7
+#define PPS_FREQ_BITP               12
 #define DR_POLARITY_BITM            (1 << DR_POLARITY_BITP)
-#define PPS_POLARITY_BITM           (1 << DR_POLARITY_BITP)
+#define PPS_POLARITY_BITM           (1 << PPS_POLARITY_BITP)
 #define PPS_FREQ_BITM               ((1 << 12) | (1 << 13))
 
+/* DIO_OUTPUT_CONFIG fields. Each is a mask of the DIO1 - DIO4 pins driven
+ * by that function (pass through is not supported) */
+#define DIO_PASS_MASK				0x000F
+#define DIO_WATERMARK_BITP			4
+#define DIO_OVERFLOW_BITP			8
+#define DIO_ERROR_BITP				12
+#define DIO_FUNC_MASK				0xF
+
 /* Watermark int config pulse mode mask */
 #define WATERMARK_PULSE_MASK 		(1 << 15)
 
@@ -177,12 +257,16 @@
 #define SD_STREAM_BITP				1
 #define USB_ECHO_BITP				2
 #define SD_AUTORUN_BITP				3
+#define USB_BINARY_BITP				4
+#define USB_BULK_BITP				5
 #define CLI_DELIM_BITP				8
 
 #define USB_STREAM_BITM				(1 << USB_STREAM_BITP)
 #define SD_STREAM_BITM				(1 << SD_STREAM_BITP)
 #define USB_ECHO_BITM				(1 << USB_ECHO_BITP)
 #define SD_AUTORUN_BITM				(1 << SD_AUTORUN_BITP)
+#define USB_BINARY_BITM				(1 << USB_BINARY_BITP)
+#define USB_BULK_BITM				(1 << USB_BULK_BITP)
 #define CLI_DELIM_BITM				(0xFF << CLI_DELIM_BITP)
 
 #define CLI_CONFIG_CLEAR_MASK		0xFF0C
@@ -199,7 +283,11 @@ void Reg_Init();
 void Reg_Update_Identifiers();
 bool Reg_Is_Burst_Read(uint8_t addr);
 uint16_t Reg_Read(uint8_t regAddr);
+bool Reg_Read_Multiple(const uint8_t* regAddrs, uint16_t* values, uint32_t count);
 uint16_t Reg_Write(uint8_t regAddr, uint8_t regValue);
+bool Reg_Access_Done();
+bool Reg_IMU_Access_Blocked();
+uint32_t Reg_Get_Page();
 void Reg_Process_Command();
 void Reg_Factory_Reset();
 void Reg_Buf_Dequeue_To_Outputs();
@@ -3,6 +3,7 @@
 
 /* Header includes require for prototypes */
 #include <stdint.h>
+#include <stdbool.h>
 
 /** Available script commands */
 typedef enum
@@ -20,6 +21,9 @@ typedef enum
 	about,
 	uptime,
 	increment,
+	tsync,
+	scradd,
+	scrclear,
 	help,
 	sleep,
 	loop,
@@ -47,6 +51,10 @@ typedef struct
 void Script_Check_Stream();
 void Script_Parse_Element(const uint8_t* commandBuf, script * scr);
 void Script_Run_Element(script* scr, uint8_t * outBuf);
+void Script_Start();
+void Script_Stop();
+void Script_Step();
+bool Script_Element_Done();
 
 /** Buffer output base address (on page 255) */
 #define BUF_BASE_ADDR			8
@@ -57,4 +65,30 @@ void Script_Run_Element(script* scr, uint8_t * outBuf);
 /** Stream buffer size */
 #define STREAM_BUF_SIZE			512
 
+/** Binary buffer packets (CLI_CONFIG USB_BINARY set). Raw packet layout:
+ * [0..1] sequence number, [2] entry count, [3] entry size in bytes,
+ * [4..] entries exactly as stored in the buffer, then CRC-16-CCITT
+ * (poly 0x1021, seed 0xFFFF) of all previous bytes. All fields little endian.
+ * Each packet is COBS encoded and followed by a 0x00 delimiter */
+#define BIN_PKT_HEADER_SIZE		4
+#define BIN_PKT_CRC_SIZE		2
+
+/** USB start of frame timestamp packets have an entry count of 0 and an entry
+ * size of 10. The payload is [0..1] 11-bit USB frame number, [2..5] UTC seconds,
+ * [6..9] microseconds (same time base as the buffer entries). One is sent ahead
+ * of the buffer entries every USB_SOF_PACKET_PERIOD frames */
+#define BIN_SOF_SIZE			10
+
+/** Max raw packet size, so the COBS encoded packet fits in STREAM_BUF_SIZE */
+#define BIN_PKT_MAX_SIZE		(STREAM_BUF_SIZE - (STREAM_BUF_SIZE / 254) - 3)
+
+/** Max elements in the script store (uploaded with scradd) */
+#define SCRIPT_MAX_LINES		64
+
+/** Max loop / endloop nesting depth within a stored script */
+#define SCRIPT_MAX_LOOP_DEPTH	4
+
+/** Max registers per read command (addresses 0 - 0x7E) */
+#define READ_MAX_REGS			64
+
 #endif /* INC_SCRIPT_H_ */
@@ -0,0 +1,21 @@
+#ifndef INC_SYNC_GEN_H_
+#define INC_SYNC_GEN_H_
+
+/* Header includes require for prototypes */
+#include <stdint.h>
+
+/** SYNC clock output GPIO (to the IMU sync input) */
+#define PIN_SYNC 21
+
+/** Max change of one sync period from nominal, as a shift (1/256) */
+#define SYNC_SLEW_SHIFT			8
+
+/** Delay from a sync start command to the generator starting (us) */
+#define SYNC_START_DELAY_US		200
+
+/* Public function prototypes */
+void Sync_Gen_Init();
+void Sync_Gen_Start();
+void Sync_Gen_Stop();
+
+#endif /* INC_SYNC_GEN_H_ */
@@ -3,16 +3,27 @@
 
 /* Header includes require for prototypes */
 #include <stdint.h>
+#include <stdbool.h>
+
+/** PPS input GPIO */
+#define PIN_PPS 20
 
 /* Public function prototypes */
 
 void Timer_Init();
 void Timer_Clear_Microsecond_Timer();
 uint32_t Timer_Get_Microsecond_Timestamp();
+uint32_t Timer_Get_Timestamp(uint32_t* seconds);
+uint32_t Timer_Raw_To_Timestamp(uint32_t raw, uint32_t* seconds);
+void Timer_Get_Time_Base(uint64_t* base, int64_t* period);
+void Timer_Start_DR_Stamp(uint32_t pin, bool risingEdge);
+void Timer_Stop_DR_Stamp();
+uint32_t Timer_Get_DR_Timestamp(uint32_t* seconds);
 uint32_t Timer_Get_Millisecond_Uptime();
 uint32_t Timer_Get_PPS_Timestamp();
 void Timer_Enable_PPS();
 void Timer_Disable_PPS();
+void Timer_Update_PPS_Config();
 void Timer_Check_PPS_Unlock();
 void Timer_Increment_PPS_Time();
 
@@ -0,0 +1,23 @@
+#ifndef INC_TIMESYNC_H_
+#define INC_TIMESYNC_H_
+
+/* Header includes require for prototypes */
+#include <stdint.h>
+
+/** Sync exchanges with a round trip this far (us) above the minimum are discarded */
+#define TSYNC_DELAY_SLACK		250
+
+/** Offset prediction error (us) which restarts the estimator */
+#define TSYNC_MAX_ERROR			10000
+
+/** Min device time between sync exchanges (us) for a skew update */
+#define TSYNC_MIN_INTERVAL		1000
+
+/* Public function prototypes */
+void TimeSync_Reset();
+uint32_t TimeSync_Get_Device_Time();
+uint32_t TimeSync_Raw_To_Device_Time(uint32_t raw);
+void TimeSync_Update(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4);
+uint16_t TimeSync_Latch_Offset();
+
+#endif /* INC_TIMESYNC_H_ */
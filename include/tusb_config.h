@@ -0,0 +1,34 @@
+#ifndef TUSB_CONFIG_H_
+#define TUSB_CONFIG_H_
+
+/* TinyUSB configuration. Composite device: CDC (CLI / stdio) plus a vendor
+ * class interface with a bulk IN endpoint for the buffered data stream.
+ * See usb_descriptors.c */
+
+#define CFG_TUSB_RHPORT0_MODE		OPT_MODE_DEVICE
+
+#ifndef CFG_TUSB_OS
+#define CFG_TUSB_OS					OPT_OS_PICO
+#endif
+
+#define CFG_TUD_ENDPOINT0_SIZE		64
+
+/** Interfaces */
+#define CFG_TUD_CDC					1
+#define CFG_TUD_MSC					0
+#define CFG_TUD_HID					0
+#define CFG_TUD_MIDI				0
+#define CFG_TUD_VENDOR				1
+
+/** CDC FIFO sizes (same as pico_stdio_usb) */
+#define CFG_TUD_CDC_RX_BUFSIZE		256
+#define CFG_TUD_CDC_TX_BUFSIZE		256
+
+/** Vendor bulk endpoint size (full speed max). The TX FIFO holds two
+ * packets, so one can fill while the other is on the bus (checked in
+ * usb_descriptors.c) */
+#define CFG_TUD_VENDOR_EPSIZE		64
+#define CFG_TUD_VENDOR_RX_BUFSIZE	64
+#define CFG_TUD_VENDOR_TX_BUFSIZE	(2 * CFG_TUD_VENDOR_EPSIZE)
+
+#endif /* TUSB_CONFIG_H_ */
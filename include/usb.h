@@ -3,10 +3,30 @@
 
 /* Header includes require for prototypes */
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Public function prototypes */
 
 void USB_Rx_Handler();
 void USB_Tx_Handler(const uint8_t* buf, uint32_t count);
+void USB_Tx_Flush();
+void USB_Tx_Check_Deadline();
+uint32_t USB_Bulk_Tx(const uint8_t* buf, uint32_t count);
+void USB_Bulk_Flush();
+void USB_SOF_Init();
+uint32_t USB_Get_SOF_Stamp(uint16_t* frame, uint32_t* seconds, uint32_t* microseconds);
+bool USB_Get_Command_Rx_Time(uint32_t* raw);
+
+/** CDC (CLI) bulk OUT endpoint. Its packet arrivals are timestamped for tsync */
+#define USB_CDC_EP_OUT			0x02
+
+/** CLI output batch buffer size. USB_TX_SIZE is clamped to this */
+#define USB_TX_BUF_SIZE			1024
+
+/** Time the vendor bulk FIFO may make no progress before stream data is dropped */
+#define USB_BULK_TIMEOUT_US		100000
+
+/** USB frames (ms) between start of frame timestamp packets in the binary stream */
+#define USB_SOF_PACKET_PERIOD	1000
 
 #endif /* INC_USB_H_ */
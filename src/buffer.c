@@ -1,24 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
 #include "hardware/sync.h"
 #include "stdint.h"
 #include "reg.h"
 #include "buffer.h"
+#include "imu.h"
+#include "dio.h"
+
+/* Local function prototypes */
+static void UpdateCountRegs(uint32_t count);
+static void CompressedTakeSpan(uint32_t max, uint8_t** first, uint32_t* count);
+static void CompressedReleaseSpan(uint32_t count);
+static uint32_t CompressedFreeSpace(uint32_t* head);
+static void CompressedCommit();
+static uint32_t EncodeEntry(const uint8_t* entry, const uint8_t* prev, uint8_t* out);
+static uint32_t DecodeEntry(const uint8_t* in, const uint8_t* prev, uint8_t* entry);
+static uint8_t* PutVarint(uint8_t* out, uint32_t val);
+static const uint8_t* GetVarint(const uint8_t* in, uint32_t* val);
+
+/* The smallest buffer (BUF_MIN_SIZE, max size entries) has to hold the producer slot,
+ * the last dequeued slot and a full DMA ring of in flight entries, plus stored entries */
+_Static_assert((BUF_MIN_SIZE / (BUF_MAX_ENTRY + 12)) > (IMU_DMA_RING_SIZE + 2), "BUF_MIN_SIZE too small");
 
 /** Index for the last buffer output register. This is based on buffer size. Global scope */
 uint32_t g_bufLastRegIndex;
 
-/** Number of elements currently stored in the buffer. Global scope */
-uint32_t g_bufCount = 0;
-
 /** Number of 32-bit words per buffer entry. Global scope */
 uint32_t g_bufNumWords32;
 
-/** The buffer storage (aligned to allow word-wise retrieval of buffer data) */
-static uint8_t buf[BUF_SIZE] __attribute__((aligned (32)));
+/** Linker symbols for the start (end of .bss) and end of the heap */
+extern char __end__;
+extern char __StackLimit;
+
+/** The buffer storage (claimed from the heap by Buffer_Init) */
+static uint8_t* buf;
+
+/** Size of the buffer storage claimed at boot, in bytes */
+static uint32_t buf_allocSize;
+
+/** Size of the buffer storage in use (after BUF_MAX_SIZE_REG cap is applied), in bytes */
+static uint32_t buf_size;
+
+/** Number of entries committed to the buffer since reset. Only written by the producer (DR ISR) */
+static volatile uint32_t buf_headSeq = 0;
 
-/** Index within buffer array for buffer head */
-static volatile uint32_t buf_head = 0;
+/** Number of entries taken from the buffer since reset. Only written by the consumer (main loop) */
+static volatile uint32_t buf_tailSeq = 0;
 
-/** Index within buffer array for buffer tail */
+/** Byte index within buffer array for buffer head. Producer owned */
+static uint32_t buf_head = 0;
+
+/** Byte index within buffer array for buffer tail. Consumer owned (read by producer in compressed mode) */
 static volatile uint32_t buf_tail = 0;
 
 /** Increment per buffer entry. This is buffer length + 4, padded to multiple of 4 */
@@ -27,12 +59,62 @@ static uint32_t buf_increment = 64;
 /** Buffer full setting (0 -> stop adding, Not 0 -> replace oldest) */
 static uint32_t buf_replaceOldest = 0;
 
+/** Compressed buffer setting (0 -> fixed size entries, Not 0 -> delta encoded records) */
+static uint32_t buf_compress = 0;
+
 /** Buffer max count (determined once when buffer is initialized) */
 static uint32_t buf_maxCount;
 
+/** Number of entry slots in the buffer memory */
+static uint32_t buf_numSlots;
+
 /** Position at which buffer needs to wrap around */
 static uint32_t buf_lastEntryIndex;
 
+/** Raw entries used by the producer in compressed mode (one being captured, one previous) */
+static uint8_t buf_stage[2][BUF_MAX_ENTRY + 12] __attribute__((aligned (4)));
+
+/** Index within buf_stage of the entry being captured */
+static uint32_t buf_stageIndex;
+
+/** Decoded entries handed to the consumer in compressed mode (buf_increment bytes apart) */
+static uint8_t buf_decode[BUF_DECODE_ENTRIES * (BUF_MAX_ENTRY + 12)] __attribute__((aligned (4)));
+
+/** Last entry released by the consumer in compressed mode (delta decode reference) */
+static uint8_t buf_decPrev[BUF_MAX_ENTRY + 12] __attribute__((aligned (4)));
+
+/** CRC-16-CCITT (poly 0x1021) lookup, one nibble at a time */
+static const uint16_t buf_crcNibble[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+/** Byte index after each entry in buf_decode */
+static uint32_t buf_decEnd[BUF_DECODE_ENTRIES];
+
+/** Number of entries currently decoded into buf_decode */
+static uint32_t buf_decCount;
+
+/**
+  * @brief Get the number of entries currently stored in the buffer
+  *
+  * @return Buffer entry count, clamped to the buffer max count
+  *
+  * Safe to call from either producer or consumer context. When replace
+  * oldest is enabled the producer can run ahead of the consumer, so the
+  * raw head/tail difference is clamped.
+  */
+uint32_t Buffer_Get_Count()
+{
+	uint32_t count = buf_headSeq - buf_tailSeq;
+
+	if(count > buf_maxCount)
+	{
+		count = buf_maxCount;
+	}
+	return count;
+}
+
 /**
   * @brief Checks if an element can be added to the buffer
   *
@@ -42,6 +124,14 @@ static uint32_t buf_lastEntryIndex;
   */
 uint32_t Buffer_Can_Add_Element()
 {
+	uint32_t head;
+
+	/* Compressed mode has to have space for a worst case record */
+	if(buf_compress)
+	{
+		return CompressedFreeSpace(&head) >= BUF_MAX_RECORD;
+	}
+
 	/* can always add new element if replace oldest is set */
 	if(buf_replaceOldest)
 	{
@@ -49,7 +139,7 @@ uint32_t Buffer_Can_Add_Element()
 	}
 
 	/* Buffer full and replace oldest set to false */
-	if(g_bufCount >= buf_maxCount)
+	if((buf_headSeq - buf_tailSeq) >= buf_maxCount)
 	{
 		return 0;
 	}
@@ -65,103 +155,299 @@ uint32_t Buffer_Can_Add_Element()
   *
   * In FIFO mode (queue) this function takes from the tail and moves the tail
   * pointer down. This function is called from the main loop when a buffer
-  * dequeue is requested. As such, the ISRs are disabled for the duration
-  * of this function execution to prevent issues with g_bufCount being
-  * inadvertently changed
+  * dequeue is requested. It is the only writer of the tail index, and the
+  * DR ISR is the only writer of the head index, so no critical section is
+  * needed. If there are no entries the current tail is returned.
   */
 uint8_t* Buffer_Take_Element()
 {
-	uint8_t* buf_addr = buf;
+	uint8_t* buf_addr;
+	uint32_t count;
 
-	/* Enter critical */
-	uint32_t irqs = save_and_disable_interrupts();
+	Buffer_Take_Span(1, &buf_addr, &count);
+	Buffer_Release_Span(count);
 
-	/* In FIFO mode take from the tail and move tail down */
-	if(g_bufCount)
-	{
-		/*Get pointer to the current tail entry */
-		buf_addr += buf_tail;
+	/* Return pointer to the buffer entry */
+	return buf_addr;
+}
 
-		/* Decrement counter and move tail down */
-		g_bufCount--;
-		buf_tail += buf_increment;
+/**
+  * @brief Get a run of contiguous entries from the buffer tail
+  *
+  * @param max Maximum number of entries to return
+  *
+  * @param first Receives a pointer to the first (oldest) entry
+  *
+  * @param count Receives the number of entries in the span
+  *
+  * @return void
+  *
+  * Entries in the span are g_bufNumWords32 * 4 bytes apart. The span stops
+  * at the buffer wrap point, so a second call may be needed to retrieve the
+  * remaining entries. The entries stay in the buffer (and are counted)
+  * until Buffer_Release_Span() is called. In replace oldest mode the producer
+  * can overwrite span entries while they are read, so check each copied entry
+  * with Buffer_Span_Intact(). If the producer has lapped the
+  * consumer (replace oldest mode) the tail is first moved forward past the
+  * entries which have been overwritten. In compressed mode the entries are
+  * decoded to a staging area, up to BUF_DECODE_ENTRIES at a time.
+  */
+void Buffer_Take_Span(uint32_t max, uint8_t** first, uint32_t* count)
+{
+	uint32_t headSeq = buf_headSeq;
+	uint32_t tailSeq = buf_tailSeq;
+	uint32_t available, skip, toWrap, tail;
 
-		/* Check that buffer tail hasn't wrapped around */
-		if(buf_tail > buf_lastEntryIndex)
+	if(buf_compress)
+	{
+		CompressedTakeSpan(max, first, count);
+		return;
+	}
+
+	/* Discard the oldest entries if the producer replaced them */
+	tail = buf_tail;
+	if((headSeq - tailSeq) > buf_maxCount)
+	{
+		skip = (headSeq - tailSeq) - buf_maxCount;
+		tailSeq += skip;
+		tail += (skip % buf_numSlots) * buf_increment;
+		if(tail > buf_lastEntryIndex)
 		{
-			/* reset to top of buffer */
-			buf_tail = 0;
+			tail -= (buf_lastEntryIndex + buf_increment);
 		}
+		buf_tail = tail;
+		__dmb();
+		buf_tailSeq = tailSeq;
 	}
-	else
+
+	/* Limit to stored entries, and to the entries before the wrap point */
+	available = headSeq - tailSeq;
+	toWrap = ((buf_lastEntryIndex - tail) / buf_increment) + 1;
+	if(available > toWrap)
+		available = toWrap;
+	if(available > max)
+		available = max;
+
+	*first = buf + tail;
+	*count = available;
+}
+
+/**
+  * @brief Check that an entry of the current span has not been overwritten
+  *
+  * @param index Index of the entry within the span returned by Buffer_Take_Span()
+  *
+  * @return 1 if the entry is intact, 0 if the producer may have replaced it
+  *
+  * Only needed in replace oldest mode, where the producer keeps writing while
+  * the consumer reads the span in place. Call after copying the entry out of
+  * the buffer memory; a 0 return means the copy may be torn and should be dropped.
+  * The producer writes at most (buf_numSlots - buf_maxCount - 2) entries past the
+  * head (DMA ring / multi IMU bursts in flight), so an entry survives until the
+  * head is more than buf_maxCount + 1 entries past it.
+  */
+uint32_t Buffer_Span_Intact(uint32_t index)
+{
+	if(buf_compress || !buf_replaceOldest)
 	{
-		/*Return pointer to current tail and leave in place for zero entries */
-		buf_addr += buf_tail;
-		g_bufCount = 0;
+		return 1;
 	}
-	/* Update buffer count register */
-	g_regs[BUF_CNT_0_REG] = g_bufCount;
-	g_regs[BUF_CNT_1_REG] = g_regs[BUF_CNT_0_REG];
 
-	/* Exit critical */
-	restore_interrupts(irqs);
+	/* Entry contents must be read before the head is checked */
+	__dmb();
+	return (buf_headSeq - (buf_tailSeq + index)) <= (buf_maxCount + 1);
+}
 
-	/* Return pointer to the buffer entry */
-	return buf_addr;
+/**
+  * @brief Remove entries previously returned by Buffer_Take_Span()
+  *
+  * @param count Number of entries to remove from the buffer tail
+  *
+  * @return void
+  *
+  * The most recently released entry is left intact until the producer
+  * wraps back around to it, so it may still be read from.
+  */
+void Buffer_Release_Span(uint32_t count)
+{
+	uint32_t tailSeq = buf_tailSeq;
+	uint32_t tail = buf_tail;
+
+	if(buf_compress)
+	{
+		CompressedReleaseSpan(count);
+		return;
+	}
+
+	/* Don't move tail past head */
+	if(count > (buf_headSeq - tailSeq))
+		count = buf_headSeq - tailSeq;
+
+	tailSeq += count;
+	tail += count * buf_increment;
+
+	/* Check that buffer tail hasn't wrapped around */
+	if(tail > buf_lastEntryIndex)
+	{
+		/* reset to top of buffer */
+		tail -= (buf_lastEntryIndex + buf_increment);
+	}
+
+	/* Publish new tail to producer */
+	buf_tail = tail;
+	__dmb();
+	buf_tailSeq = tailSeq;
+
+	/* Update buffer count register */
+	UpdateCountRegs(Buffer_Get_Count());
 }
 
 /**
-  * @brief Add an element to the buffer
+  * @brief Get the buffer slot which the next element should be written to
   *
-  * @return Pointer to the new element added to the buffer
+  * @return Pointer to the new element to populate
   *
   * New elements always get added to the head of the buffer, in
-  * both buffer modes. If the buffer is full and ReplaceOldest is set
-  * to true, then the head continues moving through the buffer memory.
-  * If replace oldest is set to false, the head stays still when the
-  * buffer data structure reaches capacity.
+  * both buffer modes. The element is not visible to the consumer until
+  * Buffer_Commit_Element() is called, so it may be filled asynchronously
+  * (e.g. by DMA). If the buffer is full and ReplaceOldest is set
+  * to true, then the head continues moving through the buffer memory,
+  * and the consumer discards the overwritten entries on its next take.
+  * In compressed mode the element is a raw staging entry, which is encoded
+  * into the buffer memory on commit.
   */
 uint8_t* Buffer_Add_Element()
 {
-	uint8_t* buf_addr = buf;
-	if(g_bufCount < buf_maxCount)
+	if(buf_compress)
 	{
-		/* Increment counter */
-		g_bufCount++;
+		return buf_stage[buf_stageIndex];
+	}
 
-		/* Set return pointer to current buffer head */
-		buf_addr += buf_head;
+	/* Return pointer to write buffer value to */
+	return buf + buf_head;
+}
 
-		/* Move buffer head down */
-		buf_head += buf_increment;
+/**
+  * @brief Reserve a buffer element ahead of the current head
+  *
+  * @param ahead Number of elements between the head and the reserved element
+  *
+  * @return Pointer to the reserved element, or NULL if it could not be committed
+  *
+  * Used by DMA ring capture, which has bursts in flight to several elements
+  * at once. The caller must commit the reserved elements in order, and may only
+  * reserve the element after the last non-NULL reservation. In stop mode NULL is
+  * returned if the buffer would be full when this element is committed; the
+  * burst should then be discarded. Not supported in compressed mode.
+  */
+uint8_t* Buffer_Reserve_Element(uint32_t ahead)
+{
+	uint32_t index;
 
-		/* Check if head has wrapped around */
-		if(buf_head > buf_lastEntryIndex)
-		{
-			buf_head = 0;
-		}
+	if(!buf_replaceOldest && ((buf_headSeq + ahead - buf_tailSeq) >= buf_maxCount))
+	{
+		return NULL;
+	}
+
+	index = buf_head + (ahead * buf_increment);
+	while(index > buf_lastEntryIndex)
+	{
+		index -= (buf_lastEntryIndex + buf_increment);
+	}
+	return buf + index;
+}
+
+/**
+  * @brief Publish the element most recently returned by Buffer_Add_Element()
+  *
+  * @return void
+  *
+  * Called from the producer once the buffer entry is fully populated. If
+  * the buffer is full and replace oldest is not set the entry is dropped.
+  */
+void Buffer_Commit_Element()
+{
+	uint32_t headSeq = buf_headSeq;
+
+	if(buf_compress)
+	{
+		CompressedCommit();
+		return;
+	}
+
+	/* Buffer is full, stop adding */
+	if(!buf_replaceOldest && ((headSeq - buf_tailSeq) >= buf_maxCount))
+	{
+		return;
 	}
+
+	/* Move buffer head down */
+	buf_head += buf_increment;
+
+	/* Check if head has wrapped around */
+	if(buf_head > buf_lastEntryIndex)
+	{
+		buf_head = 0;
+	}
+
+	/* Make sure entry contents land before the new head is visible */
+	__dmb();
+	buf_headSeq = headSeq + 1;
+
+	UpdateCountRegs(Buffer_Get_Count());
+}
+
+/**
+  * @brief Calculate a CRC-16-CCITT in software
+  *
+  * @param data Bytes to process
+  *
+  * @param count Number of bytes
+  *
+  * @return CRC (poly 0x1021, seed IMU_CRC_SEED). Same as the DMA sniffer
+  * buffer entry signature, for entries which are modified after capture
+  */
+uint16_t Buffer_Calc_CRC(const uint8_t* data, uint32_t count)
+{
+	uint16_t crc = IMU_CRC_SEED;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		crc = (crc << 4) ^ buf_crcNibble[(crc >> 12) ^ (data[i] >> 4)];
+		crc = (crc << 4) ^ buf_crcNibble[(crc >> 12) ^ (data[i] & 0xF)];
+	}
+	return crc;
+}
+
+/**
+  * @brief Claims all free SRAM for the buffer storage
+  *
+  * @return void
+  *
+  * This function must be called once at boot, before Buffer_Reset(). The free
+  * SRAM is found from the linker heap symbols, and all of it (except for a
+  * BUF_HEAP_RESERVE byte allowance for the C library and USB stack) is allocated
+  * to the buffer. If that fails the request is halved until an allocation succeeds.
+  */
+void Buffer_Init()
+{
+	uint32_t size = (uint32_t) (&__StackLimit - &__end__);
+
+	if(size > (BUF_HEAP_RESERVE + BUF_MIN_SIZE))
+		size -= BUF_HEAP_RESERVE;
 	else
+		size = BUF_MIN_SIZE;
+
+	/* Keep word alignment */
+	size &= ~(0x3);
+
+	buf = malloc(size);
+	while(buf == 0 && size > BUF_MIN_SIZE)
 	{
-		g_bufCount = buf_maxCount;
-		/* Buffer is full */
-		if(buf_replaceOldest)
-		{
-			/* Set head to current tail */
-			buf_head = buf_tail;
-
-			/* Move tail down. Tail should be one entry ahead of head */
-			buf_tail += buf_increment;
-			if(buf_tail > buf_lastEntryIndex)
-			{
-				buf_tail = 0;
-			}
-		}
-		/* Return pointer to head */
-		buf_addr += buf_head;
+		size = (size >> 1) & ~(0x3);
+		buf = malloc(size);
 	}
-	/* Return pointer to write buffer value to */
-	return buf_addr;
+	buf_allocSize = size;
 }
 
 /**
@@ -179,7 +465,8 @@ void Buffer_Reset()
 	/* Reset head/tail and count to 0 */
 	buf_head = 0;
 	buf_tail = 0;
-	g_bufCount = 0;
+	buf_headSeq = 0;
+	buf_tailSeq = 0;
 
 	/* Enforce min/max settings for buffer increment */
 	if(g_regs[BUF_LEN_REG] < BUF_MIN_ENTRY)
@@ -205,22 +492,337 @@ void Buffer_Reset()
 	/* Mask out unused bits in BUF_CONFIG */
 	g_regs[BUF_CONFIG_REG] &= BUF_CFG_MASK;
 
-	/* Get replacement setting */
+	/* Get replacement and compression settings */
 	buf_replaceOldest = (g_regs[BUF_CONFIG_REG] & BUF_CFG_REPLACE_OLDEST);
+	buf_compress = (g_regs[BUF_CONFIG_REG] & BUF_CFG_COMPRESS);
+
+	/* Apply user size cap (in KB, 0 for no cap). The cap can't go below BUF_MIN_SIZE,
+	 * so the slots reserved for in flight entries below always fit */
+	if(g_regs[BUF_MAX_SIZE_REG] != 0 && g_regs[BUF_MAX_SIZE_REG] < (BUF_MIN_SIZE >> 10))
+		g_regs[BUF_MAX_SIZE_REG] = BUF_MIN_SIZE >> 10;
+	buf_size = buf_allocSize;
+	if(g_regs[BUF_MAX_SIZE_REG] != 0 && ((uint32_t) g_regs[BUF_MAX_SIZE_REG] << 10) < buf_size)
+		buf_size = (uint32_t) g_regs[BUF_MAX_SIZE_REG] << 10;
+
+	/* Report usable buffer size (in KB) */
+	g_regs[BUF_SIZE_REG] = buf_size >> 10;
 
 	/* Find max buffer count and index */
-	buf_maxCount = BUF_SIZE / buf_increment;
-	buf_lastEntryIndex = (buf_maxCount - 1) * buf_increment;
+	buf_numSlots = buf_size / buf_increment;
+	buf_lastEntryIndex = (buf_numSlots - 1) * buf_increment;
+
+	/* Reduce max count by 2. One slot is always owned by the producer (being filled by
+	 * the IMU interrupt), and one "empty" space is left between head and tail for the entry
+	 * most recently dequeued. This prevents issues when the buffer is full, user dequeues,
+	 * and the data gets overwritten by the IMU interrupt before it can be retrieved */
+	buf_maxCount = buf_numSlots - 2;
+
+	/* DMA ring capture has up to a full ring of bursts in flight past the head */
+	if(g_regs[BUF_CONFIG_REG] & BUF_CFG_DMA_RING)
+		buf_maxCount -= IMU_DMA_RING_SIZE;
+	/* As does multi IMU capture, with a few samples in flight */
+	else if((g_regs[IMU_DEV_CONFIG_REG] & IMU_DEV_COUNT_MASK) > 1)
+		buf_maxCount -= IMU_MAX_IN_FLIGHT;
+
+	/* Compressed records are variable length, so the count is limited by free space instead */
+	if(buf_compress)
+	{
+		buf_maxCount = 0xFFFF;
+		memset(buf_stage, 0, sizeof(buf_stage));
+		memset(buf_decPrev, 0, sizeof(buf_decPrev));
+		buf_stageIndex = 0;
+		buf_decCount = 0;
+	}
 
-	/* Reduce max count by 1 to allow for one "empty" space between head and tail when the buffer
-	 * is full. This prevents issues when the buffer is full, user dequeues, and the data gets
-	 * overwritten by the IMU interrupt before it can be retrieved */
-	buf_maxCount--;
+	/* Count has to fit in the 16-bit count registers */
+	if(buf_maxCount > 0xFFFF)
+		buf_maxCount = 0xFFFF;
 
 	/* Update buffer count register to 0 */
-	g_regs[BUF_CNT_0_REG] = 0;
-	g_regs[BUF_CNT_1_REG] = 0;
+	UpdateCountRegs(0);
+
+	/* Update buffer max count register. In compressed mode this is the guaranteed
+	 * (worst case record size) capacity */
+	if(buf_compress)
+		g_regs[BUF_MAX_CNT_REG] = buf_size / BUF_MAX_RECORD;
+	else
+		g_regs[BUF_MAX_CNT_REG] = buf_maxCount;
+}
+
+/**
+  * @brief Update the buffer count register mirrors
+  *
+  * @param count The buffer count to report
+  *
+  * @return void
+  */
+static void UpdateCountRegs(uint32_t count)
+{
+	g_regs[BUF_CNT_0_REG] = count;
+	g_regs[BUF_CNT_1_REG] = count;
+
+	/* Watermark / overflow interrupt pins */
+	Dio_Update_Watermark();
+}
+
+/**
+  * @brief Find the contiguous free space available for the next compressed record
+  *
+  * @param head Receives the byte index the next record should be written to
+  *
+  * @return Number of free bytes at head
+  *
+  * One byte is always left unused between head and tail, so that head == tail
+  * means the buffer is empty. If there is not enough space for a worst case record
+  * before the end of the buffer memory, the record goes to the top of the buffer
+  * instead (the producer leaves a zero length marker behind in that case).
+  */
+static uint32_t CompressedFreeSpace(uint32_t* head)
+{
+	uint32_t tail = buf_tail;
+	uint32_t free;
+
+	*head = buf_head;
+	if(tail > *head)
+	{
+		return tail - *head - 1;
+	}
+
+	free = buf_size - *head;
+	if(tail == 0)
+		free--;
+
+	/* Not enough space before the end, wrap if there is space at the top */
+	if(free < BUF_MAX_RECORD && tail > BUF_MAX_RECORD)
+	{
+		*head = 0;
+		free = tail - 1;
+	}
+	return free;
+}
+
+/**
+  * @brief Encode the staged entry into the buffer memory
+  *
+  * @return void
+  *
+  * The staged raw entry is delta encoded against the previous entry. If there
+  * is no space for a worst case record the entry is dropped.
+  */
+static void CompressedCommit()
+{
+	uint32_t head;
+	uint8_t* entry = buf_stage[buf_stageIndex];
+	uint8_t* prev = buf_stage[buf_stageIndex ^ 1];
+
+	if(CompressedFreeSpace(&head) < BUF_MAX_RECORD)
+	{
+		return;
+	}
+
+	/* Place wrap marker if moving back to the top of the buffer */
+	if(head != buf_head)
+	{
+		buf[buf_head] = 0;
+	}
+
+	head += EncodeEntry(entry, prev, buf + head);
+	if(head >= buf_size)
+		head = 0;
+	buf_head = head;
+
+	/* This entry is the delta reference for the next one */
+	buf_stageIndex ^= 1;
+
+	/* Make sure record contents land before the new head is visible */
+	__dmb();
+	buf_headSeq = buf_headSeq + 1;
+
+	UpdateCountRegs(Buffer_Get_Count());
+}
+
+/**
+  * @brief Decode compressed records from the buffer tail
+  *
+  * @param max Maximum number of entries to decode
+  *
+  * @param first Receives a pointer to the first decoded entry
+  *
+  * @param count Receives the number of decoded entries
+  *
+  * @return void
+  */
+static void CompressedTakeSpan(uint32_t max, uint8_t** first, uint32_t* count)
+{
+	uint32_t available = buf_headSeq - buf_tailSeq;
+	uint32_t pos = buf_tail;
+	const uint8_t* prev = buf_decPrev;
+	uint8_t* entry = buf_decode;
 
-	/* Update buffer max count register */
-	g_regs[BUF_MAX_CNT_REG] = buf_maxCount;
+	if(available > BUF_DECODE_ENTRIES)
+		available = BUF_DECODE_ENTRIES;
+	if(available > max)
+		available = max;
+
+	for(uint32_t i = 0; i < available; i++)
+	{
+		/* Zero length marks a wrap to the top of the buffer */
+		if(buf[pos] == 0)
+			pos = 0;
+		pos += DecodeEntry(buf + pos, prev, entry);
+		if(pos >= buf_size)
+			pos = 0;
+		buf_decEnd[i] = pos;
+		prev = entry;
+		entry += buf_increment;
+	}
+	buf_decCount = available;
+
+	*first = buf_decode;
+	*count = available;
+}
+
+/**
+  * @brief Remove entries previously decoded by CompressedTakeSpan()
+  *
+  * @param count Number of entries to remove from the buffer tail
+  *
+  * @return void
+  */
+static void CompressedReleaseSpan(uint32_t count)
+{
+	if(count > buf_decCount)
+		count = buf_decCount;
+	if(count == 0)
+		return;
+
+	/* Last released entry is the delta reference for the next decode */
+	memcpy(buf_decPrev, buf_decode + (count - 1) * buf_increment, buf_increment);
+	buf_decCount = 0;
+
+	/* Publish new tail to producer */
+	buf_tail = buf_decEnd[count - 1];
+	__dmb();
+	buf_tailSeq = buf_tailSeq + count;
+
+	UpdateCountRegs(Buffer_Get_Count());
+}
+
+/**
+  * @brief Delta encode a buffer entry
+  *
+  * @param entry The raw entry to encode
+  *
+  * @param prev The previous raw entry
+  *
+  * @param out Output record. Must have space for BUF_MAX_RECORD bytes
+  *
+  * @return Record length, in bytes
+  *
+  * Record format is a length byte, followed by zig-zag varints of the
+  * difference from the previous entry: UTC timestamp, microsecond timestamp,
+  * then each 16-bit word of the signature and data.
+  */
+static uint32_t EncodeEntry(const uint8_t* entry, const uint8_t* prev, uint8_t* out)
+{
+	const uint32_t* ts = (const uint32_t *) entry;
+	const uint32_t* prevTs = (const uint32_t *) prev;
+	const uint16_t* words = (const uint16_t *) (entry + 8);
+	const uint16_t* prevWords = (const uint16_t *) (prev + 8);
+	uint8_t* pos = out + 1;
+	int32_t delta;
+	int16_t delta16;
+
+	for(int i = 0; i < 2; i++)
+	{
+		delta = (int32_t) (ts[i] - prevTs[i]);
+		pos = PutVarint(pos, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31));
+	}
+
+	/* Signature word, then data words */
+	for(uint32_t i = 0; i <= (g_regs[BUF_LEN_REG] >> 1); i++)
+	{
+		delta16 = (int16_t) (words[i] - prevWords[i]);
+		pos = PutVarint(pos, (uint16_t) (((uint16_t) delta16 << 1) ^ (uint16_t) (delta16 >> 15)));
+	}
+
+	out[0] = pos - out;
+	return out[0];
+}
+
+/**
+  * @brief Decode a delta encoded buffer entry
+  *
+  * @param in The record to decode
+  *
+  * @param prev The previous decoded entry
+  *
+  * @param entry Output raw entry
+  *
+  * @return Record length, in bytes
+  */
+static uint32_t DecodeEntry(const uint8_t* in, const uint8_t* prev, uint8_t* entry)
+{
+	uint32_t* ts = (uint32_t *) entry;
+	const uint32_t* prevTs = (const uint32_t *) prev;
+	uint16_t* words = (uint16_t *) (entry + 8);
+	const uint16_t* prevWords = (const uint16_t *) (prev + 8);
+	const uint8_t* pos = in + 1;
+	uint32_t val;
+
+	for(int i = 0; i < 2; i++)
+	{
+		pos = GetVarint(pos, &val);
+		ts[i] = prevTs[i] + ((val >> 1) ^ -(val & 1));
+	}
+
+	for(uint32_t i = 0; i <= (g_regs[BUF_LEN_REG] >> 1); i++)
+	{
+		pos = GetVarint(pos, &val);
+		words[i] = prevWords[i] + (uint16_t) ((val >> 1) ^ -(val & 1));
+	}
+
+	return in[0];
+}
+
+/**
+  * @brief Write an unsigned LEB128 varint
+  *
+  * @param out Output pointer
+  *
+  * @param val Value to write
+  *
+  * @return Pointer to the byte after the varint
+  */
+static uint8_t* PutVarint(uint8_t* out, uint32_t val)
+{
+	while(val >= 0x80)
+	{
+		*out++ = (val & 0x7F) | 0x80;
+		val >>= 7;
+	}
+	*out++ = val;
+	return out;
+}
+
+/**
+  * @brief Read an unsigned LEB128 varint
+  *
+  * @param in Input pointer
+  *
+  * @param val Receives the value read
+  *
+  * @return Pointer to the byte after the varint
+  */
+static const uint8_t* GetVarint(const uint8_t* in, uint32_t* val)
+{
+	uint32_t shift = 0;
+
+	*val = 0;
+	do
+	{
+		*val |= (uint32_t) (*in & 0x7F) << shift;
+		shift += 7;
+	} while(*in++ & 0x80);
+	return in;
 }
@@ -1,29 +1,221 @@
 #include "pico/stdlib.h"
 #include "reg.h"
 #include "isr.h"
+#include "filter.h"
+#include "integrator.h"
+#include "imu.h"
+#include "timer.h"
+#include "buffer.h"
 #include "hardware/irq.h"
 #include "hardware/gpio.h"
+#include "pico/multicore.h"
 #include "data_capture.h"
 
-#define PIN_DR 0
+/* Commands sent to the capture core through the multicore FIFO */
+#define CAPTURE_CMD_ENABLE		1
+#define CAPTURE_CMD_DISABLE		2
+#define CAPTURE_CMD_RESET_BUFFER	3
+#define CAPTURE_CMD_SPI_CONFIG		4
+
+/* Reply from the capture core once a command (or startup) is complete */
+#define CAPTURE_CMD_ACK			0xACC
 
 static enum gpio_irq_level irq_level;
 
+/* Track if capture is enabled. Only used on the capture core */
+static bool capture_enabled;
+
+/* Local function prototypes */
+static void Capture_Core_Main();
+static void Capture_Enable();
+static void Capture_Disable();
+static void Capture_Reconfigure(void (*apply)());
+
+/**
+  * @brief Starts the capture core (core1)
+  *
+  * @return void
+  *
+  * All of the capture path (DR interrupt, DMA and PIO interrupts, buffer
+  * producer, timestamping) runs on core1, so its latency does not depend
+  * on USB or CLI activity on core0. Core0 controls it through the multicore
+  * FIFO, and reads the captured data through the lock-free sample buffer.
+  * Must be called after IMU_SPI_Init().
+  */
+void Data_Capture_Init()
+{
+	multicore_launch_core1(Capture_Core_Main);
+	multicore_fifo_pop_blocking();
+}
+
+/**
+  * @brief Enables autonomous data capture on the capture core
+  *
+  * @return void
+  *
+  * Blocks until the capture core has applied the change. Does nothing
+  * if capture is already running.
+  */
+void Data_Capture_Enable()
+{
+	multicore_fifo_push_blocking(CAPTURE_CMD_ENABLE);
+	multicore_fifo_pop_blocking();
+}
+
+/**
+  * @brief Disables autonomous data capture on the capture core
+  *
+  * @return void
+  *
+  * Blocks until the capture core has applied the change.
+  */
+void Data_Capture_Disable()
+{
+	multicore_fifo_push_blocking(CAPTURE_CMD_DISABLE);
+	multicore_fifo_pop_blocking();
+}
+
+/**
+  * @brief Resets the sample buffer from the capture core
+  *
+  * @return void
+  *
+  * The buffer producer runs on the capture core, so the buffer can't be
+  * reset (or reallocated for new BUF_CONFIG / BUF_LEN / BUF_MAX_SIZE /
+  * IMU_DEV_CONFIG settings) from core0 while capture is running. Capture is
+  * paused around the reset and resumed if it was enabled. Blocks until done.
+  */
+void Data_Capture_Reset_Buffer()
+{
+	multicore_fifo_push_blocking(CAPTURE_CMD_RESET_BUFFER);
+	multicore_fifo_pop_blocking();
+}
+
+/**
+  * @brief Applies IMU_SPI_CONFIG / IMU_BURST_CONFIG from the capture core
+  *
+  * @return void
+  *
+  * The stall time and SCLK settings are used by bursts in flight on the
+  * capture core, so they are only changed with capture paused. Capture is
+  * resumed (picking up the new burst settings) if it was enabled. Blocks
+  * until done.
+  */
+void Data_Capture_Update_SPI_Config()
+{
+	multicore_fifo_push_blocking(CAPTURE_CMD_SPI_CONFIG);
+	multicore_fifo_pop_blocking();
+}
+
+/**
+  * @brief Capture core main loop
+  *
+  * @return void
+  *
+  * Claims the capture interrupts for core1, then waits for commands. All
+  * capture work happens in interrupt context on this core.
+  */
+static void Capture_Core_Main()
+{
+	uint32_t cmd;
+
+	IMU_DMA_IRQ_Init();
+	multicore_fifo_push_blocking(CAPTURE_CMD_ACK);
+
+	while(true)
+	{
+		if(multicore_fifo_rvalid())
+		{
+			cmd = multicore_fifo_pop_blocking();
+			/* Returning to page 255 from an IMU page re-enables a running capture */
+			if(cmd == CAPTURE_CMD_ENABLE)
+			{
+				if(!capture_enabled)
+					Capture_Enable();
+			}
+			else if(cmd == CAPTURE_CMD_DISABLE)
+				Capture_Disable();
+			else if(cmd == CAPTURE_CMD_RESET_BUFFER)
+				Capture_Reconfigure(Buffer_Reset);
+			else if(cmd == CAPTURE_CMD_SPI_CONFIG)
+				Capture_Reconfigure(IMU_Update_SPI_Config);
+			multicore_fifo_push_blocking(CAPTURE_CMD_ACK);
+		}
+		/* IMU register requests from core0, slotted between bursts */
+		IMU_Service_Queue();
+	}
+}
+
 /**
   * @brief Enables autonomous data capture by enabling DR ISR in NVIC.
   *
   * @return void
   *
   * This function does not configure the interrupt hardware at all. The config
-  * must be performed by UpdateDRConfig prior to calling this function.
+  * must be performed by UpdateDRConfig prior to calling this function. Runs
+  * on the capture core, so the capture interrupts are handled there.
   */
-void Data_Capture_Enable()
+static void Capture_Enable()
 {
+	uint32_t numDevices = g_regs[IMU_DEV_CONFIG_REG] & IMU_DEV_COUNT_MASK;
+
+	capture_enabled = true;
 	if (g_regs[DIO_INPUT_CONFIG_REG] & DR_POLARITY_BITM) {
 		irq_level = GPIO_IRQ_EDGE_RISE;
 	} else {
 		irq_level = GPIO_IRQ_EDGE_FALL;
 	}
+	/* Bursts run at the burst SCLK */
+	IMU_SPI_Set_Burst_Speed(true);
+
+	/* Decimating filter and integrator settings are latched at capture start */
+	Filter_Reset();
+	Integrator_Reset();
+
+	/* Buffer signature is a hardware CRC of the burst unless the legacy sum is selected */
+	IMU_DMA_Enable_CRC(!(g_regs[BUF_CONFIG_REG] & BUF_CFG_SUM_SIG));
+
+	/* Latch the timer on DR edges in hardware, so timestamps don't include interrupt latency */
+	Timer_Start_DR_Stamp(PIN_DR, irq_level == GPIO_IRQ_EDGE_RISE);
+
+	/* Register list capture. DR interrupt queues each list to the PIO register list engine.
+	 * Takes precedence over multi IMU, DMA ring and PIO burst capture (see BUF_CONFIG in reg.h) */
+	if(!(g_regs[BUF_CONFIG_REG] & BUF_CFG_IMU_BURST))
+	{
+		IMU_PIO_Start_RegList();
+		gpio_set_irq_enabled_with_callback(PIN_DR, irq_level, 1, ISR_Start_IMU_Burst);
+		return;
+	}
+
+	/* Multi IMU capture. Each IMU's DR interrupt starts a burst on its own SPI port */
+	if(numDevices > 1 && !(g_regs[BUF_CONFIG_REG] & BUF_CFG_COMPRESS))
+	{
+		ISR_Start_Multi_Capture(numDevices);
+		for(uint32_t dev = 0; dev < numDevices; dev++)
+		{
+			gpio_set_irq_enabled_with_callback(IMU_Get_DR_Pin(dev), irq_level, 1, ISR_Start_Device_Burst);
+		}
+		return;
+	}
+
+	/* DMA ring capture (runs on the PIO burst engine). Not supported with compression.
+	 * Ring timestamps are latched by its own DMA chain */
+	if((g_regs[BUF_CONFIG_REG] & (BUF_CFG_DMA_RING | BUF_CFG_COMPRESS)) == BUF_CFG_DMA_RING)
+	{
+		Timer_Stop_DR_Stamp();
+		ISR_Start_Ring_Capture(irq_level == GPIO_IRQ_EDGE_RISE);
+		return;
+	}
+
+	/* PIO burst engine handles DR itself */
+	if(g_regs[IMU_SPI_CONFIG_REG] & IMU_SPI_PIO_BITM)
+	{
+		ISR_Start_PIO_Capture(irq_level == GPIO_IRQ_EDGE_RISE);
+		/* DR input is now inverted for falling edge triggering */
+		Timer_Start_DR_Stamp(PIN_DR, true);
+		return;
+	}
+
 	/* Enable data ready interrupts */
 	gpio_set_irq_enabled_with_callback(PIN_DR, irq_level, 1, ISR_Start_IMU_Burst);
 }
@@ -34,13 +226,53 @@ void Data_Capture_Enable()
   * @return void
   *
   * This will stop a new capture from starting. A capture in progress
-  * will still run to completion.
+  * will still run to completion, and this waits for it, so the buffer
+  * and SPI ports are idle on return. Runs on the capture core.
   */
-void Data_Capture_Disable()
+static void Capture_Disable()
 {
+	capture_enabled = false;
+
 	/* Capture in progress set to false */
 	g_captureInProgress = 0;
 
-	/* Disable data ready interrupts */
-	gpio_set_irq_enabled_with_callback(PIN_DR, irq_level, 0, ISR_Start_IMU_Burst);
+	/* Disable data ready interrupts (all IMUs) */
+	for(uint32_t dev = 0; dev < IMU_MAX_DEVICES; dev++)
+	{
+		gpio_set_irq_enabled(IMU_Get_DR_Pin(dev), irq_level, 0);
+	}
+	ISR_Stop_Multi_Capture();
+	Timer_Stop_DR_Stamp();
+
+	/* Stop PIO burst engine, DMA ring or register list engine (if running) and return pins to spi0 */
+	ISR_Stop_PIO_Capture();
+	ISR_Stop_Ring_Capture();
+	IMU_PIO_Stop();
+
+	/* Let a burst already in flight land (and commit) at the SCLK it started with */
+	while(IMU_DMA_Is_Busy())
+		tight_loop_contents();
+
+	/* Back to the register access SCLK */
+	IMU_SPI_Set_Burst_Speed(false);
+}
+
+/**
+  * @brief Pause capture, apply a settings change, then resume capture
+  *
+  * @param apply Function which applies the change (buffer reset, SPI config)
+  *
+  * @return void
+  *
+  * Runs on the capture core, so no capture work can overlap the change.
+  */
+static void Capture_Reconfigure(void (*apply)())
+{
+	bool wasEnabled = capture_enabled;
+
+	if(wasEnabled)
+		Capture_Disable();
+	apply();
+	if(wasEnabled)
+		Capture_Enable();
 }
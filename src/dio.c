@@ -0,0 +1,170 @@
+/**
+  * @file dio.c
+  * @brief DIO output pins (watermark, buffer overflow and error interrupts)
+  *
+  * DIO_OUTPUT_CONFIG assigns each interrupt function a set of the DIO1 -
+  * DIO4 pins (active high). The watermark and overflow pins are updated
+  * whenever the buffer count changes (either core, serialised by a hardware
+  * spinlock), the error pin from the main loop. A host can block on a pin edge instead of polling the buffer
+  * count over USB.
+  */
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "reg.h"
+#include "dio.h"
+
+/** GPIO masks for each function */
+static uint32_t Dio_WatermarkPins;
+static uint32_t Dio_OverflowPins;
+static uint32_t Dio_ErrorPins;
+
+/** Guards the watermark state and pins, updated from both cores */
+static spin_lock_t* Dio_Lock;
+
+/** Track if the buffer count was at or above the watermark on the last update */
+static volatile bool Dio_AboveWatermark;
+
+/** Watermark pulse in progress, and when it started (time_us_32) */
+static volatile bool Dio_Pulsing;
+static volatile uint32_t Dio_PulseStart;
+
+/**
+  * @brief Convert a DIO_OUTPUT_CONFIG function field to a GPIO mask
+  *
+  * @param field DIO1 - DIO4 pin mask
+  *
+  * @return GPIO mask
+  */
+static uint32_t FieldToPins(uint32_t field)
+{
+	return (field & DIO_FUNC_MASK) << DIO1_PIN;
+}
+
+/**
+  * @brief Set up the DIO output pins
+  *
+  * @return void
+  *
+  * Must run before the first Buffer_Reset(), since count updates drive the pins.
+  */
+void Dio_Init()
+{
+	Dio_Lock = spin_lock_init(spin_lock_claim_unused(true));
+	for(uint32_t dio = 0; dio < DIO_NUM_PINS; dio++)
+	{
+		gpio_init(DIO1_PIN + dio);
+		gpio_set_dir(DIO1_PIN + dio, GPIO_OUT);
+		gpio_put(DIO1_PIN + dio, 0);
+	}
+	Dio_Update_Config();
+}
+
+/**
+  * @brief Apply DIO_OUTPUT_CONFIG
+  *
+  * @return void
+  *
+  * A pin assigned to more than one function is driven by the highest
+  * priority one (error, then overflow, then watermark). Called from the
+  * main loop when DIO_OUTPUT_CONFIG is written.
+  */
+void Dio_Update_Config()
+{
+	uint32_t config = g_regs[DIO_OUTPUT_CONFIG_REG];
+	uint32_t irq;
+
+	irq = spin_lock_blocking(Dio_Lock);
+	Dio_ErrorPins = FieldToPins(config >> DIO_ERROR_BITP);
+	Dio_OverflowPins = FieldToPins(config >> DIO_OVERFLOW_BITP) & ~Dio_ErrorPins;
+	Dio_WatermarkPins = FieldToPins(config >> DIO_WATERMARK_BITP) & ~(Dio_ErrorPins | Dio_OverflowPins);
+
+	/* Start from idle, then pick up the current state */
+	gpio_clr_mask(FieldToPins(DIO_FUNC_MASK));
+	Dio_AboveWatermark = false;
+	Dio_Pulsing = false;
+	spin_unlock(Dio_Lock, irq);
+
+	Dio_Update_Watermark();
+	Dio_Service();
+}
+
+/**
+  * @brief Update the watermark and overflow pins for a new buffer count
+  *
+  * @return void
+  *
+  * Called by the buffer whenever the count changes, from the capture core
+  * (producer) or the main loop (consumer), after BUF_CNT is written. The
+  * count is read under the lock, so whichever core updates last leaves the
+  * pins matching the final BUF_CNT. In level mode the watermark
+  * pins are set while count is at or above the WATERMARK_INT_CONFIG level.
+  * In pulse mode they pulse for DIO_PULSE_US when the count reaches it.
+  */
+void Dio_Update_Watermark()
+{
+	uint32_t config = g_regs[WATERMARK_INT_CONFIG_REG];
+	uint32_t level = config & ~WATERMARK_PULSE_MASK;
+	uint32_t count, irq;
+	bool above;
+
+	/* Min. watermark is 1, same as the CLI stream */
+	if(level == 0)
+		level = 1;
+
+	irq = spin_lock_blocking(Dio_Lock);
+	count = g_regs[BUF_CNT_0_REG];
+	above = (count >= level);
+
+	if(config & WATERMARK_PULSE_MASK)
+	{
+		if(above && !Dio_AboveWatermark)
+		{
+			Dio_PulseStart = time_us_32();
+			Dio_Pulsing = true;
+			gpio_set_mask(Dio_WatermarkPins);
+		}
+	}
+	else if(above)
+	{
+		gpio_set_mask(Dio_WatermarkPins);
+	}
+	else
+	{
+		gpio_clr_mask(Dio_WatermarkPins);
+	}
+	Dio_AboveWatermark = above;
+
+	if(count >= g_regs[BUF_MAX_CNT_REG])
+		gpio_set_mask(Dio_OverflowPins);
+	else
+		gpio_clr_mask(Dio_OverflowPins);
+	spin_unlock(Dio_Lock, irq);
+}
+
+/**
+  * @brief Update the error pins and end watermark pulses
+  *
+  * @return void
+  *
+  * The error pins are set while any STATUS bit selected by
+  * ERROR_INT_CONFIG is set. This function should be called
+  * periodically from the main loop.
+  */
+void Dio_Service()
+{
+	uint32_t irq;
+
+	if(g_regs[STATUS_0_REG] & g_regs[ERROR_INT_CONFIG_REG])
+		gpio_set_mask(Dio_ErrorPins);
+	else
+		gpio_clr_mask(Dio_ErrorPins);
+
+	irq = spin_lock_blocking(Dio_Lock);
+	if(Dio_Pulsing && ((time_us_32() - Dio_PulseStart) >= DIO_PULSE_US))
+	{
+		Dio_Pulsing = false;
+		gpio_clr_mask(Dio_WatermarkPins);
+	}
+	spin_unlock(Dio_Lock, irq);
+}
@@ -0,0 +1,163 @@
+/**
+  * @file filter.c
+  * @brief Decimating filter for captured IMU samples
+  *
+  * Runs on the capture core, between the burst completing and the buffer
+  * entry being committed. Every sample goes through the filter, and only
+  * every FILT_CONFIG ratio-th sample is stored, with the filter output in
+  * place of the raw gyro and accel words. Everything is fixed point.
+  */
+
+#include "reg.h"
+#include "filter.h"
+
+/** Decimation ratio (0 when the filter is off) */
+static uint32_t Filt_Ratio;
+
+/** Samples since the last output */
+static uint32_t Filt_Count;
+
+/** FIR length (0 for boxcar) and taps, Q15 */
+static uint32_t Filt_NumTaps;
+static int32_t Filt_Taps[FILT_MAX_TAPS];
+
+/** First filtered data word */
+static uint32_t Filt_FirstWord;
+
+/** Boxcar sums since the last output */
+static int32_t Filt_Sum[FILT_WORDS];
+
+/** FIR sample history (ring, Filt_Pos is the next slot written) */
+static int16_t Filt_History[FILT_MAX_TAPS][FILT_WORDS];
+static uint32_t Filt_Pos;
+
+/** Samples in the FIR history, up to Filt_NumTaps */
+static uint32_t Filt_Fill;
+
+/**
+  * @brief Load the filter settings from FILT_CONFIG and FILT_COEF_x and clear its state
+  *
+  * @return void
+  *
+  * Called when capture starts.
+  */
+void Filter_Reset()
+{
+	uint32_t config = g_regs[FILT_CONFIG_REG];
+	uint32_t half = (config & FILT_TAPS_MASK) >> FILT_TAPS_BITP;
+
+	Filt_Ratio = config & FILT_RATIO_MASK;
+	if(Filt_Ratio < 2)
+		Filt_Ratio = 0;
+
+	/* FILT_CONFIG drives the integrator instead */
+	if(g_regs[BUF_CONFIG_REG] & BUF_CFG_INTEGRATE)
+		Filt_Ratio = 0;
+
+	/* Filtered words must fit in the buffer entry */
+	Filt_FirstWord = (config & FILT_WORD_MASK) >> FILT_WORD_BITP;
+	if((Filt_FirstWord + FILT_WORDS) > (g_regs[BUF_LEN_REG] / 2))
+		Filt_Ratio = 0;
+
+	if(half > FILT_MAX_HALF)
+		half = FILT_MAX_HALF;
+	Filt_NumTaps = half ? (2 * half - 1) : 0;
+
+	/* Symmetric taps, FILT_COEF_0 in the center */
+	for(uint32_t i = 0; i < half; i++)
+	{
+		int32_t coef = (int16_t) g_regs[FILT_COEF_0_REG + i];
+		Filt_Taps[half - 1 + i] = coef;
+		Filt_Taps[half - 1 - i] = coef;
+	}
+
+	Filt_Count = 0;
+	Filt_Pos = 0;
+	Filt_Fill = 0;
+	for(uint32_t word = 0; word < FILT_WORDS; word++)
+	{
+		Filt_Sum[word] = 0;
+	}
+}
+
+/**
+  * @brief Check if the decimating filter is running
+  *
+  * @return true if samples go through Filter_Process
+  */
+bool Filter_Is_Enabled()
+{
+	return Filt_Ratio != 0;
+}
+
+/**
+  * @brief Run one captured sample through the filter
+  *
+  * @param data Buffer entry data words (after the timestamp and signature)
+  *
+  * @return true if this sample is a decimated output. The filtered words in
+  * data have been replaced with the filter output, and the entry should be
+  * stored. Otherwise the entry should be discarded.
+  *
+  * The boxcar output is the average of the ratio samples since the previous
+  * output (a first order CIC). The FIR output is computed only at output
+  * samples, from the last FIR length samples. Output is saturated to 16 bits.
+  */
+bool Filter_Process(uint16_t* data)
+{
+	int16_t* sample = (int16_t *) &data[Filt_FirstWord];
+	int32_t out;
+
+	if(Filt_NumTaps)
+	{
+		for(uint32_t word = 0; word < FILT_WORDS; word++)
+		{
+			Filt_History[Filt_Pos][word] = sample[word];
+		}
+		Filt_Pos = (Filt_Pos + 1) % Filt_NumTaps;
+		if(Filt_Fill < Filt_NumTaps)
+			Filt_Fill++;
+	}
+	else
+	{
+		for(uint32_t word = 0; word < FILT_WORDS; word++)
+		{
+			Filt_Sum[word] += sample[word];
+		}
+	}
+
+	Filt_Count++;
+	if(Filt_Count < Filt_Ratio)
+		return false;
+	Filt_Count = 0;
+
+	/* Let the FIR history fill before the first output */
+	if(Filt_NumTaps && (Filt_Fill < Filt_NumTaps))
+		return false;
+
+	for(uint32_t word = 0; word < FILT_WORDS; word++)
+	{
+		if(Filt_NumTaps)
+		{
+			int64_t acc = 0;
+			/* Filt_Pos is the oldest sample */
+			for(uint32_t tap = 0; tap < Filt_NumTaps; tap++)
+			{
+				acc += (int64_t) Filt_Taps[tap] * Filt_History[(Filt_Pos + tap) % Filt_NumTaps][word];
+			}
+			out = (int32_t) (acc >> 15);
+		}
+		else
+		{
+			out = Filt_Sum[word] / (int32_t) Filt_Ratio;
+			Filt_Sum[word] = 0;
+		}
+
+		if(out > INT16_MAX)
+			out = INT16_MAX;
+		if(out < INT16_MIN)
+			out = INT16_MIN;
+		sample[word] = out;
+	}
+	return true;
+}
@@ -2,7 +2,10 @@
 #include "hardware/spi.h"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/sync.h"
 #include "imu.h"
+#include "imu_burst.pio.h"
 #include "reg.h"
 #include "isr.h"
 
@@ -15,10 +18,71 @@
 #define PIN_TX   3
 #define PIN_RST  6
 
-/* Microseconds to stall after chip select. Seems like it should be 16 */
-static uint32_t stall_time = 20;
+/* Second SPI port (IMU 1) */
+#define SPI1_PORT spi1
 
-void IMU_DMA_Finish_Burst();
+#define PIN1_RX   12
+#define PIN1_CS   13
+#define PIN1_SCLK 10
+#define PIN1_TX   11
+#define PIN1_RST  14
+#define PIN1_DR   15
+
+/* IMU 2 shares the first SPI port */
+#define PIN2_CS   5
+#define PIN2_RST  7
+#define PIN2_DR   8
+
+/** SPI port and pins for one IMU */
+typedef struct {
+    spi_inst_t *spi;
+    uint port;
+    uint cs;
+    uint rst;
+    uint dr;
+} imu_device_t;
+
+static const imu_device_t imu_devices[IMU_MAX_DEVICES] = {
+    {SPI_PORT,  0, PIN_CS,  PIN_RST,  PIN_DR},
+    {SPI1_PORT, 1, PIN1_CS, PIN1_RST, PIN1_DR},
+    {SPI_PORT,  0, PIN2_CS, PIN2_RST, PIN2_DR},
+};
+
+/* IMU accessed by register reads/writes */
+static uint32_t imu_selected = 0;
+
+/* Microseconds to stall between register access transactions (IMU_SPI_CONFIG) */
+static uint32_t stall_time = 16;
+
+/* SCLK for register access and burst reads (IMU_SPI_CONFIG / IMU_BURST_CONFIG) */
+static uint32_t reg_sclk_hz = 1000*1000;
+static uint32_t burst_sclk_hz = 1000*1000;
+
+/* Earliest time the next register access frame may start (end of stall) */
+static absolute_time_t spi_ready_time;
+
+/* Track if the SPI ports are running at the burst SCLK (capture running) */
+static volatile bool imu_burst_speed = false;
+
+/* Register transfer queue. Filled by core0, serviced by the capture core */
+static imu_xfer_t *xfer_queue[IMU_XFER_QUEUE_SIZE];
+static volatile uint32_t xfer_head = 0;
+static volatile uint32_t xfer_tail = 0;
+
+/* Per SPI port: capture bursts seen (port is gated), burst just finished, and
+ * when the gap after it may be used (end of stall) */
+static bool spi_gated[2] = {false, false};
+static volatile bool spi_gap[2] = {false, false};
+static absolute_time_t spi_gap_time[2];
+
+/* Per SPI port: when the last capture burst started, and the measured data
+ * ready period (0 until known). Used to fit several transfers into one gap */
+static volatile uint32_t spi_burst_start[2] = {0, 0};
+static volatile uint32_t spi_dr_period[2] = {0, 0};
+
+void IMU_DMA_Finish_Burst(uint port);
+static bool IMU_Queue_Transfer(imu_xfer_t *xfer);
+static void IMU_Track_Burst_Start(uint port);
 
 static dma_channel_config dma_rx_config;
 static uint dma_rx;
@@ -26,73 +90,131 @@ static uint dma_rx;
 static dma_channel_config dma_tx_config;
 static uint dma_tx;
 
-static bool dma_done = false;
+/* Track if one of the TX/RX channels has finished, per SPI port */
+static bool dma_done[2] = {false, false};
+
+/* Second SPI port burst DMA channels */
+static dma_channel_config dma1_rx_config;
+static uint dma1_rx;
+
+static dma_channel_config dma1_tx_config;
+static uint dma1_tx;
+
+/* IMU using each SPI port's burst DMA, or -1 if idle */
+static volatile int port_dev[2] = {-1, -1};
+
+/* Track if the DMA sniffer computes a CRC of each burst */
+static bool dma_crc = false;
 
-static inline void spi_select() {
-    gpio_put(PIN_CS, 0);
+/* PIO burst engine state machine and DMA configs */
+static PIO imu_pio = pio0;
+static uint imu_sm;
+static uint imu_pio_offset;
+static uint imu_reglist_offset;
+static bool imu_pio_running = false;
+
+static dma_channel_config dma_pio_rx_config;
+static dma_channel_config dma_pio_tx_config;
+
+/* Autonomous DMA ring capture channels and state */
+static uint dma_rx_ctrl;
+static uint dma_tx_reload;
+static uint dma_ts;
+static uint dma_crc_copy;
+static uint dma_crc_seed;
+static bool dma_ring_running = false;
+static uint imu_count_sm;
+static uint imu_count_offset;
+
+/* TX channel read address, rewritten by dma_tx_reload after every burst */
+static uint32_t tx_reload_addr;
+
+/* Sniffer seed, written by dma_crc_seed after every burst */
+static const uint32_t crc_seed = IMU_CRC_SEED;
+
+static inline void spi_select(uint cs) {
+    gpio_put(cs, 0);
 }
 
-static inline void spi_deselect() {
-    gpio_put(PIN_CS, 1);
+static inline void spi_deselect(uint cs) {
+    gpio_put(cs, 1);
 }
 
-static void dma_rx_callback()
+/* Track TX/RX completion for a port, finish the burst once both are done */
+static void dma_port_done(uint port)
 {
-    /* Clear the interrupt */
-    dma_hw->ints0 = 1u << dma_rx;
-
-    /* Clear interrupt enable */
-    irq_clear(DMA_IRQ_0);
-
     /* Check if both interrupts complete */
-    if(dma_done == 0)
+    if(dma_done[port] == 0)
     {
-        dma_done = 1;
+        dma_done[port] = 1;
     }
     else
     {
         /* Both are done */
-        IMU_DMA_Finish_Burst();
+        IMU_DMA_Finish_Burst(port);
     }
 }
 
+static void dma_rx_callback()
+{
+    uint32_t ints = dma_hw->ints0;
+
+    /* Clear the interrupt */
+    dma_hw->ints0 = ints & ((1u << dma_rx) | (1u << dma1_rx));
+
+    /* Clear interrupt enable */
+    irq_clear(DMA_IRQ_0);
+
+    if(ints & (1u << dma_rx))
+        dma_port_done(0);
+    if(ints & (1u << dma1_rx))
+        dma_port_done(1);
+}
+
 static void dma_tx_callback()
 {
+    uint32_t ints = dma_hw->ints1;
+
     /* Clear the interrupt */
-    dma_hw->ints1 = 1u << dma_tx;
+    dma_hw->ints1 = ints & ((1u << dma_tx) | (1u << dma1_tx));
 
     /* Clear interrupt enable */
     irq_clear(DMA_IRQ_1);
 
-    /* Check if both interrupts complete */
-    if(dma_done == 0)
-    {
-        dma_done = 1;
-    }
-    else
-    {
-        /* Both are done */
-        IMU_DMA_Finish_Burst();
-    }
+    if(ints & (1u << dma_tx))
+        dma_port_done(0);
+    if(ints & (1u << dma1_tx))
+        dma_port_done(1);
 }
 
 void IMU_SPI_Init() {
     /* Use SPI at 1MHz */
-    spi_init(SPI_PORT, 1000*1000);
+    spi_init(SPI_PORT, reg_sclk_hz);
     gpio_set_function(PIN_RX,   GPIO_FUNC_SPI);
     gpio_set_function(PIN_SCLK, GPIO_FUNC_SPI);
     gpio_set_function(PIN_TX,   GPIO_FUNC_SPI);
 
     spi_set_format(SPI_PORT, 16, 1, 1, SPI_MSB_FIRST);
 
+    /* Second port, for multi IMU captures */
+    spi_init(SPI1_PORT, reg_sclk_hz);
+    gpio_set_function(PIN1_RX,   GPIO_FUNC_SPI);
+    gpio_set_function(PIN1_SCLK, GPIO_FUNC_SPI);
+    gpio_set_function(PIN1_TX,   GPIO_FUNC_SPI);
+
+    spi_set_format(SPI1_PORT, 16, 1, 1, SPI_MSB_FIRST);
+
     /* Chip select and reset are active-low, so we initialise them to a driven-high state */
-    gpio_init(PIN_CS);
-    gpio_set_dir(PIN_CS, GPIO_OUT);
-    gpio_put(PIN_CS, 1);
+    for(uint dev = 0; dev < IMU_MAX_DEVICES; dev++)
+    {
+        gpio_init(imu_devices[dev].cs);
+        gpio_set_dir(imu_devices[dev].cs, GPIO_OUT);
+        gpio_put(imu_devices[dev].cs, 1);
 
-    gpio_init(PIN_RST);
-    gpio_set_dir(PIN_RST, GPIO_OUT);
-    gpio_put(PIN_RST, 1);
+        gpio_init(imu_devices[dev].rst);
+        gpio_set_dir(imu_devices[dev].rst, GPIO_OUT);
+        gpio_put(imu_devices[dev].rst, 1);
+    }
 
     dma_tx = dma_claim_unused_channel(true);
     dma_rx = dma_claim_unused_channel(true);
@@ -117,34 +239,102 @@ void IMU_SPI_Init() {
     channel_config_set_read_increment(&dma_rx_config, false);
     channel_config_set_write_increment(&dma_rx_config, true);
 
+    /* Same configs for the second port, paced by its FIFOs */
+    dma1_tx = dma_claim_unused_channel(true);
+    dma1_rx = dma_claim_unused_channel(true);
+    dma1_tx_config = dma_tx_config;
+    channel_config_set_chain_to(&dma1_tx_config, dma1_tx);
+    channel_config_set_dreq(&dma1_tx_config, spi_get_dreq(SPI1_PORT, true));
+    dma1_rx_config = dma_rx_config;
+    channel_config_set_chain_to(&dma1_rx_config, dma1_rx);
+    channel_config_set_dreq(&dma1_rx_config, spi_get_dreq(SPI1_PORT, false));
+
+    /* Let the sniffer see RX data. It only computes anything once enabled by IMU_DMA_Enable_CRC */
+    channel_config_set_sniff_enable(&dma_rx_config, true);
+
+    /* Load the PIO burst engine. It is only started when selected in IMU_SPI_CONFIG */
+    imu_pio_offset = pio_add_program(imu_pio, &imu_burst_program);
+    imu_sm = pio_claim_unused_sm(imu_pio, true);
+
+    /* Register list engine runs on the same state machine, for non-burst captures */
+    imu_reglist_offset = pio_add_program(imu_pio, &imu_reglist_program);
+
+    /* Same as the SPI DMA configs, but paced by the PIO FIFOs */
+    dma_pio_tx_config = dma_tx_config;
+    channel_config_set_dreq(&dma_pio_tx_config, pio_get_dreq(imu_pio, imu_sm, true));
+    dma_pio_rx_config = dma_rx_config;
+    channel_config_set_dreq(&dma_pio_rx_config, pio_get_dreq(imu_pio, imu_sm, false));
+
+    /* Control channels for autonomous ring capture */
+    dma_rx_ctrl = dma_claim_unused_channel(true);
+    dma_tx_reload = dma_claim_unused_channel(true);
+    dma_ts = dma_claim_unused_channel(true);
+    dma_crc_copy = dma_claim_unused_channel(true);
+    dma_crc_seed = dma_claim_unused_channel(true);
+
+    /* Burst counter for ring capture watermark interrupts */
+    imu_count_offset = pio_add_program(imu_pio, &imu_burst_count_program);
+    imu_count_sm = pio_claim_unused_sm(imu_pio, true);
+}
+
+/**
+  * @brief Set up the burst DMA completion interrupts
+  *
+  * @return void
+  *
+  * Interrupts are handled by the core which enables them, so this must be
+  * called from the capture core.
+  */
+void IMU_DMA_IRQ_Init() {
     /* Tell the DMA to raise IRQ line 0 when the channel finishes a block */
     dma_channel_set_irq0_enabled(dma_rx, true);
+    dma_channel_set_irq0_enabled(dma1_rx, true);
     /* Call dma_rx_callback when DMA IRQ 0 is asserted */
     irq_set_exclusive_handler(DMA_IRQ_0, dma_rx_callback);
     irq_set_enabled(DMA_IRQ_0, true);
 
     /* Tell the DMA to raise IRQ line 1 when the channel finishes a block */
     dma_channel_set_irq1_enabled(dma_tx, true);
+    dma_channel_set_irq1_enabled(dma1_tx, true);
     /* Call dma_tx_callback when DMA IRQ 1 is asserted */
     irq_set_exclusive_handler(DMA_IRQ_1, dma_tx_callback);
     irq_set_enabled(DMA_IRQ_1, true);
-
 }
 
-uint16_t IMU_SPI_Transfer(uint16_t msg) {
-    uint16_t res = 0;
+/**
+  * @brief Run one 16 bit SPI frame on the selected IMU
+  *
+  * @param dev IMU to access
+  *
+  * @param msg Word to send
+  *
+  * @return Word received (the response to the previous frame)
+  *
+  * The stall after each frame is timed against the hardware timer from CS
+  * deassert, so any work done between frames overlaps with the stall.
+  */
+static uint16_t spi_frame(const imu_device_t *dev, uint16_t msg) {
+    uint16_t res;
 
-    spi_select();
-    spi_write16_blocking(SPI_PORT, &msg, 1);
-    spi_deselect();
+    busy_wait_until(spi_ready_time);
 
-    sleep_us(stall_time);
+    spi_select(dev->cs);
+    spi_write16_read16_blocking(dev->spi, &msg, &res, 1);
+    spi_deselect(dev->cs);
+
+    spi_ready_time = make_timeout_time_us(stall_time);
+    return res;
+}
 
-    spi_select();
-    spi_read16_blocking(SPI_PORT, 0, &res, 1);
-    spi_deselect();
+uint16_t IMU_SPI_Transfer(uint16_t msg) {
+    uint16_t res;
+    const imu_device_t *dev = &imu_devices[imu_selected];
 
-    sleep_us(stall_time);
+    spi_frame(dev, msg);
+    res = spi_frame(dev, 0);
+
+    /* Leave the bus idle for a full stall */
+    busy_wait_until(spi_ready_time);
 
     return res;
 }
@@ -157,6 +347,39 @@ uint16_t IMU_Read_Register(uint8_t RegAddr) {
     return IMU_SPI_Transfer(msg);
 }
 
+/**
+  * @brief Read a list of registers from the selected IMU
+  *
+  * @param RegAddrs Register addresses to read
+  *
+  * @param Values Output for the register values, in the same order
+  *
+  * @param Count Number of registers to read
+  *
+  * @return void
+  *
+  * Pipelined: each frame sends the next read request while clocking out the
+  * result of the previous one, so N reads take N + 1 frames instead of 2N.
+  */
+void IMU_Read_Registers(const uint8_t *RegAddrs, uint16_t *Values, uint32_t Count) {
+    const imu_device_t *dev = &imu_devices[imu_selected];
+    uint16_t msg;
+
+    if(Count == 0)
+        return;
+
+    spi_frame(dev, (((uint16_t)RegAddrs[0]) << 8) & 0x7FFF);
+    for(uint32_t i = 1; i <= Count; i++)
+    {
+        /* Final frame only clocks out the last result */
+        msg = (i < Count) ? ((((uint16_t)RegAddrs[i]) << 8) & 0x7FFF) : 0;
+        Values[i - 1] = spi_frame(dev, msg);
+    }
+
+    /* Leave the bus idle for a full stall */
+    busy_wait_until(spi_ready_time);
+}
+
 uint16_t IMU_Write_Register(uint8_t RegAddr, uint8_t RegValue) {
     /* Write a 1 to the R/W bit, the address to the next seven bits,
      * and the new value to the last 8 bits */
@@ -165,17 +388,518 @@ uint16_t IMU_Write_Register(uint8_t RegAddr, uint8_t RegValue) {
     return IMU_SPI_Transfer(msg);
 }
 
+/**
+  * @brief Queue a register read on the selected IMU
+  *
+  * @param xfer Transfer to queue. Must stay valid until its status is no longer pending
+  *
+  * @param RegAddr Register address to read
+  *
+  * @return false if the queue is full
+  */
+bool IMU_Queue_Read(imu_xfer_t *xfer, uint8_t RegAddr) {
+    xfer->msg = (((uint16_t)RegAddr) << 8) & 0x7FFF;
+    return IMU_Queue_Transfer(xfer);
+}
+
+/**
+  * @brief Queue a register write on the selected IMU
+  *
+  * @param xfer Transfer to queue. Must stay valid until its status is no longer pending
+  *
+  * @param RegAddr Register address to write
+  *
+  * @param RegValue Value to write
+  *
+  * @return false if the queue is full
+  */
+bool IMU_Queue_Write(imu_xfer_t *xfer, uint8_t RegAddr, uint8_t RegValue) {
+    xfer->msg = (0x8000 | (((uint16_t)RegAddr) << 8) | RegValue);
+    return IMU_Queue_Transfer(xfer);
+}
+
+/**
+  * @brief Add a transfer to the register transfer queue (single producer, core0)
+  *
+  * @param xfer Transfer to queue, with msg filled in
+  *
+  * @return false if the queue is full
+  */
+static bool IMU_Queue_Transfer(imu_xfer_t *xfer) {
+    if((xfer_head - xfer_tail) >= IMU_XFER_QUEUE_SIZE)
+        return false;
+
+    xfer->dev = imu_selected;
+    xfer->status = IMU_XFER_PENDING;
+    xfer_queue[xfer_head & (IMU_XFER_QUEUE_SIZE - 1)] = xfer;
+    /* Entry must be visible before the head moves */
+    __dmb();
+    xfer_head++;
+    return true;
+}
+
+/**
+  * @brief Hand a finished transfer back to its owner
+  *
+  * @param xfer Transfer
+  *
+  * @param result Response word
+  *
+  * @param status IMU_XFER_DONE, IMU_XFER_ERROR or IMU_XFER_BLOCKED
+  *
+  * @return void
+  */
+static void xfer_complete(imu_xfer_t *xfer, uint16_t result, uint32_t status) {
+    /* The owner may reuse xfer as soon as status changes */
+    imu_xfer_callback_t callback = xfer->callback;
+
+    xfer->result = result;
+    __dmb();
+    xfer->status = status;
+    if(callback)
+        callback(xfer);
+}
+
+/**
+  * @brief Run queued register transfers
+  *
+  * @return void
+  *
+  * Called from the capture core loop. Each transfer is a request frame and a
+  * response frame, run back to back with interrupts held off so a data ready
+  * edge can't start a burst until both frames and the trailing stall are done.
+  * Nothing is left in flight between calls, so a burst never clocks out a
+  * queued register response. While capture bursts are running on an SPI port,
+  * transfers on that port only go out in the gap right after a burst finishes
+  * (plus the stall). Once the data ready period is known, further transfers
+  * run in the same gap while they fit before the next burst is due. Requests
+  * to IMUs on a port owned by a PIO capture engine complete as IMU_XFER_BLOCKED.
+  */
+void IMU_Service_Queue() {
+    imu_xfer_t *xfer;
+    const imu_device_t *dev;
+    uint16_t res;
+    uint32_t irq, timeout, xfer_us, due;
+    uint port;
+    int gap_port = -1;
+    bool gated;
+
+    /* Two frames at the register SCLK, each followed by a stall */
+    xfer_us = (32 * 1000000) / reg_sclk_hz + 2 * stall_time;
+
+    while(xfer_tail != xfer_head)
+    {
+        xfer = xfer_queue[xfer_tail & (IMU_XFER_QUEUE_SIZE - 1)];
+        dev = &imu_devices[xfer->dev];
+        port = dev->port;
+
+        /* PIO capture engines own the spi0 pins */
+        if(imu_pio_running && port == 0)
+        {
+            xfer_tail++;
+            xfer_complete(xfer, 0, IMU_XFER_BLOCKED);
+            continue;
+        }
+
+        gated = imu_burst_speed && spi_gated[port];
+        if(gated)
+        {
+            if(gap_port < 0)
+            {
+                if(!spi_gap[port])
+                {
+                    /* Bursts stopped (DR lost), stop waiting for gaps */
+                    timeout = 2 * spi_dr_period[port];
+                    if(timeout == 0 || timeout > IMU_XFER_GAP_TIMEOUT_US)
+                        timeout = IMU_XFER_GAP_TIMEOUT_US;
+                    if(absolute_time_diff_us(spi_gap_time[port], get_absolute_time()) > timeout)
+                        spi_gated[port] = false;
+                    return;
+                }
+                busy_wait_until(spi_gap_time[port]);
+                gap_port = port;
+            }
+            else
+            {
+                /* Only keep going in this gap while the transfer fits before the next burst */
+                due = spi_burst_start[port] + spi_dr_period[port] - IMU_XFER_GAP_MARGIN_US;
+                if(port != (uint) gap_port || spi_dr_period[port] == 0 ||
+                   (int32_t)(due - time_us_32()) < (int32_t) xfer_us)
+                    return;
+            }
+        }
+
+        irq = save_and_disable_interrupts();
+        /* Burst running (or started while waiting out the stall) on this port */
+        if(port_dev[port] >= 0)
+        {
+            restore_interrupts(irq);
+            return;
+        }
+        if(imu_burst_speed)
+            spi_set_baudrate(dev->spi, reg_sclk_hz);
+        spi_frame(dev, xfer->msg);
+        res = spi_frame(dev, 0);
+        if(imu_burst_speed)
+            spi_set_baudrate(dev->spi, burst_sclk_hz);
+        /* Hold off the next burst until CS has been high for a full stall */
+        busy_wait_until(spi_ready_time);
+        spi_gap[port] = false;
+        restore_interrupts(irq);
+
+        xfer_tail++;
+        xfer_complete(xfer, res, IMU_XFER_DONE);
+    }
+}
+
+/**
+  * @brief Check if register transfers to the selected IMU are blocked
+  *
+  * @return true while a PIO capture engine owns the selected IMU's SPI port
+  *
+  * The register list, PIO burst and DMA ring capture modes run spi0 from a
+  * PIO state machine, which leaves no gaps for queued register transfers.
+  */
+bool IMU_Queue_Blocked() {
+    return imu_pio_running && (imu_devices[imu_selected].port == 0);
+}
+
+/**
+  * @brief Track the data ready period on an SPI port as capture bursts start
+  *
+  * @param port SPI port the burst is starting on
+  *
+  * @return void
+  *
+  * Called from the burst start paths (interrupt context). Intervals where a
+  * data ready edge was missed are skipped, and the estimate leans towards
+  * the shortest interval seen so gap transfers never run into a burst.
+  */
+static void IMU_Track_Burst_Start(uint port) {
+    uint32_t now = time_us_32();
+    uint32_t interval = now - spi_burst_start[port];
+    uint32_t period = spi_dr_period[port];
+
+    /* Gated once a burst has finished on this port since capture started */
+    if(spi_gated[port] && (period == 0 || interval < 2 * period))
+    {
+        if(period == 0 || interval < period)
+            period = interval;
+        else
+            period += (interval - period) >> 4;
+        spi_dr_period[port] = period;
+    }
+    spi_burst_start[port] = now;
+}
+
+/**
+  * @brief Check if a capture is running (SPI ports at burst SCLK)
+  *
+  * @return true while capture is running
+  */
+bool IMU_SPI_Is_Capturing() {
+    return imu_burst_speed;
+}
+
+/* Resets all IMUs at once */
 void IMU_Reset() {
     /* Reset pin is active low */
-    gpio_put(PIN_RST, 0);
+    for(uint dev = 0; dev < IMU_MAX_DEVICES; dev++)
+        gpio_put(imu_devices[dev].rst, 0);
     sleep_ms(10);
-    gpio_put(PIN_RST, 1);
+    for(uint dev = 0; dev < IMU_MAX_DEVICES; dev++)
+        gpio_put(imu_devices[dev].rst, 1);
     sleep_ms(310);
 }
 
+/**
+  * @brief Apply the IMU_SPI_CONFIG and IMU_BURST_CONFIG register settings
+  *
+  * @return void
+  *
+  * Called at boot, then on the capture core with capture paused when either
+  * register is written (Data_Capture_Update_SPI_Config()), so the stall and
+  * SCLK never change under a burst in flight. Burst settings are picked up
+  * when capture resumes.
+  */
+void IMU_Update_SPI_Config() {
+    uint32_t div;
+
+    stall_time = g_regs[IMU_SPI_CONFIG_REG] & IMU_SPI_STALL_MASK;
+
+    div = (g_regs[IMU_SPI_CONFIG_REG] & IMU_SPI_SCLK_DIV_MASK) >> IMU_SPI_SCLK_DIV_BITP;
+    if(div < IMU_SPI_SCLK_MIN_DIV)
+        div = IMU_SPI_SCLK_MIN_DIV;
+    reg_sclk_hz = IMU_SPI_SCLK_BASE_HZ / div;
+
+    div = (g_regs[IMU_BURST_CONFIG_REG] & IMU_SPI_SCLK_DIV_MASK) >> IMU_SPI_SCLK_DIV_BITP;
+    if(div < IMU_SPI_SCLK_MIN_DIV)
+        div = IMU_SPI_SCLK_MIN_DIV;
+    burst_sclk_hz = IMU_SPI_SCLK_BASE_HZ / div;
+
+    if(!imu_burst_speed)
+    {
+        spi_set_baudrate(SPI_PORT, reg_sclk_hz);
+        spi_set_baudrate(SPI1_PORT, reg_sclk_hz);
+    }
+}
+
+/**
+  * @brief Switch the SPI ports between the burst and register access SCLK
+  *
+  * @param burst Use the burst SCLK if true (capture starting), register SCLK otherwise
+  *
+  * @return void
+  */
+void IMU_SPI_Set_Burst_Speed(bool burst) {
+    uint32_t hz = burst ? burst_sclk_hz : reg_sclk_hz;
+
+    imu_burst_speed = burst;
+    for(uint port = 0; port < 2; port++)
+    {
+        spi_gated[port] = false;
+        spi_gap[port] = false;
+        spi_dr_period[port] = 0;
+    }
+    spi_set_baudrate(SPI_PORT, hz);
+    spi_set_baudrate(SPI1_PORT, hz);
+}
+
+/**
+  * @brief Run a single burst read and check its checksum
+  *
+  * @param dev IMU to read
+  *
+  * @return true if the burst checksum is good
+  *
+  * Uses the standard ADIS burst (0x6800 command, DIAG_STAT through DATA_CNTR,
+  * then a checksum of their bytes). A stuck bus (all words equal) fails.
+  */
+static bool IMU_Burst_Checksum_Good(const imu_device_t *dev) {
+    uint16_t tx[IMU_BURST_WORDS + 1] = {IMU_BURST_CMD};
+    uint16_t rx[IMU_BURST_WORDS + 1];
+    uint16_t sum = 0;
+    bool stuck = true;
+
+    spi_select(dev->cs);
+    spi_write16_read16_blocking(dev->spi, tx, rx, IMU_BURST_WORDS + 1);
+    spi_deselect(dev->cs);
+    sleep_us(stall_time);
+
+    /* rx[0] is the response to the burst command */
+    for(int i = 1; i < IMU_BURST_WORDS; i++)
+    {
+        sum += (rx[i] & 0xFF) + (rx[i] >> 8);
+        if(rx[i] != rx[1])
+            stuck = false;
+    }
+    return !stuck && (sum == rx[IMU_BURST_WORDS]);
+}
+
+/**
+  * @brief Find the fastest burst SCLK of one IMU which still gives good burst checksums
+  *
+  * @param dev IMU to calibrate
+  *
+  * @return Slowest working SCLK divider, or 0 if none worked
+  *
+  * Steps the burst SCLK divider down from IMU_SPI_CAL_START_DIV, running
+  * IMU_SPI_CAL_BURSTS bursts at each setting, and stops at the first failure.
+  */
+static uint32_t IMU_Calibrate_Device(const imu_device_t *dev) {
+    uint32_t div, best = 0;
+
+    for(div = IMU_SPI_CAL_START_DIV; div >= IMU_SPI_SCLK_MIN_DIV; div--)
+    {
+        bool good = true;
+
+        spi_set_baudrate(dev->spi, IMU_SPI_SCLK_BASE_HZ / div);
+        for(int i = 0; i < IMU_SPI_CAL_BURSTS; i++)
+        {
+            if(!IMU_Burst_Checksum_Good(dev))
+            {
+                good = false;
+                break;
+            }
+        }
+        if(!good)
+            break;
+        best = div;
+    }
+
+    /* Back to the register access clock */
+    spi_set_baudrate(dev->spi, reg_sclk_hz);
+    return best;
+}
+
+/**
+  * @brief Find the fastest burst SCLK which still gives good burst checksums
+  *
+  * @return true if a working SCLK was found and saved to IMU_BURST_CONFIG
+  *
+  * Each IMU enabled by IMU_DEV_CONFIG is calibrated in turn. IMU_BURST_CONFIG
+  * is shared by all of them, so the slowest result is used. Capture must not
+  * be running.
+  */
+bool IMU_Calibrate_Burst_Speed() {
+    uint32_t numDevices = g_regs[IMU_DEV_CONFIG_REG] & IMU_DEV_COUNT_MASK;
+    uint32_t div, best = 0;
+
+    if(numDevices == 0)
+        numDevices = 1;
+    if(numDevices > IMU_MAX_DEVICES)
+        numDevices = IMU_MAX_DEVICES;
+
+    for(uint32_t dev = 0; dev < numDevices; dev++)
+    {
+        div = IMU_Calibrate_Device(&imu_devices[dev]);
+        if(!div)
+            return false;
+        if(div > best)
+            best = div;
+    }
+
+    g_regs[IMU_BURST_CONFIG_REG] &= ~IMU_SPI_SCLK_DIV_MASK;
+    g_regs[IMU_BURST_CONFIG_REG] |= (best << IMU_SPI_SCLK_DIV_BITP);
+    burst_sclk_hz = IMU_SPI_SCLK_BASE_HZ / best;
+    return true;
+}
+
+/**
+  * @brief Select the IMU accessed by register reads and writes
+  *
+  * @param dev IMU index (0 to IMU_MAX_DEVICES - 1)
+  *
+  * @return void
+  */
+void IMU_Select_Device(uint32_t dev) {
+    if(dev < IMU_MAX_DEVICES)
+        imu_selected = dev;
+}
+
+/**
+  * @brief Get the data ready pin of an IMU
+  *
+  * @param dev IMU index
+  *
+  * @return DR GPIO number
+  */
+uint32_t IMU_Get_DR_Pin(uint32_t dev) {
+    return imu_devices[dev].dr;
+}
+
+/**
+  * @brief Find the IMU which owns a data ready pin
+  *
+  * @param gpio DR GPIO number
+  *
+  * @return IMU index, or IMU_MAX_DEVICES if no IMU uses the pin
+  */
+uint32_t IMU_Get_Device_From_DR(uint32_t gpio) {
+    uint32_t dev;
+
+    for(dev = 0; dev < IMU_MAX_DEVICES; dev++)
+    {
+        if(imu_devices[dev].dr == gpio)
+            break;
+    }
+    return dev;
+}
+
+/**
+  * @brief Start a burst from one IMU of a multi IMU capture
+  *
+  * @param dev IMU index
+  *
+  * @param buf Destination for the burst data
+  *
+  * @param words Number of 16 bit words in the burst
+  *
+  * @return true if the burst started, false if the IMU's SPI port is busy
+  *
+  * IMUs on different SPI ports burst concurrently. The DMA completion
+  * calls ISR_Finish_IMU_Burst() with the IMU index.
+  */
+bool IMU_DMA_Start_Device_Burst(uint32_t dev, uint8_t *buf, uint32_t words) {
+    const imu_device_t *imu = &imu_devices[dev];
+    uint tx = imu->port ? dma1_tx : dma_tx;
+    uint rx = imu->port ? dma1_rx : dma_rx;
+
+    if(port_dev[imu->port] >= 0)
+        return false;
+    port_dev[imu->port] = dev;
+    IMU_Track_Burst_Start(imu->port);
+
+    spi_select(imu->cs);
+
+    dma_channel_configure(tx, imu->port ? &dma1_tx_config : &dma_tx_config,
+                          &spi_get_hw(imu->spi)->dr, /* write address */
+                          &g_regs[BUF_WRITE_0_REG],  /* read address */
+                          words,                     /* 16 bit words to transfer */
+                          false);                    /* don't start yet */
+    dma_channel_configure(rx, imu->port ? &dma1_rx_config : &dma_rx_config,
+                          buf,                       /* write address */
+                          &spi_get_hw(imu->spi)->dr, /* read address */
+                          words,                     /* 16 bit words to transfer */
+                          false);                    /* don't start yet */
+
+    /* Start both channels */
+    dma_start_channel_mask((1u << tx) | (1u << rx));
+    return true;
+}
+
+/**
+  * @brief Enable or disable the burst CRC computed by the DMA sniffer
+  *
+  * @param enable Compute a CRC-16-CCITT of each burst if true
+  *
+  * @return void
+  *
+  * The CRC covers the burst data bytes in buffer (little endian) order,
+  * seeded with IMU_CRC_SEED. It is reseeded before every burst.
+  */
+void IMU_DMA_Enable_CRC(bool enable) {
+    dma_crc = enable;
+    if(enable)
+    {
+        dma_sniffer_enable(dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+        dma_hw->sniff_data = IMU_CRC_SEED;
+    }
+    else
+    {
+        dma_sniffer_disable();
+    }
+}
+
+/**
+  * @brief Get the CRC of the most recently completed burst
+  *
+  * @return Burst CRC (only valid when enabled by IMU_DMA_Enable_CRC)
+  */
+uint16_t IMU_DMA_Get_CRC() {
+    return dma_hw->sniff_data & 0xFFFF;
+}
+
+/**
+  * @brief Check if a burst DMA is in flight on either SPI port
+  *
+  * @return true until the burst completion handler has run
+  *
+  * Used when capture stops, so the buffer is not reset or reconfigured
+  * under a burst which is still landing in it.
+  */
+bool IMU_DMA_Is_Busy() {
+    return (port_dev[0] >= 0) || (port_dev[1] >= 0);
+}
+
 /* Start DMA channels to begin transferring memory from the IMU to buffers */
 void IMU_DMA_Start_Burst(uint8_t *buf) {
-    spi_select();
+    port_dev[0] = 0;
+    IMU_Track_Burst_Start(0);
+    spi_select(PIN_CS);
+
+    if(dma_crc)
+        dma_hw->sniff_data = IMU_CRC_SEED;
 
     dma_channel_configure(dma_tx, &dma_tx_config,
                           &spi_get_hw(SPI_PORT)->dr, /* write address */
@@ -192,9 +916,332 @@ void IMU_DMA_Start_Burst(uint8_t *buf) {
     dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
 }
 
+/**
+  * @brief Hand the IMU pins to the PIO burst engine and start it
+  *
+  * @param risingEdge Start bursts on DR rising edge if true, falling edge otherwise
+  *
+  * @param callback Called (from PIO0_IRQ_0) when the engine sees a DR edge
+  *
+  * @return void
+  *
+  * The engine waits for DR on its own. IMU_PIO_Arm_Burst() must be called to
+  * give it a destination before each DR edge.
+  */
+void IMU_PIO_Start(bool risingEdge, void *callback) {
+    pio_sm_set_enabled(imu_pio, imu_sm, false);
+    pio_sm_clear_fifos(imu_pio, imu_sm);
+
+    /* jmp pin is active high, so invert DR for falling edge triggering */
+    gpio_set_inover(PIN_DR, risingEdge ? GPIO_OVERRIDE_NORMAL : GPIO_OVERRIDE_INVERT);
+
+    pio_gpio_init(imu_pio, PIN_CS);
+    pio_gpio_init(imu_pio, PIN_SCLK);
+    pio_gpio_init(imu_pio, PIN_TX);
+    pio_gpio_init(imu_pio, PIN_RX);
+
+    imu_burst_program_init(imu_pio, imu_sm, imu_pio_offset, PIN_CS, PIN_SCLK,
+                           PIN_TX, PIN_RX, PIN_DR, burst_sclk_hz);
+
+    /* Load Y with the number of bits per burst - 1, then empty the OSR so autopull starts fresh */
+    pio_sm_put(imu_pio, imu_sm, (g_regs[BUF_LEN_REG] * 8) - 1);
+    pio_sm_exec(imu_pio, imu_sm, pio_encode_pull(false, false));
+    pio_sm_exec(imu_pio, imu_sm, pio_encode_mov(pio_y, pio_osr));
+    pio_sm_exec(imu_pio, imu_sm, pio_encode_out(pio_null, 32));
+
+    /* Burst start IRQ (not used for ring capture) */
+    if(callback)
+    {
+        pio_set_irq0_source_enabled(imu_pio, pis_interrupt0, true);
+        irq_set_exclusive_handler(PIO0_IRQ_0, callback);
+        irq_set_enabled(PIO0_IRQ_0, true);
+    }
+
+    dma_done[0] = false;
+    imu_pio_running = true;
+    pio_sm_set_enabled(imu_pio, imu_sm, true);
+}
+
+/**
+  * @brief Hand the IMU pins to the PIO register list engine and start it
+  *
+  * @return void
+  *
+  * Each 16 bit word later queued by IMU_PIO_Arm_Burst() is run as its own SPI
+  * transaction, followed by the stall time with CS high. The stall is timed
+  * by the PIO, so a full register list runs with no CPU involvement. It is
+  * latched here, from the current register access SCLK and stall; SPI config
+  * changes restart capture (Data_Capture_Update_SPI_Config()), which reloads it.
+  */
+void IMU_PIO_Start_RegList() {
+    uint32_t stall;
+
+    pio_sm_set_enabled(imu_pio, imu_sm, false);
+    pio_sm_clear_fifos(imu_pio, imu_sm);
+
+    pio_gpio_init(imu_pio, PIN_CS);
+    pio_gpio_init(imu_pio, PIN_SCLK);
+    pio_gpio_init(imu_pio, PIN_TX);
+    pio_gpio_init(imu_pio, PIN_RX);
+
+    imu_reglist_program_init(imu_pio, imu_sm, imu_reglist_offset, PIN_CS, PIN_SCLK,
+                             PIN_TX, PIN_RX, reg_sclk_hz);
+
+    /* Load Y with the stall time in SCLK periods - 1 */
+    stall = ((uint64_t) stall_time * reg_sclk_hz) / (1000*1000);
+    pio_sm_put(imu_pio, imu_sm, stall ? stall - 1 : 0);
+    pio_sm_exec(imu_pio, imu_sm, pio_encode_pull(false, false));
+    pio_sm_exec(imu_pio, imu_sm, pio_encode_mov(pio_y, pio_osr));
+
+    dma_done[0] = false;
+    imu_pio_running = true;
+    pio_sm_set_enabled(imu_pio, imu_sm, true);
+}
+
+/**
+  * @brief Stop the PIO burst engine and give the IMU pins back to spi0
+  *
+  * @return void
+  */
+void IMU_PIO_Stop() {
+    if(!imu_pio_running)
+        return;
+    imu_pio_running = false;
+
+    pio_sm_set_enabled(imu_pio, imu_sm, false);
+    irq_set_enabled(PIO0_IRQ_0, false);
+    pio_set_irq0_source_enabled(imu_pio, pis_interrupt0, false);
+    IMU_DMA_Ring_Stop();
+
+    /* Burst start and ring capture use different handlers */
+    if(irq_get_exclusive_handler(PIO0_IRQ_0))
+        irq_remove_handler(PIO0_IRQ_0, irq_get_exclusive_handler(PIO0_IRQ_0));
+    dma_channel_abort(dma_rx);
+    dma_channel_abort(dma_tx);
+    dma_done[0] = false;
+    /* Armed burst will never complete */
+    port_dev[0] = -1;
+
+    gpio_set_inover(PIN_DR, GPIO_OVERRIDE_NORMAL);
+
+    gpio_set_function(PIN_RX,   GPIO_FUNC_SPI);
+    gpio_set_function(PIN_SCLK, GPIO_FUNC_SPI);
+    gpio_set_function(PIN_TX,   GPIO_FUNC_SPI);
+    gpio_init(PIN_CS);
+    gpio_set_dir(PIN_CS, GPIO_OUT);
+    gpio_put(PIN_CS, 1);
+}
+
+/**
+  * @brief Acknowledge the PIO burst start interrupt
+  *
+  * @return void
+  */
+void IMU_PIO_Clear_Start_IRQ() {
+    pio_interrupt_clear(imu_pio, 0);
+}
+
+/* Point the PIO burst engine DMA at the buffer for the next burst */
+void IMU_PIO_Arm_Burst(uint8_t *buf) {
+    port_dev[0] = 0;
+    if(dma_crc)
+        dma_hw->sniff_data = IMU_CRC_SEED;
+
+    dma_channel_configure(dma_tx, &dma_pio_tx_config,
+                          &imu_pio->txf[imu_sm],     /* write address */
+                          &g_regs[BUF_WRITE_0_REG],  /* read address */
+                          g_regs[BUF_LEN_REG] / 2,   /* 16 bit words to transfer */
+                          false);                    /* don't start yet */
+    dma_channel_configure(dma_rx, &dma_pio_rx_config,
+                          buf,                       /* write address */
+                          &imu_pio->rxf[imu_sm],     /* read address */
+                          g_regs[BUF_LEN_REG] / 2,   /* 16 bit words to transfer */
+                          false);                    /* don't start yet */
+
+    /* Start both channels. They wait on the PIO FIFOs until DR fires */
+    dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+}
+
+/**
+  * @brief Start autonomous DMA ring capture
+  *
+  * @param slots Ring of buffer data addresses (IMU_DMA_RING_SIZE words, aligned to its size)
+  *
+  * @param timestamps Timestamp ring (IMU_DMA_RING_SIZE words, aligned to its size)
+  *
+  * @param crcs Burst CRC ring (IMU_DMA_RING_SIZE words, aligned to its size), NULL if CRC disabled
+  *
+  * @param watermark Number of bursts between callbacks
+  *
+  * @param callback Called from PIO0_IRQ_0 every watermark bursts
+  *
+  * @return void
+  *
+  * Five channels run the capture with no CPU involvement per sample:
+  * dma_tx sends BUF_WRITE words to the PIO engine and chains to dma_tx_reload,
+  * which re-arms dma_tx for the next burst. dma_rx_ctrl writes the next slot
+  * address to dma_rx (triggering it), which moves the burst to the buffer then
+  * chains to dma_ts. dma_ts copies the raw 1MHz timer to the timestamp ring and
+  * chains back to dma_rx_ctrl. With CRC enabled dma_rx chains to dma_crc_copy
+  * (sniffer result to the CRC ring) and dma_crc_seed (reseed the sniffer) before
+  * dma_ts, so a burst's CRC is always in place before its timestamp. A second state machine counts bursts and raises
+  * the callback interrupt. The PIO engine must be started (IMU_PIO_Start) with
+  * no callback before calling this function.
+  */
+void IMU_DMA_Ring_Start(uint32_t *slots, uint32_t *timestamps, uint32_t *crcs, uint32_t watermark, void *callback) {
+    dma_channel_config c;
+
+    dma_ring_running = true;
+    dma_done[0] = false;
+
+    /* TX: BUF_WRITE words to the PIO TX FIFO, then reload */
+    tx_reload_addr = (uint32_t) &g_regs[BUF_WRITE_0_REG];
+    c = dma_pio_tx_config;
+    channel_config_set_chain_to(&c, dma_tx_reload);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_set_irq1_enabled(dma_tx, false);
+    dma_channel_configure(dma_tx, &c, &imu_pio->txf[imu_sm], &g_regs[BUF_WRITE_0_REG],
+                          g_regs[BUF_LEN_REG] / 2, false);
+
+    /* TX reload: rewrite the read address and retrigger. TRANS_COUNT reloads itself */
+    c = dma_channel_get_default_config(dma_tx_reload);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    dma_channel_configure(dma_tx_reload, &c, &dma_hw->ch[dma_tx].al3_read_addr_trig, &tx_reload_addr, 1, false);
+
+    /* RX: one burst from the PIO RX FIFO, then timestamp. Write address set by dma_rx_ctrl */
+    c = dma_pio_rx_config;
+    channel_config_set_chain_to(&c, crcs ? dma_crc_copy : dma_ts);
+    channel_config_set_irq_quiet(&c, true);
+    dma_channel_set_irq0_enabled(dma_rx, false);
+    dma_channel_configure(dma_rx, &c, 0, &imu_pio->rxf[imu_sm], g_regs[BUF_LEN_REG] / 2, false);
+
+    /* CRC: sniffer result to the CRC ring, then reseed the sniffer */
+    if(crcs)
+    {
+        c = dma_channel_get_default_config(dma_crc_copy);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_ring(&c, true, IMU_DMA_RING_BITS + 2);
+        channel_config_set_chain_to(&c, dma_crc_seed);
+        dma_channel_configure(dma_crc_copy, &c, crcs, &dma_hw->sniff_data, 1, false);
+
+        c = dma_channel_get_default_config(dma_crc_seed);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_chain_to(&c, dma_ts);
+        dma_channel_configure(dma_crc_seed, &c, &dma_hw->sniff_data, &crc_seed, 1, false);
+    }
+
+    /* Timestamp: raw timer to the timestamp ring, then next slot */
+    c = dma_channel_get_default_config(dma_ts);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, IMU_DMA_RING_BITS + 2);
+    channel_config_set_chain_to(&c, dma_rx_ctrl);
+    dma_channel_configure(dma_ts, &c, timestamps, &timer_hw->timerawl, 1, false);
+
+    /* RX control: next slot address from the slot ring to the RX write address trigger */
+    c = dma_channel_get_default_config(dma_rx_ctrl);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_ring(&c, false, IMU_DMA_RING_BITS + 2);
+    dma_channel_configure(dma_rx_ctrl, &c, &dma_hw->ch[dma_rx].al2_write_addr_trig, slots, 1, false);
+
+    /* Burst counter raises an interrupt every watermark bursts */
+    pio_sm_set_enabled(imu_pio, imu_count_sm, false);
+    imu_burst_count_program_init(imu_pio, imu_count_sm, imu_count_offset);
+    pio_sm_put(imu_pio, imu_count_sm, watermark - 1);
+    pio_sm_exec(imu_pio, imu_count_sm, pio_encode_pull(false, false));
+    pio_sm_exec(imu_pio, imu_count_sm, pio_encode_mov(pio_y, pio_osr));
+    pio_interrupt_clear(imu_pio, 1);
+    pio_set_irq0_source_enabled(imu_pio, pis_interrupt1, true);
+    irq_set_exclusive_handler(PIO0_IRQ_0, callback);
+    irq_set_enabled(PIO0_IRQ_0, true);
+    pio_sm_set_enabled(imu_pio, imu_count_sm, true);
+
+    /* Arm RX with the first slot, and TX with the first burst */
+    dma_start_channel_mask((1u << dma_rx_ctrl) | (1u << dma_tx));
+}
+
+/**
+  * @brief Stop autonomous DMA ring capture
+  *
+  * @return void
+  *
+  * The PIO engine should be stopped first, so no burst is in flight.
+  */
+void IMU_DMA_Ring_Stop() {
+    if(!dma_ring_running)
+        return;
+
+    pio_sm_set_enabled(imu_pio, imu_count_sm, false);
+    pio_set_irq0_source_enabled(imu_pio, pis_interrupt1, false);
+
+    /* Break the chains (chain to self) first, then abort */
+    hw_write_masked(&dma_hw->ch[dma_tx].al1_ctrl, dma_tx << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+                    DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    hw_write_masked(&dma_hw->ch[dma_rx].al1_ctrl, dma_rx << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+                    DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    hw_write_masked(&dma_hw->ch[dma_ts].al1_ctrl, dma_ts << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+                    DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+    dma_channel_abort(dma_rx_ctrl);
+    dma_channel_abort(dma_crc_copy);
+    dma_channel_abort(dma_crc_seed);
+    dma_channel_abort(dma_tx_reload);
+    dma_channel_abort(dma_ts);
+    dma_channel_abort(dma_rx);
+    dma_channel_abort(dma_tx);
+
+    /* Restore per-burst interrupts */
+    dma_channel_set_irq0_enabled(dma_rx, true);
+    dma_channel_set_irq1_enabled(dma_tx, true);
+    dma_ring_running = false;
+    dma_done[0] = false;
+}
+
+/**
+  * @brief Get the index of the next timestamp ring entry DMA will write
+  *
+  * @param timestamps Timestamp ring passed to IMU_DMA_Ring_Start()
+  *
+  * @return Index within the timestamp ring
+  *
+  * Every completed burst writes one timestamp, so this is also the
+  * index of the next slot to complete.
+  */
+uint32_t IMU_DMA_Ring_Position(const uint32_t *timestamps) {
+    return ((uint32_t *) dma_hw->ch[dma_ts].write_addr - timestamps) & (IMU_DMA_RING_SIZE - 1);
+}
+
+/**
+  * @brief Acknowledge the ring capture watermark interrupt
+  *
+  * @return void
+  */
+void IMU_DMA_Ring_Clear_IRQ() {
+    pio_interrupt_clear(imu_pio, 1);
+}
+
 /* Cleanup after DMA */
-void IMU_DMA_Finish_Burst() {
-    spi_deselect();
-    dma_done = false;
-    ISR_Finish_IMU_Burst();
+void IMU_DMA_Finish_Burst(uint port) {
+    int dev = port_dev[port];
+
+    /* PIO engine drives CS itself */
+    if(!imu_pio_running || port)
+        spi_deselect(imu_devices[dev].cs);
+    dma_done[port] = false;
+    port_dev[port] = -1;
+
+    /* Register transfers may use the gap once the stall is over */
+    spi_gap_time[port] = make_timeout_time_us(stall_time);
+    spi_gated[port] = true;
+    spi_gap[port] = true;
+
+    ISR_Finish_IMU_Burst(dev);
 }
@@ -0,0 +1,217 @@
+/**
+  * @file integrator.c
+  * @brief Coning / sculling corrected delta angle and delta velocity integrator
+  *
+  * Runs on the capture core for every sample, between the burst completing
+  * and the buffer entry being committed. Gyro and accel samples are turned
+  * into angle and velocity increments using the measured sample spacing
+  * (DR timestamps), and accumulated over FILT_CONFIG ratio samples with
+  * the recursive coning and sculling corrections (Savage). Only the
+  * integrated output entries are stored. Everything is fixed point.
+  */
+
+#include "reg.h"
+#include "filter.h"
+#include "integrator.h"
+
+/** Samples per output (0 when the integrator is off) */
+static uint32_t Integ_Ratio;
+
+/** Samples since the last output */
+static uint32_t Integ_Count;
+
+/** First data word (gyro X, then gyro Y/Z, accel X/Y/Z) */
+static uint32_t Integ_FirstWord;
+
+/** Timestamp (PPS seconds, us) of the previous sample, and if it is valid */
+static uint32_t Integ_LastS;
+static uint32_t Integ_LastUs;
+static bool Integ_HaveLast;
+
+/** Angle and velocity accumulated since the last output */
+static int64_t Integ_Angle[3];
+static int64_t Integ_Vel[3];
+
+/** Coning and sculling corrections accumulated since the last output */
+static int64_t Integ_Coning[3];
+static int64_t Integ_Sculling[3];
+
+/** Previous sample's angle and velocity increments */
+static int64_t Integ_PrevAngle[3];
+static int64_t Integ_PrevVel[3];
+
+/**
+  * @brief Cross product of two fixed point vectors
+  *
+  * @param a First vector
+  *
+  * @param b Second vector, in delta angle (2^-INTEG_ANGLE_BITS rad) units
+  *
+  * @param out a x b, in the units of a
+  *
+  * @return void
+  */
+static void Cross(const int64_t* a, const int64_t* b, int64_t* out)
+{
+	out[0] = (a[1] * b[2] - a[2] * b[1]) >> INTEG_ANGLE_BITS;
+	out[1] = (a[2] * b[0] - a[0] * b[2]) >> INTEG_ANGLE_BITS;
+	out[2] = (a[0] * b[1] - a[1] * b[0]) >> INTEG_ANGLE_BITS;
+}
+
+/**
+  * @brief Clear the integrated values (start of an output interval)
+  *
+  * @return void
+  */
+static void ClearInterval()
+{
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Integ_Angle[axis] = 0;
+		Integ_Vel[axis] = 0;
+		Integ_Coning[axis] = 0;
+		Integ_Sculling[axis] = 0;
+	}
+	Integ_Count = 0;
+}
+
+/**
+  * @brief Load the integrator settings and clear its state
+  *
+  * @return void
+  *
+  * Enabled by BUF_CFG_INTEGRATE. Uses the FILT_CONFIG ratio (samples per
+  * output) and first word fields. The entry must have room for the
+  * INTEG_OUT_WORDS output words. Called when capture starts.
+  */
+void Integrator_Reset()
+{
+	uint32_t config = g_regs[FILT_CONFIG_REG];
+
+	Integ_Ratio = 0;
+	Integ_FirstWord = (config & FILT_WORD_MASK) >> FILT_WORD_BITP;
+	if((g_regs[BUF_CONFIG_REG] & BUF_CFG_INTEGRATE) &&
+	   ((Integ_FirstWord + INTEG_OUT_WORDS) <= (g_regs[BUF_LEN_REG] / 2)))
+	{
+		Integ_Ratio = config & FILT_RATIO_MASK;
+		/* One sample per output is still integrated */
+		if(Integ_Ratio == 0)
+			Integ_Ratio = 1;
+	}
+
+	ClearInterval();
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Integ_PrevAngle[axis] = 0;
+		Integ_PrevVel[axis] = 0;
+	}
+	Integ_HaveLast = false;
+}
+
+/**
+  * @brief Check if the integrator is running
+  *
+  * @return true if samples go through Integrator_Process
+  */
+bool Integrator_Is_Enabled()
+{
+	return Integ_Ratio != 0;
+}
+
+/**
+  * @brief Integrate one captured sample
+  *
+  * @param element Buffer entry (timestamp, signature, then data)
+  *
+  * @return true if this sample ends an output interval. The data words
+  * starting at the FILT_CONFIG first word have been replaced with the
+  * integrated delta angle and delta velocity, and the entry should be
+  * stored. Otherwise the entry should be discarded.
+  *
+  * Per sample k, with angle increment a_k and velocity increment v_k:
+  *   coning   += 1/2 (A + a_(k-1) / 6) x a_k
+  *   sculling += 1/2 ((A + a_(k-1) / 6) x v_k + (V + v_(k-1) / 6) x a_k)
+  *   A += a_k, V += v_k
+  * and at the end of the interval:
+  *   delta angle    = A + coning
+  *   delta velocity = V + 1/2 A x V + sculling
+  */
+bool Integrator_Process(uint8_t* element)
+{
+	uint32_t s = *(uint32_t *) element;
+	uint32_t us = *(uint32_t *) (element + 4);
+	int16_t* sample = (int16_t *) (element + 10) + Integ_FirstWord;
+	int64_t angle[3], vel[3], angleRef[3], velRef[3], tmp[3], tmp2[3];
+	int64_t dt;
+
+	/* Microsecond timestamp restarts on each PPS second */
+	dt = (int64_t) (int32_t) (s - Integ_LastS) * 1000000 + (int32_t) (us - Integ_LastUs);
+	Integ_LastS = s;
+	Integ_LastUs = us;
+
+	/* Need a previous sample for the spacing. Start over after a gap */
+	if(!Integ_HaveLast || dt <= 0 || dt > INTEG_MAX_DT)
+	{
+		Integ_HaveLast = true;
+		ClearInterval();
+		for(int axis = 0; axis < 3; axis++)
+		{
+			Integ_PrevAngle[axis] = 0;
+			Integ_PrevVel[axis] = 0;
+		}
+		return false;
+	}
+
+	/* Increments for this sample */
+	for(int axis = 0; axis < 3; axis++)
+	{
+		angle[axis] = ((int64_t) sample[axis] * dt * INTEG_GYRO_SCALE) >> 24;
+		vel[axis] = ((int64_t) sample[3 + axis] * dt * INTEG_ACCL_SCALE) >> 24;
+		angleRef[axis] = Integ_Angle[axis] + Integ_PrevAngle[axis] / 6;
+		velRef[axis] = Integ_Vel[axis] + Integ_PrevVel[axis] / 6;
+	}
+
+	/* Coning */
+	Cross(angleRef, angle, tmp);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Integ_Coning[axis] += tmp[axis] / 2;
+	}
+
+	/* Sculling. (V + v/6) x a = -(a x (V + v/6)) */
+	Cross(vel, angleRef, tmp);
+	Cross(velRef, angle, tmp2);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Integ_Sculling[axis] += (tmp2[axis] - tmp[axis]) / 2;
+	}
+
+	for(int axis = 0; axis < 3; axis++)
+	{
+		Integ_Angle[axis] += angle[axis];
+		Integ_Vel[axis] += vel[axis];
+		Integ_PrevAngle[axis] = angle[axis];
+		Integ_PrevVel[axis] = vel[axis];
+	}
+
+	Integ_Count++;
+	if(Integ_Count < Integ_Ratio)
+		return false;
+
+	/* Rotation compensation, 1/2 A x V */
+	Cross(Integ_Vel, Integ_Angle, tmp);
+	for(int axis = 0; axis < 3; axis++)
+	{
+		int32_t dAngle = Integ_Angle[axis] + Integ_Coning[axis];
+		int32_t dVel = Integ_Vel[axis] - tmp[axis] / 2 + Integ_Sculling[axis];
+		uint16_t* out = (uint16_t *) sample;
+
+		out[2 * axis] = dAngle & 0xFFFF;
+		out[2 * axis + 1] = (uint32_t) dAngle >> 16;
+		out[6 + 2 * axis] = dVel & 0xFFFF;
+		out[6 + 2 * axis + 1] = (uint32_t) dVel >> 16;
+	}
+
+	ClearInterval();
+	return true;
+}
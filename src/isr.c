@@ -1,11 +1,11 @@
+#include <stddef.h>
 #include "isr.h"
-#include "usb.h"
 #include "reg.h"
 #include "imu.h"
 #include "timer.h"
 #include "buffer.h"
-
-static const char NoIMUBurstError[] = "Unimplemented: data capture without IMU_BURST enabled \r\n";
+#include "filter.h"
+#include "integrator.h"
 
 /* Track if there is currently a capture in progress */
 volatile uint32_t g_captureInProgress = 0u;
@@ -22,14 +22,128 @@ static volatile uint32_t WordsCaptured;
 /* Buffer signature */
 static uint32_t BufferSignature;
 
+/* Track if the PIO burst engine is running captures */
+static uint32_t PIOCaptureMode = 0;
+
+/* Track if the armed PIO capture is being discarded (buffer full) */
+static uint32_t PIODropEntry;
+
+/* Destination for PIO bursts which are discarded */
+static uint8_t PIOScratchEntry[BUF_MAX_ENTRY + 12] __attribute__((aligned (4)));
+
+/* Track if DMA ring capture is running */
+static uint32_t RingCaptureMode = 0;
+
+/* Data address for each ring slot, read by the RX control DMA channel */
+static uint32_t RingSlots[IMU_DMA_RING_SIZE] __attribute__((aligned (IMU_DMA_RING_SIZE * 4)));
+
+/* Raw timer value at the end of each ring slot burst, written by DMA */
+static uint32_t RingTimestamps[IMU_DMA_RING_SIZE] __attribute__((aligned (IMU_DMA_RING_SIZE * 4)));
+
+/* Sniffer CRC of each ring slot burst, written by DMA */
+static uint32_t RingCrcs[IMU_DMA_RING_SIZE] __attribute__((aligned (IMU_DMA_RING_SIZE * 4)));
+
+/* Buffer element for each ring slot (NULL if the burst is discarded) */
+static uint8_t* RingElements[IMU_DMA_RING_SIZE];
+
+/* Index of the next ring slot to complete */
+static uint32_t RingNext;
+
+/* Number of buffer elements reserved by ring slots */
+static uint32_t RingReserved;
+
+/* Raw timestamp of the most recently serviced ring slot */
+static uint32_t RingLastTimestamp;
+
+/* Number of IMUs in a multi IMU capture (0 when not running) */
+static uint32_t MultiNumDevices = 0;
+
+/* Buffer element each IMU is capturing to (scratch entry if discarded) */
+static uint8_t* MultiElement[IMU_MAX_DEVICES];
+
+/* Signature of the sample each IMU is capturing */
+static uint32_t MultiSignature[IMU_MAX_DEVICES];
+
+/* Track which IMUs have a sample in progress, or waiting for their SPI port */
+static volatile uint32_t MultiBusy[IMU_MAX_DEVICES];
+static volatile uint32_t MultiWaiting[IMU_MAX_DEVICES];
+
+/* Destination for multi IMU samples which are discarded */
+static uint8_t MultiScratch[IMU_MAX_DEVICES][BUF_MAX_ENTRY + 12] __attribute__((aligned (4)));
+
+/* Reserved buffer elements, in reservation (buffer) order, and if each is complete */
+static uint8_t* MultiQueue[IMU_MAX_IN_FLIGHT];
+static uint32_t MultiQueueDone[IMU_MAX_IN_FLIGHT];
+static uint32_t MultiQueueHead;
+static uint32_t MultiQueueCount;
+
+/**
+  * @brief Writes the timestamps to a buffer element
+  *
+  * @param element Start of the buffer element
+  *
+  * @param timestampS UTC seconds for the element
+  *
+  * @param timestampUs Microsecond timestamp for the element, counted from timestampS
+  *
+  * @return Initial buffer signature (sum of the timestamp words)
+  */
+static uint32_t TimestampElement(uint8_t* element, uint32_t timestampS, uint32_t timestampUs)
+{
+    uint32_t signature;
+
+    /* Add timestamp to buffer */
+    *(uint32_t *) element = timestampS;
+    *(uint32_t *) (element + 4) = timestampUs;
+
+    /* Set signature to timestamp value initially */
+    signature = timestampS & 0xFFFF;
+    signature += (timestampS >> 16);
+    signature += timestampUs & 0xFFFF;
+    signature += (timestampUs >> 16);
+    return signature;
+}
+
+/**
+  * @brief Timestamps a buffer element and sets up the signature
+  *
+  * @return void
+  *
+  * BufferElementHandle must point to the start of the element. On return it is
+  * offset to the element data.
+  */
+static void StartBufferElement()
+{
+    uint32_t timestampS, timestampUs;
+
+    timestampUs = Timer_Get_DR_Timestamp(&timestampS);
+    BufferSignature = TimestampElement(BufferElementHandle, timestampS, timestampUs);
+
+    /* Set buffer signature handle */
+    BufferSigHandle = (uint16_t *) (BufferElementHandle + 8);
+
+    /* Offset buffer element handle by 10 bytes (timestamp + sig) */
+    BufferElementHandle += 10;
+}
+
+/**
+  * @brief Sets the overrun status flag
+  *
+  * @return void
+  */
+static void FlagOverrun()
+{
+    g_regs[STATUS_0_REG] |= STATUS_OVERRUN;
+    g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
 void ISR_Start_IMU_Burst()
 {
     /* If capture in progress then set error flag and exit */
     if(g_captureInProgress)
     {
         g_captureInProgress = 0;
-        g_regs[STATUS_0_REG] |= STATUS_OVERRUN;
-        g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+        FlagOverrun();
         return;
     }
 
@@ -37,43 +151,392 @@ void ISR_Start_IMU_Burst()
     if(!Buffer_Can_Add_Element())
         return;
 
-    uint32_t SampleTimestampUs = Timer_Get_Microsecond_Timestamp();
-    uint32_t SampleTimestampS = Timer_Get_PPS_Timestamp();
-
-    /* Get element handle */
+    /* Get element handle, then timestamp it */
     BufferElementHandle = Buffer_Add_Element();
+    StartBufferElement();
 
-    /* Add timestamp to buffer */
-    *(uint32_t *) BufferElementHandle = SampleTimestampS;
-    *(uint32_t *) (BufferElementHandle + 4) = SampleTimestampUs;
+    /* Set flag indicating capture is running */
+    g_captureInProgress = 1;
 
-    /* Set signature to timestamp value initially */
-    BufferSignature = SampleTimestampS & 0xFFFF;
-    BufferSignature += (SampleTimestampS >> 16);
-    BufferSignature += SampleTimestampUs & 0xFFFF;
-    BufferSignature += (SampleTimestampUs >> 16);
+    if(g_regs[BUF_CONFIG_REG] & BUF_CFG_IMU_BURST)
+    {
+        IMU_DMA_Start_Burst(BufferElementHandle);
+    }
+    else
+    {
+        /* Register list mode. BUF_WRITE words are run as individual SPI transactions
+         * by the PIO register list engine, with the stall between them timed in
+         * hardware. Each word read back is the response to the previous command. */
+        IMU_PIO_Arm_Burst(BufferElementHandle);
+    }
+}
 
-    /* Set buffer signature handle */
-    BufferSigHandle = (uint16_t *) (BufferElementHandle + 8);
-    *(BufferElementHandle + 14) = 0xFF;
+/**
+  * @brief Points the PIO burst engine at the next buffer element
+  *
+  * @return void
+  *
+  * Called when PIO capture starts, and after each PIO burst completes. The
+  * buffer element is reserved ahead of the DR edge, so the burst itself
+  * needs no CPU involvement. If the buffer is full the burst goes to a
+  * scratch entry and is discarded.
+  */
+static void ArmPIOBurst()
+{
+    if(Buffer_Can_Add_Element())
+    {
+        BufferElementHandle = Buffer_Add_Element();
+        PIODropEntry = 0;
+    }
+    else
+    {
+        BufferElementHandle = PIOScratchEntry;
+        PIODropEntry = 1;
+    }
+    IMU_PIO_Arm_Burst(BufferElementHandle + 10);
+}
 
-    /* Offset buffer element handle by 10 bytes (timestamp + sig) */
-    BufferElementHandle += 10;
+/**
+  * @brief Handler for the PIO burst engine DR edge interrupt
+  *
+  * @return void
+  *
+  * The burst is already running when this is called. This only timestamps
+  * the armed buffer element.
+  */
+static void ISR_PIO_Burst_Started()
+{
+    IMU_PIO_Clear_Start_IRQ();
 
-    /* Set flag indicating capture is running */
+    /* Previous burst never completed */
+    if(g_captureInProgress)
+    {
+        FlagOverrun();
+        return;
+    }
+
+    StartBufferElement();
     g_captureInProgress = 1;
+}
 
-    if(g_regs[BUF_CONFIG_REG] & BUF_CFG_IMU_BURST)
+/**
+  * @brief Starts DR triggered captures using the PIO burst engine
+  *
+  * @param risingEdge Trigger on DR rising edge if true, falling edge otherwise
+  *
+  * @return void
+  */
+void ISR_Start_PIO_Capture(bool risingEdge)
+{
+    PIOCaptureMode = 1;
+    g_captureInProgress = 0;
+    ArmPIOBurst();
+    IMU_PIO_Start(risingEdge, ISR_PIO_Burst_Started);
+}
+
+/**
+  * @brief Stops PIO burst engine captures
+  *
+  * @return void
+  */
+void ISR_Stop_PIO_Capture()
+{
+    if(!PIOCaptureMode)
+        return;
+    PIOCaptureMode = 0;
+    IMU_PIO_Stop();
+}
+
+/**
+  * @brief Points a DMA ring slot at the next buffer element
+  *
+  * @param index Ring slot index
+  *
+  * @return void
+  *
+  * If the buffer has no space for the element the slot captures to the
+  * scratch entry and its burst is discarded.
+  */
+static void RingFillSlot(uint32_t index)
+{
+    uint8_t* element = Buffer_Reserve_Element(RingReserved);
+
+    RingElements[index] = element;
+    if(element)
     {
-        IMU_DMA_Start_Burst(BufferElementHandle);
+        RingReserved++;
+        RingSlots[index] = (uint32_t) (element + 10);
+    }
+    else
+    {
+        RingSlots[index] = (uint32_t) (PIOScratchEntry + 10);
+    }
+}
+
+/**
+  * @brief Publishes the bursts completed by DMA ring capture
+  *
+  * @return void
+  *
+  * Called from the ring capture watermark interrupt (once every watermark
+  * bursts), and once more when ring capture stops. Each completed slot gets
+  * its timestamp and signature, is committed to the buffer, and is then
+  * refilled with a new buffer element for the DMA to use on its next lap. The
+  * microsecond timestamp is taken by DMA at the end of the burst, not at DR.
+  */
+static void ISR_Ring_Service()
+{
+    uint32_t end, signature, timestampS, timestampUs;
+    uint8_t* element;
+    uint16_t* RxData;
+
+    IMU_DMA_Ring_Clear_IRQ();
+    end = IMU_DMA_Ring_Position(RingTimestamps);
+
+    /* DMA lapped the ring (slot serviced last time was overwritten) */
+    if(RingTimestamps[(RingNext - 1) & (IMU_DMA_RING_SIZE - 1)] != RingLastTimestamp)
+        FlagOverrun();
+
+    while(RingNext != end)
+    {
+        element = RingElements[RingNext];
+        RingLastTimestamp = RingTimestamps[RingNext];
+        if(element)
+        {
+            timestampUs = Timer_Raw_To_Timestamp(RingLastTimestamp, &timestampS);
+            signature = TimestampElement(element, timestampS, timestampUs);
+            if(g_regs[BUF_CONFIG_REG] & BUF_CFG_SUM_SIG)
+            {
+                RxData = (uint16_t *) (element + 10);
+                for(int reg = 0; reg < (g_regs[BUF_LEN_REG] / 2); reg++)
+                {
+                    signature += RxData[reg];
+                }
+            }
+            else
+            {
+                signature = RingCrcs[RingNext];
+            }
+            *(uint16_t *) (element + 8) = signature;
+
+            /* Element was reserved, so this always publishes it */
+            RingReserved--;
+            Buffer_Commit_Element();
+        }
+        RingFillSlot(RingNext);
+        RingNext = (RingNext + 1) & (IMU_DMA_RING_SIZE - 1);
+    }
+}
+
+/**
+  * @brief Starts autonomous DMA ring captures using the PIO burst engine
+  *
+  * @param risingEdge Trigger on DR rising edge if true, falling edge otherwise
+  *
+  * @return void
+  *
+  * The CPU is only interrupted once every watermark (WATERMARK_INT_CONFIG
+  * level, 1 to half the ring size) bursts.
+  */
+void ISR_Start_Ring_Capture(bool risingEdge)
+{
+    uint32_t watermark = g_regs[WATERMARK_INT_CONFIG_REG] & ~WATERMARK_PULSE_MASK;
+
+    if(watermark < 1)
+        watermark = 1;
+    if(watermark > (IMU_DMA_RING_SIZE / 2))
+        watermark = IMU_DMA_RING_SIZE / 2;
+
+    RingCaptureMode = 1;
+    RingNext = 0;
+    RingReserved = 0;
+    RingLastTimestamp = 0;
+    for(uint32_t i = 0; i < IMU_DMA_RING_SIZE; i++)
+    {
+        RingTimestamps[i] = 0;
+        RingFillSlot(i);
+    }
+
+    IMU_PIO_Start(risingEdge, NULL);
+    IMU_DMA_Ring_Start(RingSlots, RingTimestamps,
+                       (g_regs[BUF_CONFIG_REG] & BUF_CFG_SUM_SIG) ? NULL : RingCrcs,
+                       watermark, ISR_Ring_Service);
+}
+
+/**
+  * @brief Stops DMA ring captures and publishes any completed bursts
+  *
+  * @return void
+  */
+void ISR_Stop_Ring_Capture()
+{
+    if(!RingCaptureMode)
+        return;
+    RingCaptureMode = 0;
+    IMU_PIO_Stop();
+    ISR_Ring_Service();
+}
+
+/**
+  * @brief Starts a multi IMU capture
+  *
+  * @param numDevices Number of IMUs to capture from (2 to IMU_MAX_DEVICES)
+  *
+  * @return void
+  *
+  * Each IMU's DR interrupt must then call ISR_Start_Device_Burst(). Every
+  * buffer entry holds one sample from one IMU. The first data word of the
+  * entry is the IMU index, followed by BUF_LEN - 2 bytes of burst data.
+  */
+void ISR_Start_Multi_Capture(uint32_t numDevices)
+{
+    for(uint32_t dev = 0; dev < IMU_MAX_DEVICES; dev++)
+    {
+        MultiBusy[dev] = 0;
+        MultiWaiting[dev] = 0;
+    }
+    MultiQueueHead = 0;
+    MultiQueueCount = 0;
+    MultiNumDevices = numDevices;
+}
+
+/**
+  * @brief Stops a multi IMU capture
+  *
+  * @return void
+  *
+  * The DR interrupts must already be disabled. Samples in flight are
+  * allowed to complete (bursts take well under one DR period).
+  */
+void ISR_Stop_Multi_Capture()
+{
+    if(!MultiNumDevices)
+        return;
+
+    for(uint32_t dev = 0; dev < IMU_MAX_DEVICES; dev++)
+    {
+        while(MultiBusy[dev]);
+    }
+    MultiNumDevices = 0;
+}
+
+/**
+  * @brief Starts the burst for an IMU if its SPI port is free
+  *
+  * @param dev IMU index
+  *
+  * @return void
+  */
+static void StartMultiBurst(uint32_t dev)
+{
+    uint32_t words = (g_regs[BUF_LEN_REG] / 2) - 1;
+
+    MultiWaiting[dev] = !IMU_DMA_Start_Device_Burst(dev, MultiElement[dev] + 12, words);
+}
+
+/**
+  * @brief Handler for the DR interrupt of each IMU in a multi IMU capture
+  *
+  * @param gpio DR pin which triggered
+  *
+  * @param events GPIO interrupt events (unused)
+  *
+  * @return void
+  *
+  * The sample is timestamped at DR (hardware latched for IMU 0, which has the
+  * DR edge detector, at interrupt time for the others). If another IMU is using the same SPI
+  * port the burst starts as soon as the port is free.
+  */
+void ISR_Start_Device_Burst(unsigned int gpio, uint32_t events)
+{
+    uint32_t dev = IMU_Get_Device_From_DR(gpio);
+    uint32_t index, timestampS, timestampUs;
+    uint8_t* element;
+
+    (void) events;
+
+    if(dev >= MultiNumDevices)
+        return;
+
+    /* Previous sample from this IMU never completed */
+    if(MultiBusy[dev])
+    {
+        FlagOverrun();
+        return;
+    }
+
+    /* Reserve the next buffer element, in commit order. Discard if none free */
+    element = NULL;
+    if(MultiQueueCount < IMU_MAX_IN_FLIGHT)
+        element = Buffer_Reserve_Element(MultiQueueCount);
+    if(element)
+    {
+        index = (MultiQueueHead + MultiQueueCount) % IMU_MAX_IN_FLIGHT;
+        MultiQueue[index] = element;
+        MultiQueueDone[index] = 0;
+        MultiQueueCount++;
     }
     else
     {
-        /* This mode is for generating your own readout of the IMU instead of a
-         * burst read, by specifying registers to read individually instead of
-         * reading and writing simultaneously. We don't need this now, so it's
-         * not implemented. */
-        USB_Tx_Handler(NoIMUBurstError, sizeof(NoIMUBurstError) - 1);
+        element = MultiScratch[dev];
+    }
+
+    /* Timestamp, then IMU index as the first data word */
+    MultiElement[dev] = element;
+    timestampUs = (dev == 0) ? Timer_Get_DR_Timestamp(&timestampS) : Timer_Get_Timestamp(&timestampS);
+    MultiSignature[dev] = TimestampElement(element, timestampS, timestampUs) + dev;
+    *(uint16_t *) (element + 10) = dev;
+
+    MultiBusy[dev] = 1;
+    StartMultiBurst(dev);
+}
+
+/**
+  * @brief Completes a multi IMU capture burst
+  *
+  * @param dev IMU index
+  *
+  * @return void
+  *
+  * Samples are committed in buffer order, so a sample which completes
+  * before an earlier sample from another IMU waits for it.
+  */
+static void FinishMultiBurst(uint32_t dev)
+{
+    uint8_t* element = MultiElement[dev];
+    uint16_t* RxData = (uint16_t *) (element + 12);
+    uint32_t signature = MultiSignature[dev];
+    uint32_t index;
+
+    /* Signature is always the sum (the DMA sniffer can only follow one SPI port) */
+    for(int reg = 0; reg < ((g_regs[BUF_LEN_REG] / 2) - 1); reg++)
+    {
+        signature += RxData[reg];
+    }
+    *(uint16_t *) (element + 8) = signature;
+
+    /* Mark the reserved element complete */
+    for(uint32_t i = 0; i < MultiQueueCount; i++)
+    {
+        index = (MultiQueueHead + i) % IMU_MAX_IN_FLIGHT;
+        if(MultiQueue[index] == element)
+            MultiQueueDone[index] = 1;
+    }
+
+    /* Publish every complete element at the front of the queue */
+    while(MultiQueueCount && MultiQueueDone[MultiQueueHead])
+    {
+        Buffer_Commit_Element();
+        MultiQueueHead = (MultiQueueHead + 1) % IMU_MAX_IN_FLIGHT;
+        MultiQueueCount--;
+    }
+    MultiBusy[dev] = 0;
+
+    /* Run any burst which was waiting for this SPI port */
+    for(uint32_t i = 0; i < MultiNumDevices; i++)
+    {
+        if(MultiWaiting[i])
+            StartMultiBurst(i);
     }
 }
 
@@ -91,23 +554,64 @@ void ISR_Start_IMU_Burst()
   * and updates the buffer count / capture state variables. Before
   * this function is called, DMA interrupts should be disabled (by
   * their respective ISR's)
+  *
+  * @param dev Index of the IMU which finished the burst
   */
-void ISR_Finish_IMU_Burst()
+void ISR_Finish_IMU_Burst(uint32_t dev)
 {
-    /* Build buffer signature */
-    uint16_t *RxData = (uint16_t *) BufferElementHandle;
+    if(MultiNumDevices)
+    {
+        FinishMultiBurst(dev);
+        return;
+    }
 
-    for(int reg = 0; reg < (g_regs[BUF_LEN_REG] / 2); reg++)
+    /* Integrator or decimating filter. Every sample is processed, only outputs are stored */
+    if(Integrator_Is_Enabled() || Filter_Is_Enabled())
     {
-        BufferSignature += RxData[reg];
+        bool output;
+
+        if(Integrator_Is_Enabled())
+            output = Integrator_Process(BufferElementHandle - 10);
+        else
+            output = Filter_Process((uint16_t *) BufferElementHandle);
+        if(!output)
+        {
+            g_captureInProgress = 0;
+            if(PIOCaptureMode)
+                ArmPIOBurst();
+            return;
+        }
+        /* Data changed after capture, so the DMA sniffer CRC no longer matches */
+        if(!(g_regs[BUF_CONFIG_REG] & BUF_CFG_SUM_SIG))
+            BufferSignature = Buffer_Calc_CRC(BufferElementHandle, g_regs[BUF_LEN_REG]);
+    }
+
+    /* Build buffer signature (legacy sum of timestamp and data words) */
+    if(g_regs[BUF_CONFIG_REG] & BUF_CFG_SUM_SIG)
+    {
+        uint16_t *RxData = (uint16_t *) BufferElementHandle;
+
+        for(int reg = 0; reg < (g_regs[BUF_LEN_REG] / 2); reg++)
+        {
+            BufferSignature += RxData[reg];
+        }
+    }
+    /* Otherwise use the CRC the DMA sniffer computed as the data arrived */
+    else if(!(Integrator_Is_Enabled() || Filter_Is_Enabled()))
+    {
+        BufferSignature = IMU_DMA_Get_CRC();
     }
     /* Save signature to buffer entry */
     BufferSigHandle[0] = BufferSignature;
 
-    /* Update buffer count regs with new count */
-    g_regs[BUF_CNT_0_REG] = g_bufCount;
-    g_regs[BUF_CNT_1_REG] = g_regs[BUF_CNT_0_REG];
+    /* Publish entry to the consumer (also updates buffer count regs) */
+    if(!(PIOCaptureMode && PIODropEntry))
+        Buffer_Commit_Element();
 
     /* Mark capture as done */
     g_captureInProgress = 0;
+
+    /* Get PIO engine ready for the next DR edge */
+    if(PIOCaptureMode)
+        ArmPIOBurst();
 }
@@ -5,14 +5,17 @@
 #include "hardware/timer.h"
 #include "hardware/spi.h"
 #include "hardware/watchdog.h"
+#include "tusb.h"
 #include "imu.h"
 #include "usb.h"
 #include "timer.h"
+#include "sync_gen.h"
 #include "isr.h"
 #include "buffer.h"
 #include "reg.h"
 #include "data_capture.h"
 #include "script.h"
+#include "dio.h"
 
 #define FIRM_REV   0x6C
 #define FIRM_DM    0x6E
@@ -39,12 +42,23 @@ static uint32_t state;
 
 int main()
 {
+    /* Composite CDC + vendor bulk device (usb_descriptors.c). TinyUSB must be up before stdio */
+    tusb_init();
     stdio_init_all();
+    /* SOF timestamps. Handler must be added after the TinyUSB one */
+    USB_SOF_Init();
 
     IMU_SPI_Init();
+    IMU_Update_SPI_Config();
     /* TODO: Test if PPS locks */
     Timer_Init();
+    Sync_Gen_Init();
+    /* Before the first buffer reset, which updates the watermark pins */
+    Dio_Init();
+    Buffer_Init();
     Buffer_Reset();
+    /* Capture path runs on core1 */
+    Data_Capture_Init();
     Reg_Update_Identifiers();
 
     if (watchdog_caused_reboot()) {
@@ -135,24 +149,57 @@ int main()
                     g_update_flags &= ~USER_COMMAND_FLAG;
                     Reg_Process_Command();
                 }
+            /* Handle DIO output pin mapping changes */
+            else if(g_update_flags & DIO_OUTPUT_CONFIG_FLAG)
+                {
+                    g_update_flags &= ~DIO_OUTPUT_CONFIG_FLAG;
+                    Dio_Update_Config();
+                }
+            /* Handle PPS input polarity / frequency changes */
+            else if(g_update_flags & DIO_INPUT_CONFIG_FLAG)
+                {
+                    g_update_flags &= ~DIO_INPUT_CONFIG_FLAG;
+                    Timer_Update_PPS_Config();
+                }
+            /* Handle IMU SPI clock / stall changes */
+            else if(g_update_flags & IMU_SPI_CONFIG_FLAG)
+                {
+                    g_update_flags &= ~IMU_SPI_CONFIG_FLAG;
+                    Data_Capture_Update_SPI_Config();
+                }
             /* Advance to next state */
             state = STATE_CHECK_PPS;
             break;
         case STATE_CHECK_PPS:
             /* Check that PPS isn't unlocked */
             Timer_Check_PPS_Unlock();
+            /* Error interrupt pins, watermark pulse timing */
+            Dio_Service();
             /* Advance to next state */
             state = STATE_CHECK_USB;
             break;
         case STATE_CHECK_USB:
+            /* TinyUSB device task. No background IRQ task, since tinyusb_device is linked directly */
+            tud_task();
             /* Handle any USB command line Rx activity */
             USB_Rx_Handler();
+            /* Send batched CLI output which has waited long enough */
+            USB_Tx_Check_Deadline();
             /* Advance to next state */
             state = STATE_CHECK_STREAM;
             break;
         case STATE_CHECK_STREAM:
             /* Check stream status for CLI */
             Script_Check_Stream();
+            /* Advance to next state */
+            state = STATE_STEP_SCRIPT;
+            break;
+        case STATE_STEP_SCRIPT:
+            /* Run the next stored script element, if a script is running */
+            Script_Step();
+            /* Advance to next state */
+            state = STATE_CHECK_FLAGS;
+            break;
         default:
             /* Go back to first state */
             state = STATE_CHECK_FLAGS;
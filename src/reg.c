@@ -1,15 +1,23 @@
+#include <string.h>
 #include "hardware/watchdog.h"
+#include "hardware/sync.h"
 #include "pico/unique_id.h"
 #include "reg.h"
 #include "imu.h"
 #include "timer.h"
+#include "timesync.h"
 #include "data_capture.h"
 #include "buffer.h"
+#include "dio.h"
+#include "sync_gen.h"
+#include "script.h"
 
 /* Local function prototypes */
 static uint16_t ProcessRegWrite(uint8_t regAddr, uint8_t regValue);
 static void GetSN();
 static void GetBuildDate();
+static void FlagStatus(uint16_t bits);
+static bool StartQueuedAccess(const uint8_t* regAddrs, uint16_t* values, uint32_t count, uint8_t writeValue);
 
 /** Register update flags for main loop processing. Global scope */
 volatile uint32_t g_update_flags = 0;
@@ -44,8 +52,13 @@ USER_SPI_CONFIG_DEFAULT, /* 0x49 */
 CLI_CONFIG_DEFAULT, /* 0x4A */
 0x0000, /* 0x4B (command) */
 SYNC_FREQ_DEFAULT, /* 0x4C */
-0x0000, 0x0000, 0x0000, /* 0x4D - 0x4F */
-0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* 0x50 - 0x57 */
+0x0000, /* 0x4D (buffer size cap, 0 for all free SRAM) */
+0x0000, /* 0x4E (IMU count / register access IMU select) */
+IMU_BURST_CONFIG_DEFAULT, /* 0x4F */
+USB_TX_SIZE_DEFAULT, /* 0x50 (CLI TX batch size, bytes. 0 to send every write) */
+USB_TX_DEADLINE_DEFAULT, /* 0x51 (CLI TX batch deadline, us) */
+FILT_CONFIG_DEFAULT, /* 0x52 (decimating filter ratio / taps / first word) */
+0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* 0x53 - 0x57 (FIR coefficients) */
 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* 0x58 - 0x5F */
 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* 0x60 - 0x67 */
 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, /* 0x68 - 0x6F */
@@ -76,6 +89,19 @@ BUF_READ_PAGE, 0x0000,0x0000,0x0000,0x0000,0x0000,0x0000,0x0000, /* 0xC0 - 0xC7
 /** Selected page. Starts on 253 (config page) */
 static volatile uint32_t selected_page = BUF_CONFIG_PAGE;
 
+/** IMU page access queued to the capture core while capture runs (one CLI read pass at most) */
+static imu_xfer_t queued_xfers[READ_MAX_REGS];
+static uint8_t queued_addrs[READ_MAX_REGS];
+
+/** Destination for queued read results, NULL for a queued write */
+static uint16_t* queued_values;
+static uint8_t queued_write_value;
+
+/** Transfers in the queued access, handed to the capture core so far, and collected so far */
+static uint32_t queued_count = 0;
+static uint32_t queued_next = 0;
+static uint32_t queued_done = 0;
+
 /**
   * @brief Dequeues an entry from the buffer and loads it to the primary output registers
   *
@@ -100,6 +126,122 @@ void Reg_Buf_Dequeue_To_Outputs()
 	}
 }
 
+/**
+  * @brief Set status register bits
+  *
+  * @param bits STATUS_x bits to set
+  *
+  * @return void
+  */
+static void FlagStatus(uint16_t bits)
+{
+	g_regs[STATUS_0_REG] |= bits;
+	g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
+/**
+  * @brief Start an IMU page access through the capture core transfer queue
+  *
+  * @param regAddrs Register addresses
+  *
+  * @param values Output for read values, or NULL to write writeValue to regAddrs[0]
+  *
+  * @param count Number of registers
+  *
+  * @param writeValue Value to write (when values is NULL)
+  *
+  * @return false (and STATUS_IMU_BUSY set) if the access can't be queued
+  *
+  * Only one access is queued at a time. The transfers are handed over and
+  * collected by Reg_Access_Done(), so nothing here waits on the capture core.
+  */
+static bool StartQueuedAccess(const uint8_t* regAddrs, uint16_t* values, uint32_t count, uint8_t writeValue)
+{
+	/* One access at a time, and none while a PIO capture engine owns the IMU bus */
+	if((queued_done != queued_count) || (count > READ_MAX_REGS) || IMU_Queue_Blocked())
+	{
+		FlagStatus(STATUS_IMU_BUSY);
+		return false;
+	}
+
+	memcpy(queued_addrs, regAddrs, count);
+	queued_values = values;
+	queued_write_value = writeValue;
+	queued_next = 0;
+	queued_done = 0;
+	queued_count = count;
+	return true;
+}
+
+/**
+  * @brief Advance the queued IMU page access, if any
+  *
+  * @return true once the access has finished (or if none is queued)
+  *
+  * Polled from the main loop. Hands transfers to the capture core as its
+  * queue frees up, and collects results in order. Failed transfers read as
+  * 0 and set STATUS_SPI_ERROR, transfers rejected because a PIO capture
+  * engine took the IMU bus set STATUS_IMU_BUSY.
+  */
+bool Reg_Access_Done()
+{
+	imu_xfer_t* xfer;
+	bool queued;
+
+	while(queued_next < queued_count)
+	{
+		xfer = &queued_xfers[queued_next];
+		xfer->callback = NULL;
+		if(queued_values)
+			queued = IMU_Queue_Read(xfer, queued_addrs[queued_next]);
+		else
+			queued = IMU_Queue_Write(xfer, queued_addrs[queued_next], queued_write_value);
+		if(!queued)
+			break;
+		queued_next++;
+	}
+
+	while(queued_done < queued_next)
+	{
+		xfer = &queued_xfers[queued_done];
+		if(xfer->status == IMU_XFER_PENDING)
+			break;
+		/* Result is written before status */
+		__dmb();
+		if(xfer->status == IMU_XFER_BLOCKED)
+			FlagStatus(STATUS_IMU_BUSY);
+		else if(xfer->status != IMU_XFER_DONE)
+			FlagStatus(STATUS_SPI_ERROR);
+		if(queued_values)
+			queued_values[queued_done] = (xfer->status == IMU_XFER_DONE) ? xfer->result : 0;
+		queued_done++;
+	}
+
+	return queued_done == queued_count;
+}
+
+/**
+  * @brief Check if IMU page access is rejected in the current capture mode
+  *
+  * @return true if an IMU page is selected and a PIO capture engine owns the selected IMU's bus
+  */
+bool Reg_IMU_Access_Blocked()
+{
+	return (selected_page < OUTPUT_PAGE) && IMU_SPI_Is_Capturing() && IMU_Queue_Blocked();
+}
+
+/**
+  * @brief Get the selected page
+  *
+  * @return Selected page (IMU page, or 252 - 255)
+  *
+  * Unlike reading register 0, this never goes to the IMU.
+  */
+uint32_t Reg_Get_Page()
+{
+	return selected_page;
+}
+
 /**
   * @brief Process a register read request (from master)
   *
@@ -110,7 +252,7 @@ void Reg_Buf_Dequeue_To_Outputs()
   * For selected pages not addressed by iSensor-SPI-Buffer, the read is
   * passed through to the connected IMU, using the spi_passthrough module.
   * If the selected page is [253 - 255] this read request is processed
-  * directly.
+  * directly. IMU reads are rejected (STATUS_IMU_BUSY) while capture runs.
   */
 uint16_t Reg_Read(uint8_t regAddr)
 {
@@ -119,6 +261,13 @@ uint16_t Reg_Read(uint8_t regAddr)
 
 	if(selected_page < OUTPUT_PAGE)
 	{
+		/* Capture core owns the IMU bus while capture is running. Reads have
+		 * to be queued through Reg_Read_Multiple() instead */
+		if(IMU_SPI_Is_Capturing())
+		{
+			FlagStatus(STATUS_IMU_BUSY);
+			return 0;
+		}
 		return IMU_Read_Register(regAddr);
 	}
 	else
@@ -159,6 +308,10 @@ uint16_t Reg_Read(uint8_t regAddr)
 			return status;
 		}
 
+		/* Latch host time offset upon read */
+		if(regIndex == TSYNC_OFFSET_LWR_REG)
+			return TimeSync_Latch_Offset();
+
 		uint32_t microseconds = Timer_Get_Microsecond_Timestamp();
 
 		/* Load time stamp on demand upon read */
@@ -172,6 +325,47 @@ uint16_t Reg_Read(uint8_t regAddr)
 	}
 }
 
+/**
+  * @brief Process a sequence of register read requests
+  *
+  * @param regAddrs Register addresses to read
+  *
+  * @param values Output for the register values, in the same order
+  *
+  * @param count Number of registers to read
+  *
+  * @return true if values is filled in, false if the reads were queued
+  *
+  * Pass through reads are pipelined on the IMU bus when capture is idle. While
+  * capture runs they are queued to the capture core (at most READ_MAX_REGS), and
+  * values is filled in once Reg_Access_Done() returns true. If the reads can't
+  * be queued, values is zeroed and STATUS_IMU_BUSY is set. Reads from the
+  * iSensor-SPI-Buffer pages are processed one at a time by Reg_Read.
+  */
+bool Reg_Read_Multiple(const uint8_t* regAddrs, uint16_t* values, uint32_t count)
+{
+	if(selected_page < OUTPUT_PAGE)
+	{
+		if(IMU_SPI_Is_Capturing())
+		{
+			if(!StartQueuedAccess(regAddrs, values, count, 0))
+			{
+				memset(values, 0, count * sizeof(uint16_t));
+				return true;
+			}
+			return Reg_Access_Done();
+		}
+		IMU_Read_Registers(regAddrs, values, count);
+		return true;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		values[i] = Reg_Read(regAddrs[i]);
+	}
+	return true;
+}
+
 /**
   * @brief Process a register write request (from master)
   *
@@ -186,6 +380,9 @@ uint16_t Reg_Read(uint8_t regAddr)
   * If the selected page is [252 - 255] this write request is processed
   * directly. The firmware echoes back the processed write value so that
   * the master can verify the write contents on the next SPI transaction.
+  * While capture runs, IMU writes are queued (finished by Reg_Access_Done())
+  * and the written value is echoed back, or 0 with STATUS_IMU_BUSY set if
+  * the write can't be queued.
   */
 uint16_t Reg_Write(uint8_t regAddr, uint8_t regValue)
 {
@@ -199,8 +396,11 @@ uint16_t Reg_Write(uint8_t regAddr, uint8_t regValue)
 		{
 			g_update_flags |= ENABLE_CAPTURE_FLAG;
 		}
-		/* Are we leaving page 255? Then disable capture */
-		if((regValue != BUF_READ_PAGE) && (selected_page == BUF_READ_PAGE))
+		/* Are we moving from page 255 or an IMU page to the config pages? Then
+		 * disable capture. IMU pages leave capture running, their access is
+		 * queued to the capture core */
+		if((regValue >= OUTPUT_PAGE) && (regValue != BUF_READ_PAGE) &&
+		   ((selected_page == BUF_READ_PAGE) || (selected_page < OUTPUT_PAGE)))
 		{
 			g_update_flags |= DISABLE_CAPTURE_FLAG;
 		}
@@ -210,7 +410,14 @@ uint16_t Reg_Write(uint8_t regAddr, uint8_t regValue)
 
 	if(selected_page < OUTPUT_PAGE)
 	{
-		/* Pass to IMU */
+		/* Pass to IMU. Queued to the capture core while capture runs */
+		if(IMU_SPI_Is_Capturing())
+		{
+			if(!StartQueuedAccess(&regAddr, NULL, 1, regValue))
+				return 0;
+			Reg_Access_Done();
+			return regValue;
+		}
 		return IMU_Write_Register(regAddr, regValue);
 	}
 	else
@@ -265,7 +472,7 @@ static uint16_t ProcessRegWrite(uint8_t regAddr, uint8_t regValue)
 		}
 
 		/* Any registers which require filtering or special actions in main loop */
-		if(regIndex == IMU_SPI_CONFIG_REG)
+		if(regIndex == IMU_SPI_CONFIG_REG || regIndex == IMU_BURST_CONFIG_REG)
 		{
 			if(isUpper)
 			{
@@ -287,8 +494,12 @@ static uint16_t ProcessRegWrite(uint8_t regAddr, uint8_t regValue)
 		}
 		else if(regIndex == DIO_INPUT_CONFIG_REG)
 		{
-			/* No updating needed, we only use the DR_POLARITY register
-			 * and both 0 and 1 are valid values */
+			/* DR polarity is applied at capture start. PPS settings
+			 * are applied from the main loop */
+			if(isUpper)
+			{
+				g_update_flags |= DIO_INPUT_CONFIG_FLAG;
+			}
 		}
 		else if(regIndex == USER_COMMAND_REG)
 		{
@@ -323,7 +534,7 @@ static uint16_t ProcessRegWrite(uint8_t regAddr, uint8_t regValue)
 			if(regValue == 0)
 			{
 				/* Clear buffer for writes of 0 to count */
-				Buffer_Reset();
+				Data_Capture_Reset_Buffer();
 				return regIndex;
 			}
 			else
@@ -367,13 +578,20 @@ static uint16_t ProcessRegWrite(uint8_t regAddr, uint8_t regValue)
 	/* Apply to reg array */
 	g_regs[regIndex] = regWriteVal;
 
+	/* IMU pages are passed through to the selected IMU */
+	if(regIndex == IMU_DEV_CONFIG_REG)
+	{
+		IMU_Select_Device((regWriteVal & IMU_DEV_SELECT_MASK) >> IMU_DEV_SELECT_BITP);
+	}
+
 	/* Check for buffer reset actions which should be performed in ISR */
-	if(regIndex == BUF_CONFIG_REG || regIndex == BUF_LEN_REG)
+	if(regIndex == BUF_CONFIG_REG || regIndex == BUF_LEN_REG || regIndex == BUF_MAX_SIZE_REG ||
+	   regIndex == IMU_DEV_CONFIG_REG)
 	{
 		if(isUpper)
 		{
 			/* Reset the buffer after writing upper half of register (applies new settings) */
-			Buffer_Reset();
+			Data_Capture_Reset_Buffer();
 		}
 	}
 
@@ -551,11 +769,15 @@ void Reg_Factory_Reset()
 	g_regs[WATERMARK_INT_CONFIG_REG] = WATER_INT_CONFIG_DEFAULT;
 	g_regs[ERROR_INT_CONFIG_REG] = ERROR_INT_CONFIG_DEFAULT;
 	g_regs[IMU_SPI_CONFIG_REG] = IMU_SPI_CONFIG_DEFAULT;
+	g_regs[IMU_BURST_CONFIG_REG] = IMU_BURST_CONFIG_DEFAULT;
 	g_regs[USER_SPI_CONFIG_REG] = USER_SPI_CONFIG_DEFAULT;
 	g_regs[FW_REV_REG] = FW_REV_DEFAULT;
 	g_regs[CLI_CONFIG_REG] = CLI_CONFIG_DEFAULT;
 	g_regs[BTN_CONFIG_REG] = BTN_CONFIG_DEFAULT;
 	g_regs[SYNC_FREQ_REG] = SYNC_FREQ_DEFAULT;
+	g_regs[USB_TX_SIZE_REG] = USB_TX_SIZE_DEFAULT;
+	g_regs[USB_TX_DEADLINE_REG] = USB_TX_DEADLINE_DEFAULT;
+	g_regs[FILT_CONFIG_REG] = FILT_CONFIG_DEFAULT;
 
 	/* Apply endurance and flash sig back */
 	g_regs[ENDURANCE_REG] = endurance;
@@ -565,8 +787,17 @@ void Reg_Factory_Reset()
 	/* Populate SN and build date */
 	Reg_Update_Identifiers();
 
+	/* Register access goes back to the first IMU */
+	IMU_Select_Device(0);
+
 	/* Apply all settings and reset buffer */
-	Buffer_Reset();
+	IMU_Update_SPI_Config();
+	Dio_Update_Config();
+	Timer_Update_PPS_Config();
+	TimeSync_Reset();
+	Sync_Gen_Stop();
+	Script_Stop();
+	Data_Capture_Reset_Buffer();
 }
 
 /**
@@ -593,7 +824,7 @@ void Reg_Process_Command()
 	}
 	else if(command & CMD_CLEAR_BUFFER)
 	{
-		Buffer_Reset();
+		Data_Capture_Reset_Buffer();
 	}
 	else if(command & CMD_FACTORY_RESET)
 	{
@@ -603,4 +834,35 @@ void Reg_Process_Command()
 	{
 		IMU_Reset();
 	}
+	else if(command & CMD_PPS_ENABLE)
+	{
+		Timer_Enable_PPS();
+	}
+	else if(command & CMD_PPS_DISABLE)
+	{
+		Timer_Disable_PPS();
+	}
+	else if(command & CMD_START_SCRIPT)
+	{
+		Script_Start();
+	}
+	else if(command & CMD_STOP_SCRIPT)
+	{
+		Script_Stop();
+	}
+	else if(command & CMD_SYNC_GEN)
+	{
+		/* Restarts at SYNC_FREQ, or stops if it is 0 */
+		Sync_Gen_Start();
+	}
+	else if(command & CMD_SPI_CALIBRATE)
+	{
+		/* Needs the bus to itself */
+		Data_Capture_Disable();
+		if(!IMU_Calibrate_Burst_Speed())
+		{
+			g_regs[STATUS_0_REG] |= STATUS_SPI_ERROR;
+			g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+		}
+	}
 }
@@ -1,21 +1,35 @@
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "script.h"
 #include "reg.h"
 #include "usb.h"
 #include "timer.h"
+#include "buffer.h"
+#include "timesync.h"
+#include "imu.h"
 
 /* Private function prototypes */
 static uint32_t ParseCommandArgs(const uint8_t* commandBuf, uint32_t* args);
 static void ReadHandler(script* scr, uint8_t* outBuf);
+static void ReadService();
+static void SelectReadPage();
 static void ReadBufHandler();
+static void ReadBufBinaryHandler();
+static void SendBinaryPacket(uint32_t numEntries, uint32_t entrySize);
+static void SendSofPacket();
 static void RegAliasReadHandler(uint8_t* outBuf, uint16_t regIndex);
 static void WriteHandler(script* scr);
 static void StreamCmdHandler(script * scr);
 static void AboutHandler(uint8_t* outBuf);
 static void UptimeHandler(uint8_t* outBuf);
 static void IncrementHandler();
+static void TimeSyncHandler(script* scr, uint8_t* outBuf);
 static void FactoryResetHandler();
+static void ScriptAddHandler();
+static void ScriptClearHandler();
+static void ScriptError(uint16_t error);
+static uint32_t CheckScriptLoops();
 static void UShortToHex(uint8_t* outBuf, uint16_t val);
 static uint32_t HexToUInt(const uint8_t* commandBuf);
 static uint32_t StringEquals(const uint8_t* string0, const uint8_t* string1, uint32_t count);
@@ -23,6 +37,68 @@ static uint32_t StringEquals(const uint8_t* string0, const uint8_t* string1, uin
 /** Buffer A for stream data (USB or SD card) ping/pong */
 static uint8_t StreamBuf[STREAM_BUF_SIZE];
 
+/** Raw (pre COBS) binary buffer packet */
+static uint8_t PacketBuf[BIN_PKT_MAX_SIZE];
+
+/** Binary buffer packet sequence number */
+static uint16_t PacketSeq;
+
+/** SOF count of the last start of frame timestamp packet */
+static uint32_t LastSofCount;
+
+/** Stored script, uploaded with scradd and run with CMD_START_SCRIPT */
+static script ScriptStore[SCRIPT_MAX_LINES];
+
+/** Number of elements in the script store */
+static uint32_t ScriptLen;
+
+/** Next script store element to run */
+static uint32_t ScriptLine;
+
+/** Track if the stored script is running */
+static uint32_t ScriptRunning;
+
+/** Track if the script is waiting on a sleep element */
+static uint32_t ScriptSleeping;
+
+/** End time of the current sleep element */
+static absolute_time_t ScriptWakeTime;
+
+/** First element of each open loop in the running script */
+static uint32_t LoopStart[SCRIPT_MAX_LOOP_DEPTH];
+
+/** Remaining passes of each open loop in the running script */
+static uint32_t LoopRemaining[SCRIPT_MAX_LOOP_DEPTH];
+
+/** Number of open loops in the running script */
+static uint32_t LoopDepth;
+
+/** Element parsed from the current scradd command, copied to the store when run */
+static script ScriptAddElement;
+
+/** Output buffer for elements run by the script executor */
+static uint8_t ScriptOutBuf[STREAM_BUF_SIZE];
+
+/** Read element in progress, waiting on queued IMU register reads (see Script_Element_Done()) */
+static uint32_t ReadActive;
+
+/** Track if the current read pass is queued to the capture core */
+static uint32_t ReadQueued;
+
+/** Arguments, output buffer and pass of the read in progress */
+static script ReadElement;
+static uint8_t* ReadOutBuf;
+static uint32_t ReadPass;
+
+/** Output position and byte count of the read in progress */
+static uint8_t* ReadBufPtr;
+static uint32_t ReadCount;
+
+/** Register addresses and values for one pass of the read in progress */
+static uint8_t ReadAddrs[READ_MAX_REGS];
+static uint16_t ReadVals[READ_MAX_REGS];
+static uint32_t ReadNumRegs;
+
 /** Current index within command buffer */
 static uint32_t cmdIndex;
 
@@ -80,6 +156,15 @@ static const uint8_t CommandCmd[] = "cmd ";
 /** String literal for incrementing PPS timer command. */
 static const uint8_t IncrementCmd[] = "inc";
 
+/** String literal for host time sync command. Must be followed by a space */
+static const uint8_t TimeSyncCmd[] = "tsync ";
+
+/** String literal for script element add command. Must be followed by a space */
+static const uint8_t ScrAddCmd[] = "scradd ";
+
+/** String literal for script clear command */
+static const uint8_t ScrClearCmd[] = "scrclear";
+
 /** Print string for invalid command */
 static const uint8_t InvalidCmdStr[] = "Error: Invalid command! Type help for list of valid commands\r\n";
 
@@ -89,6 +174,15 @@ static const uint8_t NotAllowedStr[] = "Error: Command not allowed from USB! Typ
 /** Print string for invalid argument */
 static const uint8_t InvalidArgStr[] = "Error: Invalid argument!\r\n";
 
+/** Print string for script upload while running */
+static const uint8_t ScriptBusyStr[] = "Error: Script running! Stop the script before changing it\r\n";
+
+/** Print string for script store full */
+static const uint8_t ScriptFullStr[] = "Error: Script store full!\r\n";
+
+/** Print string for IMU page access in a PIO capture mode */
+static const uint8_t ImuBusyStr[] = "Error: IMU registers not accessible in this capture mode! Select a config page first\r\n";
+
 /** Print string for unexpected processing */
 static const uint8_t UnknownErrorStr[] = "An unknown error has occurred!\r\n";
 
@@ -107,16 +201,30 @@ static const uint8_t HelpStr[] = "\r\n"
 		"\r\n"
 		"read <startAddr> [endAddr = startAddr] [numReads = 1]\r\n"
 		"   Read registers starting at <startAddr> and ending at <endAddr>, <numReads> times\r\n"
+		"   IMU pages may be read and written while capture runs, except in the PIO capture modes\r\n"
 		"write <addr> <value>\r\n"
 		"   Writes the 8-bit <value> to the register at address <addr>\r\n"
 		"readbuf\r\n"
 		"   Reads all stored buffer entries. Values for each buffer entry are each placed on a new line\r\n"
 		"stream <startStop>\r\n"
-		"   Stops the buffered read stream if <startStop> is zero, otherwise the stream is enabled\r\n"
+		"   Stops the buffered read stream if <startStop> is zero, otherwise the stream is enabled.\r\n"
+		"   Set CLI_CONFIG bit 4 for COBS framed binary packets instead of hex text,\r\n"
+		"   or bit 5 to send the binary packets on the vendor bulk IN endpoint (0x83)\r\n"
+		"   Binary streams also carry a USB frame number timestamp packet every second\r\n"
 		"cnt\r\n"
 		"   Read the number of IMU samples currently stored in the buffer\r\n"
 		"inc\r\n"
 		"   Increments the PPS counter\r\n"
+		"tsync <hostTime> [lastRxTime]\r\n"
+		"   Host time sync exchange. <hostTime> is the host send time, <lastRxTime> the host receive\r\n"
+		"   time of the previous tsync reply (host monotonic us, lower 32 bits). Replies with\r\n"
+		"   <hostTime>, then the device receive and transmit times. Estimates are in TSYNC regs\r\n"
+		"\r\n"
+		"scradd <command>\r\n"
+		"   Appends <command> to the stored script. Scripts may also use sleep <ms>, loop <count> and endloop\r\n"
+		"   Run the stored script with cmd 40, stop it with cmd 80. Progress is in SCR_LINE / SCR_ERROR\r\n"
+		"scrclear\r\n"
+		"   Clears the stored script\r\n"
 		"\r\n"
 		"cmd <cmdValue>\r\n"
 		"   Writes the 16-bit <cmdValue> to the iSensor-SPI-Buffer COMMAND register. Does not change the selected register page\r\n"
@@ -141,6 +249,10 @@ void Script_Check_Stream()
 {
 	uint16_t watermarkLevel = g_regs[WATERMARK_INT_CONFIG_REG] & ~WATERMARK_PULSE_MASK;
 
+	/* Hold the stream while a read reply is still being sent */
+	if(!Script_Element_Done())
+		return;
+
 	/* Min. water mark for stream is 1. Want to allow general value of zero for timing char */
 	if(watermarkLevel == 0)
 		watermarkLevel = 1;
@@ -154,6 +266,132 @@ void Script_Check_Stream()
 	}
 }		
 
+/**
+  * @brief Start the stored script from the first element
+  *
+  * @return void
+  *
+  * Called on CMD_START_SCRIPT. The loop structure is checked up front,
+  * so a bad script flags SCR_ERROR without running any elements. A
+  * running script is restarted.
+  */
+void Script_Start()
+{
+	uint32_t badLine;
+
+	Script_Stop();
+
+	g_regs[SCR_ERROR_REG] = SCR_ERROR_NONE;
+	g_regs[SCR_LINE_REG] = 0;
+
+	if(ScriptLen == 0)
+	{
+		ScriptError(SCR_ERROR_EMPTY);
+		return;
+	}
+
+	badLine = CheckScriptLoops();
+	if(badLine < ScriptLen)
+	{
+		g_regs[SCR_LINE_REG] = badLine;
+		ScriptError(SCR_ERROR_LOOP);
+		return;
+	}
+
+	ScriptLine = 0;
+	LoopDepth = 0;
+	ScriptRunning = 1;
+	g_regs[STATUS_0_REG] |= STATUS_SCR_RUNNING;
+	g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
+/**
+  * @brief Stop the running script
+  *
+  * @return void
+  *
+  * Called on CMD_STOP_SCRIPT, at the end of the script, and on factory
+  * reset. SCR_LINE keeps the last element which was run.
+  */
+void Script_Stop()
+{
+	ScriptRunning = 0;
+	ScriptSleeping = 0;
+	g_regs[STATUS_0_REG] &= ~STATUS_SCR_RUNNING;
+	g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
+/**
+  * @brief Run the next element of the stored script
+  *
+  * @return void
+  *
+  * Called once per main loop pass. At most one element is run per call,
+  * and a sleep element only sets a wake time, so the main loop keeps
+  * servicing USB, streams and register updates while the script waits.
+  * Loop / endloop are handled here, everything else goes through
+  * Script_Run_Element().
+  */
+void Script_Step()
+{
+	script* scr;
+	uint32_t line;
+
+	if(!ScriptRunning)
+		return;
+
+	if(!Script_Element_Done())
+		return;
+
+	if(ScriptSleeping)
+	{
+		if(!time_reached(ScriptWakeTime))
+			return;
+		ScriptSleeping = 0;
+	}
+
+	if(ScriptLine >= ScriptLen)
+	{
+		Script_Stop();
+		return;
+	}
+
+	/* Advance before running, the element may restart or stop the script */
+	line = ScriptLine;
+	scr = &ScriptStore[line];
+	ScriptLine++;
+	g_regs[SCR_LINE_REG] = line;
+
+	switch(scr->scrCommand)
+	{
+		case sleep:
+			ScriptWakeTime = make_timeout_time_ms(scr->args[0]);
+			ScriptSleeping = 1;
+			break;
+		case loop:
+			/* Nesting is checked in Script_Start() */
+			LoopStart[LoopDepth] = ScriptLine;
+			LoopRemaining[LoopDepth] = scr->args[0];
+			LoopDepth++;
+			break;
+		case endloop:
+			if(LoopDepth == 0)
+			{
+				ScriptError(SCR_ERROR_LOOP);
+				break;
+			}
+			LoopRemaining[LoopDepth - 1]--;
+			if(LoopRemaining[LoopDepth - 1])
+				ScriptLine = LoopStart[LoopDepth - 1];
+			else
+				LoopDepth--;
+			break;
+		default:
+			Script_Run_Element(scr, ScriptOutBuf);
+			break;
+	}
+}
+
 /**
   * @brief Parse a command string into a script element
   *
@@ -313,6 +551,43 @@ void Script_Parse_Element(const uint8_t* commandBuf, script * scr)
 		return;
 	}
 
+	if(StringEquals(commandBuf, TimeSyncCmd, sizeof(TimeSyncCmd) - 1))
+	{
+		scr->scrCommand = tsync;
+		/* 1 - 2 args (host send time, host receive time of last reply) */
+		scr->numArgs = ParseCommandArgs(commandBuf, scr->args);
+		/* Check that we got at least 1 argument */
+		if(scr->numArgs == 0)
+			scr->invalidArgs = 1;
+		return;
+	}
+
+	if(StringEquals(commandBuf, ScrAddCmd, sizeof(ScrAddCmd) - 1))
+	{
+		scr->scrCommand = scradd;
+		/* Script element to add follows the command */
+		Script_Parse_Element(commandBuf + sizeof(ScrAddCmd) - 1, &ScriptAddElement);
+		if(ScriptAddElement.scrCommand >= invalid)
+		{
+			scr->scrCommand = invalid;
+		}
+		/* Script store commands can't be stored */
+		else if(ScriptAddElement.invalidArgs ||
+				ScriptAddElement.scrCommand == scradd ||
+				ScriptAddElement.scrCommand == scrclear)
+		{
+			scr->invalidArgs = 1;
+		}
+		return;
+	}
+
+	if(StringEquals(commandBuf, ScrClearCmd, sizeof(ScrClearCmd) - 1))
+	{
+		scr->scrCommand = scrclear;
+		/* No args */
+		return;
+	}
+
 	if(StringEquals(commandBuf, AboutCmd, sizeof(AboutCmd) - 1))
 	{
 		scr->scrCommand = about;
@@ -336,8 +611,8 @@ void Script_Parse_Element(const uint8_t* commandBuf, script * scr)
 		scr->scrCommand = loop;
 		/* 1 arg (number of loops) */
 		scr->numArgs = ParseCommandArgs(commandBuf, scr->args);
-		/* Check that we got at least 1 argument */
-		if(scr->numArgs == 0)
+		/* Check that we got at least 1 argument, number of loops can't be 0 */
+		if(scr->numArgs == 0 || scr->args[0] == 0)
 			scr->invalidArgs = 1;
 		return;
 	}
@@ -389,7 +664,7 @@ void Script_Run_Element(script* scr, uint8_t * outBuf)
 		return;
 	}
 
-	/* Squash script elements not handled here (sleep, looping) */
+	/* Squash script elements not handled here (sleep, looping). See Script_Step() */
 	if(scr->scrCommand > help)
 	{
 		/* Transmit error and return */
@@ -459,6 +734,15 @@ void Script_Run_Element(script* scr, uint8_t * outBuf)
 		case increment:
 			IncrementHandler();
 			break;
+		case tsync:
+			TimeSyncHandler(scr, outBuf);
+			break;
+		case scradd:
+			ScriptAddHandler();
+			break;
+		case scrclear:
+			ScriptClearHandler();
+			break;
 		default:
 			/* Should not get here. Transmit error and return */
 			USB_Tx_Handler(UnknownErrorStr, sizeof(UnknownErrorStr));
@@ -483,6 +767,10 @@ static void StreamCmdHandler(script * scr)
 	if(scr->args[0])
 	{
 		g_regs[CLI_CONFIG_REG] |= USB_STREAM_BITM;
+		/* Binary packets restart at sequence 0 with each stream, and start
+		 * with an SOF timestamp */
+		PacketSeq = 0;
+		LastSofCount = 0;
 	}
 	else
 	{
@@ -505,6 +793,103 @@ static void FactoryResetHandler()
 	Reg_Process_Command();
 }
 
+/**
+  * @brief Append the element parsed by the last scradd command to the script store
+  *
+  * @return void
+  *
+  * The store can't change while the script is running. Errors are
+  * reported on the CLI and in SCR_ERROR.
+  */
+static void ScriptAddHandler()
+{
+	if(ScriptRunning)
+	{
+		g_regs[SCR_ERROR_REG] = SCR_ERROR_BUSY;
+		USB_Tx_Handler(ScriptBusyStr, sizeof(ScriptBusyStr));
+		return;
+	}
+
+	if(ScriptLen >= SCRIPT_MAX_LINES)
+	{
+		g_regs[SCR_ERROR_REG] = SCR_ERROR_FULL;
+		USB_Tx_Handler(ScriptFullStr, sizeof(ScriptFullStr));
+		return;
+	}
+
+	ScriptStore[ScriptLen] = ScriptAddElement;
+	ScriptLen++;
+}
+
+/**
+  * @brief Clear the script store
+  *
+  * @return void
+  */
+static void ScriptClearHandler()
+{
+	if(ScriptRunning)
+	{
+		g_regs[SCR_ERROR_REG] = SCR_ERROR_BUSY;
+		USB_Tx_Handler(ScriptBusyStr, sizeof(ScriptBusyStr));
+		return;
+	}
+
+	ScriptLen = 0;
+	g_regs[SCR_LINE_REG] = 0;
+	g_regs[SCR_ERROR_REG] = SCR_ERROR_NONE;
+}
+
+/**
+  * @brief Stop the script and flag a script error
+  *
+  * @param error SCR_ERROR value to set
+  *
+  * @return void
+  */
+static void ScriptError(uint16_t error)
+{
+	Script_Stop();
+	g_regs[SCR_ERROR_REG] = error;
+	g_regs[STATUS_0_REG] |= STATUS_SCR_ERROR;
+	g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
+/**
+  * @brief Check that the stored script loop / endloop elements are balanced
+  *
+  * @return Index of the first bad element, or ScriptLen if the loops are valid
+  */
+static uint32_t CheckScriptLoops()
+{
+	uint32_t depth = 0;
+	uint32_t openLine = 0;
+
+	for(uint32_t i = 0; i < ScriptLen; i++)
+	{
+		if(ScriptStore[i].scrCommand == loop)
+		{
+			if(depth >= SCRIPT_MAX_LOOP_DEPTH)
+				return i;
+			if(depth == 0)
+				openLine = i;
+			depth++;
+		}
+		else if(ScriptStore[i].scrCommand == endloop)
+		{
+			if(depth == 0)
+				return i;
+			depth--;
+		}
+	}
+
+	/* Loop left open, flag the outermost */
+	if(depth)
+		return openLine;
+
+	return ScriptLen;
+}
+
 /**
   * @brief Read command handler
   *
@@ -521,66 +906,121 @@ static void FactoryResetHandler()
   */
 static void ReadHandler(script* scr, uint8_t* outBuf)
 {
-	/* Pointer within write buffer */
-	uint8_t* writeBufPtr;
-
-	/* Register read value */
-	uint16_t readVal;
-
-	/* Buffer byte count */
-	uint32_t count;
-
 	/* Init buffer variables */
-	writeBufPtr = outBuf;
-	count = 0;
+	ReadElement = *scr;
+	ReadOutBuf = outBuf;
+	ReadBufPtr = outBuf;
+	ReadCount = 0;
+	ReadPass = 0;
+	ReadQueued = 0;
+
+	/* Build address list (one page at most) */
+	ReadNumRegs = 0;
+	for(uint32_t addr = scr->args[0]; (addr <= scr->args[1]) && (ReadNumRegs < READ_MAX_REGS); addr += 2)
+	{
+		ReadAddrs[ReadNumRegs++] = addr;
+	}
 
 	/* Perform read */
-	for(int i = 0; i < scr->args[2]; i++)
+	ReadActive = 1;
+	ReadService();
+}
+
+/**
+  * @brief Run the read in progress as far as possible
+  *
+  * @return void
+  *
+  * While capture runs, IMU page reads are queued to the capture core. Each
+  * queued pass returns here to the main loop, and the read picks up again
+  * from Script_Element_Done() once the values are in.
+  */
+static void ReadService()
+{
+	while(ReadPass < ReadElement.args[2])
 	{
-		for(uint32_t addr = scr->args[0]; addr <= scr->args[1]; addr += 2)
+		if(ReadQueued)
+		{
+			if(!Reg_Access_Done())
+				return;
+			ReadQueued = 0;
+		}
+		else if(!Reg_Read_Multiple(ReadAddrs, ReadVals, ReadNumRegs))
 		{
-			readVal = Reg_Read(addr);
-			UShortToHex(writeBufPtr, readVal);
-			writeBufPtr[4] = g_regs[CLI_CONFIG_REG] >> CLI_DELIM_BITP;
-			writeBufPtr += 5;
-			count += 5;
+			ReadQueued = 1;
+			return;
+		}
+
+		/* PIO capture engine owns the IMU bus, values are not register data */
+		if(Reg_IMU_Access_Blocked())
+		{
+			USB_Tx_Handler(ReadOutBuf, ReadCount);
+			ReadCount = 0;
+			USB_Tx_Handler(ImuBusyStr, sizeof(ImuBusyStr));
+			break;
+		}
+
+		for(uint32_t reg = 0; reg < ReadNumRegs; reg++)
+		{
+			uint32_t addr = ReadAddrs[reg];
+			UShortToHex(ReadBufPtr, ReadVals[reg]);
+			ReadBufPtr[4] = g_regs[CLI_CONFIG_REG] >> CLI_DELIM_BITP;
+			ReadBufPtr += 5;
+			ReadCount += 5;
 			/* Check if transmit needed (not enough space for next loop) */
-			if((STREAM_BUF_SIZE - count) < 6)
+			if((STREAM_BUF_SIZE - ReadCount) < 6)
 			{
 				/* Check if at last read. If so, insert newline */
-				if((addr == scr->args[1])||(addr == (scr->args[1] - 1)))
+				if((addr == ReadElement.args[1])||(addr == (ReadElement.args[1] - 1)))
 				{
 					/* Move write pointer back one to last delim */
-					writeBufPtr -= 1;
+					ReadBufPtr -= 1;
 					/* Add newline */
-					writeBufPtr[0] = '\r';
-					writeBufPtr[1] = '\n';
-					writeBufPtr += 2;
+					ReadBufPtr[0] = '\r';
+					ReadBufPtr[1] = '\n';
+					ReadBufPtr += 2;
 					/* Only one new char added */
-					count += 1;
+					ReadCount += 1;
 				}
-				USB_Tx_Handler(outBuf, count);
+				USB_Tx_Handler(ReadOutBuf, ReadCount);
 				/* Reset pointers */
-				writeBufPtr = outBuf;
-				count = 0;
+				ReadBufPtr = ReadOutBuf;
+				ReadCount = 0;
 			}
 		}
-		if(count != 0)
+		if(ReadCount != 0)
 		{
 			/* Move write pointer back one to last delim */
-			writeBufPtr -= 1;
+			ReadBufPtr -= 1;
 			/* Add newline */
-			writeBufPtr[0] = '\r';
-			writeBufPtr[1] = '\n';
-			writeBufPtr += 2;
+			ReadBufPtr[0] = '\r';
+			ReadBufPtr[1] = '\n';
+			ReadBufPtr += 2;
 			/* Only one new char added */
-			count += 1;
+			ReadCount += 1;
 		}
+		ReadPass++;
 	}
 	/* transmit any remainder data */
-	USB_Tx_Handler(outBuf, count);
+	USB_Tx_Handler(ReadOutBuf, ReadCount);
+	ReadActive = 0;
 }
 
+/**
+  * @brief Finish the element run last, if it is waiting on queued IMU register access
+  *
+  * @return true once it has finished, so the next element may run
+  *
+  * While capture runs, IMU page reads and writes are queued to the capture
+  * core and the main loop keeps going. The USB CLI, the stream and the
+  * stored script hold off until this returns true.
+  */
+bool Script_Element_Done()
+{
+	if(ReadActive)
+		ReadService();
+	return !ReadActive && Reg_Access_Done();
+}
 
 /**
   * @brief Write command handler
@@ -602,6 +1042,12 @@ static void WriteHandler(script* scr)
 
 	/* Perform write */
 	Reg_Write(scr->args[0], scr->args[1]);
+
+	/* PIO capture engine owns the IMU bus, write was dropped */
+	if(Reg_IMU_Access_Blocked())
+	{
+		USB_Tx_Handler(ImuBusyStr, sizeof(ImuBusyStr));
+	}
 }
 
 /**
@@ -609,72 +1055,216 @@ static void WriteHandler(script* scr)
   *
   * @return void
   *
-  * This function uses a ping-pong architecture for the buffer transmit
-  * data. This avoids potential data corruption issues (USB transmit is non-blocking)
+  * Buffer entries are retrieved as contiguous spans and formatted directly
+  * from the buffer memory, instead of being dequeued to the output registers
+  * one at a time. The last entry read remains loaded to the output registers.
   */
 static void ReadBufHandler()
 {
+	if(g_regs[CLI_CONFIG_REG] & (USB_BINARY_BITM | USB_BULK_BITM))
+	{
+		ReadBufBinaryHandler();
+		return;
+	}
+
 	uint8_t *writeBufPtr = StreamBuf;
-	uint16_t readVal;
-	uint32_t addr, buf, numBufs, bufLastAddr, count;
+	uint8_t *entry;
+	uint16_t entryWords[(BUF_MAX_ENTRY + 10) >> 1];
+	uint32_t word, numBufs, spanCount, wordsPerEntry, count;
 
-	numBufs = g_regs[BUF_CNT_0_REG];
-	bufLastAddr = g_regs[BUF_LEN_REG] + BUF_DATA_BASE_ADDR;
+	numBufs = Buffer_Get_Count();
+	/* Timestamp (4 words), signature (1 word), then data */
+	wordsPerEntry = (g_regs[BUF_LEN_REG] >> 1) + 5;
 	count = 0;
 
 	/* Set page to 255 (if not already) */
-	if(Reg_Read(0) != BUF_READ_PAGE)
-	{
-		Reg_Write(0, BUF_READ_PAGE);
-	}
+	SelectReadPage();
 
-	for(buf = 0; buf < numBufs; buf++)
+	while(numBufs)
 	{
-		Reg_Buf_Dequeue_To_Outputs();
-		for(addr = BUF_BASE_ADDR; addr <= bufLastAddr; addr += 2)
+		Buffer_Take_Span(numBufs, &entry, &spanCount);
+		if(spanCount == 0)
+			break;
+
+		for(uint32_t i = 0; i < spanCount; i++)
 		{
-			readVal = Reg_Read(addr);
-			UShortToHex(writeBufPtr, readVal);
-			writeBufPtr[4] = g_regs[CLI_CONFIG_REG] >> CLI_DELIM_BITP;
-			writeBufPtr += 5;
-			count += 5;
-			if((STREAM_BUF_SIZE - count) < 6)
+			/* Format from a copy, the producer may replace the entry while USB output blocks */
+			memcpy(entryWords, entry, wordsPerEntry << 1);
+			if(!Buffer_Span_Intact(i))
 			{
-				/* Check if at last read. If so, insert newline */
-				if((addr == bufLastAddr)||(addr == (bufLastAddr - 1)))
+				entry += (g_bufNumWords32 << 2);
+				continue;
+			}
+			for(word = 0; word < wordsPerEntry; word++)
+			{
+				UShortToHex(writeBufPtr, entryWords[word]);
+				if(word == (wordsPerEntry - 1))
 				{
-					/* Move write pointer back one to last delim */
-					writeBufPtr -= 1;
-					/* Add newline */
-					writeBufPtr[0] = '\r';
-					writeBufPtr[1] = '\n';
-					writeBufPtr += 2;
-					/* Only one new char added */
-					count += 1;
+					/* Last value in entry, end the line */
+					writeBufPtr[4] = '\r';
+					writeBufPtr[5] = '\n';
+					writeBufPtr += 6;
+					count += 6;
+				}
+				else
+				{
+					writeBufPtr[4] = g_regs[CLI_CONFIG_REG] >> CLI_DELIM_BITP;
+					writeBufPtr += 5;
+					count += 5;
+				}
+				/* Check if transmit needed (not enough space for next value) */
+				if((STREAM_BUF_SIZE - count) < 6)
+				{
+					USB_Tx_Handler(StreamBuf, count);
+					count = 0;
+					writeBufPtr = StreamBuf;
 				}
+			}
+			/* Keep last entry loaded to output registers */
+			g_CurrentBufEntry = (uint16_t *) entry;
+			entry += (g_bufNumWords32 << 2);
+		}
+		Buffer_Release_Span(spanCount);
+		numBufs -= spanCount;
+	}
+	/* Transmit any residual data */
+	USB_Tx_Handler(StreamBuf, count);
+}
 
-				/* Perform transmit */
-				USB_Tx_Handler(StreamBuf, count);
-				count = 0;
-				writeBufPtr = StreamBuf;
+/**
+  * @brief Select page 255 (starts capture) before reading the buffer
+  *
+  * @return void
+  *
+  * An IMU page selected while capture already runs is kept, so the stream
+  * doesn't undo a page switch made for IMU register access.
+  */
+static void SelectReadPage()
+{
+	if((Reg_Get_Page() != BUF_READ_PAGE) && !IMU_SPI_Is_Capturing())
+	{
+		Reg_Write(0, BUF_READ_PAGE);
+	}
+}
+
+/**
+  * @brief Binary read buffer handler
+  *
+  * @return void
+  *
+  * Sends all stored buffer entries as framed binary packets, with as many
+  * raw entries per packet as fit (see BIN_PKT_MAX_SIZE). Selected with the
+  * USB_BINARY bit in CLI_CONFIG. Replaces 5 hex/delimiter chars per word
+  * with 2 bytes, plus a small per packet overhead.
+  */
+static void ReadBufBinaryHandler()
+{
+	uint8_t *entry;
+	uint32_t numBufs, spanCount, entrySize, entriesPerPacket, numEntries;
+
+	numBufs = Buffer_Get_Count();
+	/* Timestamp (8 bytes), signature (2 bytes), then data */
+	entrySize = g_regs[BUF_LEN_REG] + 10;
+	entriesPerPacket = (BIN_PKT_MAX_SIZE - BIN_PKT_HEADER_SIZE - BIN_PKT_CRC_SIZE) / entrySize;
+	numEntries = 0;
+
+	/* Set page to 255 (if not already) */
+	SelectReadPage();
+
+	/* Periodic USB frame timestamp, before any entries are packed into PacketBuf */
+	SendSofPacket();
+
+	while(numBufs)
+	{
+		Buffer_Take_Span(numBufs, &entry, &spanCount);
+		if(spanCount == 0)
+			break;
+
+		for(uint32_t i = 0; i < spanCount; i++)
+		{
+			memcpy(&PacketBuf[BIN_PKT_HEADER_SIZE + numEntries * entrySize], entry, entrySize);
+			/* Drop the copy if the producer replaced the entry while it was read */
+			if(!Buffer_Span_Intact(i))
+			{
+				entry += (g_bufNumWords32 << 2);
+				continue;
 			}
+			numEntries++;
+			if(numEntries == entriesPerPacket)
+			{
+				SendBinaryPacket(numEntries, entrySize);
+				numEntries = 0;
+			}
+			/* Keep last entry loaded to output registers */
+			g_CurrentBufEntry = (uint16_t *) entry;
+			entry += (g_bufNumWords32 << 2);
 		}
-		if(count != 0)
+		Buffer_Release_Span(spanCount);
+		numBufs -= spanCount;
+	}
+	/* Transmit any residual entries */
+	if(numEntries)
+		SendBinaryPacket(numEntries, entrySize);
+	if(g_regs[CLI_CONFIG_REG] & USB_BULK_BITM)
+		USB_Bulk_Flush();
+}
+
+/**
+  * @brief Add the header and CRC to a binary packet, then COBS encode and transmit it
+  *
+  * @param numEntries Number of entries in PacketBuf. 0 for an SOF timestamp packet
+  *
+  * @param entrySize Size of each entry (or the SOF payload), in bytes
+  *
+  * @return void
+  */
+static void SendBinaryPacket(uint32_t numEntries, uint32_t entrySize)
+{
+	uint32_t len = BIN_PKT_HEADER_SIZE + (numEntries ? numEntries : 1) * entrySize;
+	uint32_t codeIndex, out;
+	uint16_t crc;
+
+	PacketBuf[0] = PacketSeq & 0xFF;
+	PacketBuf[1] = PacketSeq >> 8;
+	PacketBuf[2] = numEntries;
+	PacketBuf[3] = entrySize;
+	PacketSeq++;
+
+	crc = Buffer_Calc_CRC(PacketBuf, len);
+	PacketBuf[len++] = crc & 0xFF;
+	PacketBuf[len++] = crc >> 8;
+
+	/* COBS encode, so 0x00 only ever appears as the packet delimiter */
+	codeIndex = 0;
+	out = 1;
+	for(uint32_t i = 0; i < len; i++)
+	{
+		if(PacketBuf[i] == 0)
 		{
-			/* Move write pointer back one to last delim */
-			writeBufPtr -= 1;
-			/* Add newline */
-			writeBufPtr[0] = '\r';
-			writeBufPtr[1] = '\n';
-			writeBufPtr += 2;
-			/* Only one new char added */
-			count += 1;
+			StreamBuf[codeIndex] = out - codeIndex;
+			codeIndex = out++;
+		}
+		else
+		{
+			StreamBuf[out++] = PacketBuf[i];
+			if((out - codeIndex) == 0xFF)
+			{
+				StreamBuf[codeIndex] = 0xFF;
+				codeIndex = out++;
+			}
 		}
 	}
-	/* Transmit any residual data */
-	USB_Tx_Handler(StreamBuf, count);
+	StreamBuf[codeIndex] = out - codeIndex;
+	StreamBuf[out++] = 0;
+
+	/* Vendor bulk endpoint, or the CLI CDC port */
+	if(g_regs[CLI_CONFIG_REG] & USB_BULK_BITM)
+		USB_Bulk_Tx(StreamBuf, out);
+	else
+		USB_Tx_Handler(StreamBuf, out);
 }
 
+
 /**
   * @brief Read a register without changing page, and print to CLI
   *
@@ -753,6 +1343,82 @@ static void UptimeHandler(uint8_t* outBuf)
 	USB_Tx_Handler(outBuf, len);
 }
 
+/**
+  * @brief Sends a USB start of frame timestamp packet, if one is due
+  *
+  * @return void
+  *
+  * Sent when the first SOF has been timestamped, then every USB_SOF_PACKET_PERIOD
+  * frames. Must be called before any buffer entries are placed in PacketBuf.
+  */
+static void SendSofPacket()
+{
+	uint8_t* payload = &PacketBuf[BIN_PKT_HEADER_SIZE];
+	uint32_t count, seconds, microseconds;
+	uint16_t frame;
+
+	count = USB_Get_SOF_Stamp(&frame, &seconds, &microseconds);
+	if((count == 0) || (LastSofCount && (count - LastSofCount < USB_SOF_PACKET_PERIOD)))
+		return;
+	LastSofCount = count;
+
+	payload[0] = frame & 0xFF;
+	payload[1] = frame >> 8;
+	for(uint32_t i = 0; i < 4; i++)
+	{
+		payload[2 + i] = seconds >> (8 * i);
+		payload[6 + i] = microseconds >> (8 * i);
+	}
+	SendBinaryPacket(0, BIN_SOF_SIZE);
+}
+
+/**
+  * @brief Host time sync exchange from CLI
+  *
+  * @param scr Script element. args[0] is the host send time (t1), args[1] (optional)
+  * the host receive time (t4) of the previous reply
+  *
+  * @param outBuf Output buffer
+  *
+  * @return void
+  *
+  * Replies with t1, the device receive time t2 and the device transmit time t3,
+  * in hex, separated by the CLI delimiter. t2 is when the command packet arrived
+  * (USB interrupt), so main loop and parse latency count as device turnaround
+  * instead of path asymmetry. The reply is flushed right away so
+  * t3 is close to when it goes out on the bus. The previous exchange is
+  * completed with its t4 and passed to the host offset estimator.
+  */
+static void TimeSyncHandler(script* scr, uint8_t* outBuf)
+{
+	/* Previous exchange, waiting for its host receive time */
+	static uint32_t lastT1, lastT2, lastT3;
+	static uint32_t lastValid = 0;
+
+	uint32_t t2, t3, rxRaw, len;
+	uint8_t delim = (g_regs[CLI_CONFIG_REG] & CLI_DELIM_BITM) >> CLI_DELIM_BITP;
+
+	/* Stored scripts have no packet arrival time */
+	if(USB_Get_Command_Rx_Time(&rxRaw))
+		t2 = TimeSync_Raw_To_Device_Time(rxRaw);
+	else
+		t2 = TimeSync_Get_Device_Time();
+
+	if(lastValid && (scr->numArgs > 1))
+		TimeSync_Update(lastT1, lastT2, lastT3, scr->args[1]);
+
+	t3 = TimeSync_Get_Device_Time();
+	len = sprintf((char *) outBuf, "%08X%c%08X%c%08X\r\n",
+			(unsigned int) scr->args[0], delim, (unsigned int) t2, delim, (unsigned int) t3);
+	USB_Tx_Handler(outBuf, len);
+	USB_Tx_Flush();
+
+	lastT1 = scr->args[0];
+	lastT2 = t2;
+	lastT3 = t3;
+	lastValid = 1;
+}
+
 /**
   * @brief Increment PPS time from CLI
   *
@@ -924,4 +1590,3 @@ static uint32_t StringEquals(const uint8_t* string0, const uint8_t* string1, uin
 	}
 	return 1;
 }
-
@@ -0,0 +1,205 @@
+/**
+  * @file sync_gen.c
+  * @brief SYNC clock output for externally clocked IMU sampling
+  *
+  * A pio1 state machine produces the clock (see sync_gen.pio). The length
+  * of every period is scheduled from an interrupt on core 0, so each sync
+  * edge lands on a grid of SYNC_FREQ points per second. The grid is anchored
+  * to the timer time base, which is the PPS PLL edge / period estimate when
+  * PPS is locked. So with PPS, the edges are phase locked to the PPS seconds
+  * (and the same on every board), and without it they free run from the
+  * crystal. Grid moves (PPS lock, UTC writes) are slewed in, so the IMU never
+  * sees a period more than 1/256 off nominal.
+  *
+  * Scheduling runs four periods ahead (TX FIFO depth), so corrections take
+  * effect four sync periods later.
+  */
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "sync_gen.pio.h"
+#include "reg.h"
+#include "timer.h"
+#include "sync_gen.h"
+
+/** Fractional bits of the schedule (1/256 cycle), same as the timer time base */
+#define SYNC_FRAC_BITS			8
+
+/** Generator state machine (pio1) and its program offset */
+static PIO Sync_Pio = pio1;
+static uint Sync_Sm;
+static uint Sync_Offset;
+
+/** Track if the generator is running */
+static bool Sync_Running = false;
+
+/** Sync frequency (Hz) and state machine clocks per microsecond */
+static uint32_t Sync_Freq;
+static uint32_t Sync_CycPerUs;
+
+/** Raw timer value (1/256 us) the state machine was started at */
+static uint64_t Sync_Start;
+
+/** Last scheduled sync edge (1/256 cycles since Sync_Start) */
+static int64_t Sync_LastEdge;
+
+/** Set until the first edge has been scheduled */
+static bool Sync_First;
+
+/**
+  * @brief Signed division, rounding towards minus infinity
+  *
+  * @param a Dividend
+  *
+  * @param b Divisor (positive)
+  *
+  * @return floor(a / b)
+  */
+static int64_t FloorDiv(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+	if((a % b) < 0)
+		q--;
+	return q;
+}
+
+/**
+  * @brief Schedules the next sync edge
+  *
+  * @return Low phase count for the state machine
+  *
+  * The target is the grid point nearest one period after the last edge. The
+  * first edge goes straight to the grid, later periods are limited to
+  * nominal +-1/256.
+  */
+static uint32_t NextCount()
+{
+	uint64_t base;
+	int64_t period, baseCyc, step, len, maxSlew;
+	const int64_t minLen = (int64_t) SYNC_GEN_FIXED_CYCLES << SYNC_FRAC_BITS;
+	uint32_t cycles;
+
+	/* Grid, in 1/256 cycles since start: baseCyc + k * step */
+	Timer_Get_Time_Base(&base, &period);
+	baseCyc = (int64_t) (base - Sync_Start) * Sync_CycPerUs;
+	step = period * Sync_CycPerUs / Sync_Freq;
+
+	len = baseCyc + FloorDiv(Sync_LastEdge + step + (step >> 1) - baseCyc, step) * step;
+	len -= Sync_LastEdge;
+
+	if(Sync_First)
+	{
+		while(len < minLen)
+			len += step;
+		Sync_First = false;
+	}
+	else
+	{
+		maxSlew = step >> SYNC_SLEW_SHIFT;
+		if(len > step + maxSlew)
+			len = step + maxSlew;
+		if(len < step - maxSlew)
+			len = step - maxSlew;
+		if(len < minLen)
+			len = minLen;
+	}
+
+	/* Nearest whole cycle. The rounding error is picked up by the next period */
+	cycles = (uint32_t) ((len + (1 << (SYNC_FRAC_BITS - 1))) >> SYNC_FRAC_BITS);
+	Sync_LastEdge += (int64_t) cycles << SYNC_FRAC_BITS;
+	return cycles - SYNC_GEN_FIXED_CYCLES;
+}
+
+/**
+  * @brief Sync generator TX FIFO interrupt handler (core 0)
+  *
+  * @return void
+  *
+  * Keeps the state machine FIFO full of scheduled periods.
+  */
+static void Sync_IRQ_Handler()
+{
+	while(!pio_sm_is_tx_fifo_full(Sync_Pio, Sync_Sm))
+	{
+		pio_sm_put(Sync_Pio, Sync_Sm, NextCount());
+	}
+}
+
+/**
+  * @brief Load the sync generator program. Generator starts stopped
+  *
+  * @return void
+  *
+  * Must be called from core 0, after Timer_Init() (which also uses pio1).
+  */
+void Sync_Gen_Init()
+{
+	Sync_Offset = pio_add_program(Sync_Pio, &sync_gen_program);
+	Sync_Sm = pio_claim_unused_sm(Sync_Pio, true);
+
+	irq_set_exclusive_handler(PIO1_IRQ_0, Sync_IRQ_Handler);
+	irq_set_enabled(PIO1_IRQ_0, true);
+}
+
+/**
+  * @brief Start (or restart) the sync clock at SYNC_FREQ Hz on PIN_SYNC
+  *
+  * @return void
+  *
+  * A SYNC_FREQ of 0 just stops the generator. Frequencies too high for the
+  * fixed high pulse (~1000 system clocks) are ignored. The IMU must be set up
+  * for external sync separately (MSC_CTRL).
+  */
+void Sync_Gen_Start()
+{
+	uint32_t freq = g_regs[SYNC_FREQ_REG];
+	uint64_t start;
+	uint32_t irq;
+
+	Sync_Gen_Stop();
+
+	Sync_CycPerUs = clock_get_hz(clk_sys) / 1000000;
+	if((freq == 0) || (freq > (Sync_CycPerUs * 1000000) / (2 * SYNC_GEN_FIXED_CYCLES)))
+		return;
+	Sync_Freq = freq;
+
+	sync_gen_program_init(Sync_Pio, Sync_Sm, Sync_Offset, PIN_SYNC);
+
+	/* Schedule the first periods from a start time a little in the future */
+	start = time_us_64() + SYNC_START_DELAY_US;
+	Sync_Start = start << SYNC_FRAC_BITS;
+	Sync_LastEdge = (int64_t) (SYNC_GEN_EDGE_CYCLES - SYNC_GEN_FIXED_CYCLES) << SYNC_FRAC_BITS;
+	Sync_First = true;
+	while(!pio_sm_is_tx_fifo_full(Sync_Pio, Sync_Sm))
+	{
+		pio_sm_put(Sync_Pio, Sync_Sm, NextCount());
+	}
+
+	/* Then start on that microsecond tick */
+	irq = save_and_disable_interrupts();
+	while(time_us_64() < start);
+	pio_sm_set_enabled(Sync_Pio, Sync_Sm, true);
+	restore_interrupts(irq);
+
+	pio_set_irq0_source_enabled(Sync_Pio, pis_sm0_tx_fifo_not_full + Sync_Sm, true);
+	Sync_Running = true;
+}
+
+/**
+  * @brief Stop the sync clock. The output is left low
+  *
+  * @return void
+  */
+void Sync_Gen_Stop()
+{
+	if(!Sync_Running)
+		return;
+	Sync_Running = false;
+
+	pio_set_irq0_source_enabled(Sync_Pio, pis_sm0_tx_fifo_not_full + Sync_Sm, false);
+	pio_sm_set_enabled(Sync_Pio, Sync_Sm, false);
+	pio_sm_clear_fifos(Sync_Pio, Sync_Sm);
+	pio_sm_exec(Sync_Pio, Sync_Sm, pio_encode_set(pio_pins, 0));
+}
@@ -1,16 +1,92 @@
 #include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/timer.h"
+#include "dr_stamp.pio.h"
 #include "reg.h"
 #include "timer.h"
 #include "isr.h"
 
-/* Pico timer doesn't support resets, so we subtract this timestamp */
-static absolute_time_t Last_Reset;
+/** Number of entries in the DR timestamp ring (power of 2) */
+#define DR_STAMP_RING_BITS		4
+#define DR_STAMP_RING_SIZE		(1 << DR_STAMP_RING_BITS)
+
+/** Fractional bits used for the PPS PLL phase and period (1/256 us) */
+#define PPS_FRAC_BITS			8
+
+/** Nominal raw timer period of one PPS second */
+#define PPS_NOMINAL_PERIOD		(1000000LL << PPS_FRAC_BITS)
+
+/** Largest PPS phase error which is tracked, 10ms (1%). Larger errors unlock the PLL */
+#define PPS_MAX_PHASE_ERROR		(10000LL << PPS_FRAC_BITS)
+
+/** PLL loop gains, as shifts. Phase gain 1/4, frequency gain 1/64 (time constant ~10s) */
+#define PPS_PHASE_GAIN_SHIFT	2
+#define PPS_FREQ_GAIN_SHIFT		6
+
+/** PLL states */
+#define PPS_STATE_IDLE			0
+#define PPS_STATE_ACQUIRE		1
+#define PPS_STATE_TRACK			2
+
+/** Timestamp base: raw timer value (1/256 us) where the microsecond timestamp is 0.
+ * With PPS locked this is the PLL estimate of the last PPS second edge */
+static volatile uint64_t Base_Time;
+
+/** Timer rate correction (Q32). Microsecond timestamp = elapsed * (1 + Rate_Corr / 2^32) */
+static volatile int32_t Rate_Corr;
+
+/** Raw timer period of one second (1/256 us) that Rate_Corr was derived from */
+static volatile int64_t Base_Period = PPS_NOMINAL_PERIOD;
+
+/** UTC seconds (UTC_TIMESTAMP) the microsecond timestamp counts from */
+static volatile uint32_t Base_Seconds;
+
+/** Base, rate correction and UTC seconds in effect before the last base change. Used for
+ * raw stamps latched just before a PPS edge but converted after it */
+static volatile uint64_t Prev_Base_Time;
+static volatile int32_t Prev_Rate_Corr;
+static volatile uint32_t Prev_Seconds;
+
+/** Sequence count for the timestamp base (Base_ and Prev_ values). Odd while they are being updated */
+static volatile uint32_t Base_Seq;
 
 /** Track number of "PPS" ticks which have occurred in last second */
 static uint32_t PPS_TickCount;
 
 /** Number of PPS ticks per sec */
-static uint32_t PPS_MaxTickCount;
+static uint32_t PPS_MaxTickCount = 1;
+
+/** Track if the PPS input is enabled, and the GPIO interrupt event it is using */
+static bool PPS_Enabled = false;
+static uint32_t PPS_IrqEvent;
+
+/** PLL state, last raw PPS second edge (acquire) and estimated raw period (1/256 us) */
+static uint32_t PPS_State = PPS_STATE_IDLE;
+static uint64_t PPS_LastEdge;
+static int64_t PPS_Period = PPS_NOMINAL_PERIOD;
+
+/** DR edge detector state machine (pio1) and its program offset */
+static PIO DR_Pio = pio1;
+static uint DR_Sm;
+static uint DR_Offset;
+
+/** DMA channels which drain the DR edge detector and latch the timer */
+static uint DR_DmaDrain;
+static uint DR_DmaStamp;
+
+/** Raw timer value at each DR edge, written by DMA */
+static uint32_t DR_Stamps[DR_STAMP_RING_SIZE] __attribute__((aligned (DR_STAMP_RING_SIZE * 4)));
+
+/** Drain destination for the edge detector FIFO */
+static uint32_t DR_Discard;
+
+/** Track if DR edges are being timestamped, and the last ring index used */
+static bool DR_StampRunning = false;
+static uint32_t DR_LastIndex;
+
+/** DR interrupt latency average (us, 8 fractional bits) */
+static uint32_t DR_LatencyAvg;
 
 /**
   * @brief Initialize all timers for operation.
@@ -25,7 +101,129 @@ static uint32_t PPS_MaxTickCount;
 void Timer_Init()
 {
 	/* Last reset was at 0 us */
-	update_us_since_boot(&Last_Reset, 0);
+	Base_Time = 0;
+	Rate_Corr = 0;
+	Base_Seconds = 0;
+	Prev_Base_Time = 0;
+	Prev_Rate_Corr = 0;
+	Prev_Seconds = 0;
+
+	/* DR edge timestamp hardware. Only started with data capture */
+	DR_Offset = pio_add_program(DR_Pio, &dr_stamp_program);
+	DR_Sm = pio_claim_unused_sm(DR_Pio, true);
+	DR_DmaDrain = dma_claim_unused_channel(true);
+	DR_DmaStamp = dma_claim_unused_channel(true);
+}
+
+/**
+  * @brief Start latching the timer on every DR edge in hardware
+  *
+  * @param pin DR GPIO number
+  *
+  * @param risingEdge Latch on the rising edge if true, falling edge otherwise (as seen
+  * after any GPIO input inversion)
+  *
+  * @return void
+  *
+  * Also resets the DR latency registers.
+  */
+void Timer_Start_DR_Stamp(uint32_t pin, bool risingEdge)
+{
+	dma_channel_config c;
+
+	Timer_Stop_DR_Stamp();
+
+	for(uint32_t i = 0; i < DR_STAMP_RING_SIZE; i++)
+		DR_Stamps[i] = 0;
+	DR_LastIndex = 0;
+
+	/* Latch: raw timer to the timestamp ring, then back to the drain channel */
+	c = dma_channel_get_default_config(DR_DmaStamp);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	channel_config_set_ring(&c, true, DR_STAMP_RING_BITS + 2);
+	channel_config_set_chain_to(&c, DR_DmaDrain);
+	dma_channel_configure(DR_DmaStamp, &c, DR_Stamps, &timer_hw->timerawl, 1, false);
+
+	/* Drain: waits for the edge detector, then chains to the latch */
+	c = dma_channel_get_default_config(DR_DmaDrain);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(DR_Pio, DR_Sm, false));
+	channel_config_set_chain_to(&c, DR_DmaStamp);
+	dma_channel_configure(DR_DmaDrain, &c, &DR_Discard, &DR_Pio->rxf[DR_Sm], 1, true);
+
+	dr_stamp_program_init(DR_Pio, DR_Sm, DR_Offset, pin, risingEdge);
+	pio_sm_set_enabled(DR_Pio, DR_Sm, true);
+	DR_StampRunning = true;
+
+	/* Reset latency stats */
+	DR_LatencyAvg = 0;
+	g_regs[DR_LATENCY_MIN_REG] = 0xFFFF;
+	g_regs[DR_LATENCY_MAX_REG] = 0;
+	g_regs[DR_LATENCY_AVG_REG] = 0;
+}
+
+/**
+  * @brief Stop latching the timer on DR edges
+  *
+  * @return void
+  */
+void Timer_Stop_DR_Stamp()
+{
+	if(!DR_StampRunning)
+		return;
+	DR_StampRunning = false;
+
+	pio_sm_set_enabled(DR_Pio, DR_Sm, false);
+
+	/* Break the chain (chain to self) first, then abort */
+	hw_write_masked(&dma_hw->ch[DR_DmaStamp].al1_ctrl, DR_DmaStamp << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB,
+					DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS);
+	dma_channel_abort(DR_DmaDrain);
+	dma_channel_abort(DR_DmaStamp);
+	pio_sm_clear_fifos(DR_Pio, DR_Sm);
+}
+
+/**
+  * @brief Gets the microsecond timestamp of the most recent DR edge
+  *
+  * @param seconds Returns the UTC seconds the timestamp counts from
+  *
+  * @return Microsecond timestamp (same base as Timer_Get_Timestamp)
+  *
+  * Called from the DR interrupt. Returns the hardware latched edge time, and
+  * records the delay from the edge to this call in the DR latency registers
+  * (min, max, and average in 1/16 us). If no new edge has been latched (DR
+  * timestamping not running) the current time is returned instead.
+  */
+uint32_t Timer_Get_DR_Timestamp(uint32_t* seconds)
+{
+	uint32_t index, stamp, latency;
+
+	if(!DR_StampRunning)
+		return Timer_Get_Timestamp(seconds);
+
+	index = ((uint32_t *) dma_hw->ch[DR_DmaStamp].write_addr - DR_Stamps) & (DR_STAMP_RING_SIZE - 1);
+	if(index == DR_LastIndex)
+		return Timer_Get_Timestamp(seconds);
+	DR_LastIndex = index;
+
+	stamp = DR_Stamps[(index - 1) & (DR_STAMP_RING_SIZE - 1)];
+	latency = timer_hw->timerawl - stamp;
+
+	if(latency < g_regs[DR_LATENCY_MIN_REG])
+		g_regs[DR_LATENCY_MIN_REG] = latency;
+	if(latency > g_regs[DR_LATENCY_MAX_REG])
+		g_regs[DR_LATENCY_MAX_REG] = (latency > 0xFFFF) ? 0xFFFF : latency;
+
+	/* Average over roughly the last 16 samples */
+	DR_LatencyAvg += (int32_t) ((latency << 8) - DR_LatencyAvg) >> 4;
+	g_regs[DR_LATENCY_AVG_REG] = DR_LatencyAvg >> 4;
+
+	return Timer_Raw_To_Timestamp(stamp, seconds);
 }
 
 /**
@@ -38,91 +236,510 @@ uint32_t Timer_Get_Millisecond_Uptime()
 	return to_ms_since_boot(get_absolute_time());
 }
 
+/**
+  * @brief Reads the timestamp base, rate correction and UTC seconds for a raw time
+  *
+  * @param raw Raw timer value (1/256 us) being converted
+  *
+  * @param base Raw timer value (1/256 us) of microsecond timestamp 0
+  *
+  * @param corr Rate correction (Q32)
+  *
+  * @param seconds UTC seconds at the base
+  *
+  * @return void
+  *
+  * The set is updated from the PPS interrupt on core 0 and read from both
+  * cores, so the read is retried if an update was in progress. A raw time
+  * before the current base (latched just before a PPS edge, converted after
+  * it) gets the previous base, so it stays in the previous second.
+  */
+static void GetBase(uint64_t raw, uint64_t* base, int32_t* corr, uint32_t* seconds)
+{
+	uint32_t seq;
+	do
+	{
+		seq = Base_Seq;
+		__dmb();
+		*base = Base_Time;
+		*corr = Rate_Corr;
+		*seconds = Base_Seconds;
+		if((int64_t) (raw - *base) < 0)
+		{
+			*base = Prev_Base_Time;
+			*corr = Prev_Rate_Corr;
+			*seconds = Prev_Seconds;
+		}
+		__dmb();
+	} while((seq & 1) || (seq != Base_Seq));
+}
+
+/**
+  * @brief Reads the UTC seconds registers
+  *
+  * @return UTC_TIMESTAMP value
+  */
+static uint32_t GetUtcRegs()
+{
+	return (g_regs[UTC_TIMESTAMP_LWR_REG] | (g_regs[UTC_TIMESTAMP_UPR_REG] << 16));
+}
+
+/**
+  * @brief Calculates the rate correction for a PPS period estimate
+  *
+  * @param period Raw timer ticks per PPS second (1/256 us)
+  *
+  * @return Rate correction (Q32), nominal / period - 1
+  */
+static int32_t PPS_Rate_Corr(int64_t period)
+{
+	return (int32_t) (((PPS_NOMINAL_PERIOD - period) * (1LL << 32)) / period);
+}
+
+/**
+  * @brief Updates the timestamp base, rate correction and UTC seconds
+  *
+  * @param base Raw timer value (1/256 us) of microsecond timestamp 0
+  *
+  * @param period Raw timer period of one second (1/256 us), sets the rate correction
+  *
+  * @param seconds UTC seconds at the base. Also written to the UTC_TIMESTAMP registers
+  *
+  * @return void
+  *
+  * Only called from core 0. If the base moves, the old values are kept for
+  * stamps latched before the new base.
+  */
+static void SetBase(uint64_t base, int64_t period, uint32_t seconds)
+{
+	int32_t corr = PPS_Rate_Corr(period);
+	uint32_t irq = save_and_disable_interrupts();
+	Base_Seq++;
+	__dmb();
+	if(base != Base_Time)
+	{
+		Prev_Base_Time = Base_Time;
+		Prev_Rate_Corr = Rate_Corr;
+		Prev_Seconds = Base_Seconds;
+	}
+	Base_Time = base;
+	Rate_Corr = corr;
+	Base_Period = period;
+	Base_Seconds = seconds;
+	g_regs[UTC_TIMESTAMP_LWR_REG] = seconds & 0xFFFF;
+	g_regs[UTC_TIMESTAMP_UPR_REG] = (seconds >> 16);
+	__dmb();
+	Base_Seq++;
+	restore_interrupts(irq);
+}
+
+/**
+  * @brief Converts raw time elapsed since the timestamp base to a microsecond timestamp
+  *
+  * @param elapsed Raw elapsed time (1/256 us)
+  *
+  * @param corr Rate correction (Q32)
+  *
+  * @return The rate corrected microsecond timestamp. 0 if elapsed is negative
+  *
+  * Like the raw timer, the result wraps at 32 bits.
+  */
+static uint32_t ScaleElapsed(int64_t elapsed, int32_t corr)
+{
+	uint32_t us;
+
+	if(elapsed < 0)
+		return 0;
+
+	us = (uint32_t) (elapsed >> PPS_FRAC_BITS);
+	elapsed += ((int64_t) us * corr) >> (32 - PPS_FRAC_BITS);
+	return (uint32_t) (elapsed >> PPS_FRAC_BITS);
+}
+
+/**
+  * @brief Converts a 64-bit raw timer value to a UTC seconds and microsecond timestamp
+  *
+  * @param raw Hardware timer value (us)
+  *
+  * @param seconds Returns the UTC seconds the timestamp counts from
+  *
+  * @return The microsecond timestamp
+  *
+  * The seconds and base are read as one set, so a PPS edge can't pair the new
+  * second with the old base.
+  */
+static uint32_t RawToTimestamp(uint64_t raw, uint32_t* seconds)
+{
+	uint64_t base;
+	int32_t corr;
+
+	raw <<= PPS_FRAC_BITS;
+	GetBase(raw, &base, &corr, seconds);
+	return ScaleElapsed((int64_t) (raw - base), corr);
+}
+
 /**
   * @brief Gets the current 32-bit value from the internal timer
   *
   * @return The timer value
+  *
+  * With PPS locked, this is the time since the last PPS second edge, with the
+  * crystal drift estimated by the PPS PLL removed.
   */
 uint32_t Timer_Get_Microsecond_Timestamp()
 {
-	/* Time between last reset call and now */
-	return absolute_time_diff_us(Last_Reset, get_absolute_time());
+	uint32_t seconds;
+
+	return RawToTimestamp(time_us_64(), &seconds);
+}
+
+/**
+  * @brief Gets the current UTC seconds and microsecond timestamp
+  *
+  * @param seconds Returns the UTC seconds
+  *
+  * @return The microsecond timestamp, counted from the returned second
+  */
+uint32_t Timer_Get_Timestamp(uint32_t* seconds)
+{
+	return RawToTimestamp(time_us_64(), seconds);
+}
+
+/**
+  * @brief Converts a raw 1MHz hardware timer value to a UTC seconds and microsecond timestamp
+  *
+  * @param raw Lower 32 bits of the hardware timer (TIMERAWL)
+  *
+  * @param seconds Returns the UTC seconds the timestamp counts from
+  *
+  * @return The microsecond timestamp (same base as Timer_Get_Timestamp)
+  *
+  * Used for timer values captured by DMA or in interrupts. The raw value must
+  * be from the last 71 minutes.
+  */
+uint32_t Timer_Raw_To_Timestamp(uint32_t raw, uint32_t* seconds)
+{
+	uint64_t now = time_us_64();
+
+	/* Extend to 64 bits, going back from now */
+	return RawToTimestamp(now - (uint32_t) ((uint32_t) now - raw), seconds);
 }
 
 /**
-  * @brief Gets the current 32-bit value from PPS timestamp registers
+  * @brief Gets the time base the microsecond timestamps are steered to
+  *
+  * @param base Raw timer value (1/256 us) of microsecond timestamp 0. The last
+  * PPS second edge estimate when PPS is locked
+  *
+  * @param period Raw timer period of one second (1/256 us). The PPS PLL
+  * estimate, or nominal if PPS has not locked yet
+  *
+  * @return void
+  */
+void Timer_Get_Time_Base(uint64_t* base, int64_t* period)
+{
+	uint32_t seq;
+	do
+	{
+		seq = Base_Seq;
+		__dmb();
+		*base = Base_Time;
+		*period = Base_Period;
+		__dmb();
+	} while((seq & 1) || (seq != Base_Seq));
+}
+
+/**
+  * @brief Gets the current UTC seconds
   *
   * @return The PPS counter value
+  *
+  * Use Timer_Get_Timestamp() when the microsecond timestamp is needed too.
   */
 uint32_t Timer_Get_PPS_Timestamp()
 {
-	return (g_regs[UTC_TIMESTAMP_LWR_REG] | (g_regs[UTC_TIMESTAMP_UPR_REG] << 16));
+	uint32_t seconds;
+
+	Timer_Get_Timestamp(&seconds);
+	return seconds;
 }
 
 /**
   * @brief Reset TIM2 counter to 0.
   *
   * @return void
+  *
+  * Called when UTC_TIMESTAMP is written, and publishes the new seconds. While
+  * the PPS input is enabled the microsecond timestamp is not reset, since it
+  * then follows the PPS second edges.
   */
 void Timer_Clear_Microsecond_Timer()
 {
-	Last_Reset = get_absolute_time();
+	uint32_t seconds = GetUtcRegs();
+
+	if(PPS_Enabled)
+		SetBase(Base_Time, Base_Period, seconds);
+	else
+		SetBase(time_us_64() << PPS_FRAC_BITS, Base_Period, seconds);
 }
 
 /**
-  * @brief Check if the PPS signal is unlocked (greater than 1100ms since last PPS strobe)
+  * @brief Saturates a signed value to a 16-bit register
+  *
+  * @param value Value to saturate
+  *
+  * @return Two's complement register value
+  */
+static uint16_t Saturate16(int64_t value)
+{
+	if(value > INT16_MAX)
+		return INT16_MAX;
+	if(value < INT16_MIN)
+		return (uint16_t) INT16_MIN;
+	return (uint16_t) value;
+}
+
+/**
+  * @brief Flags a PPS unlock in the status registers
+  *
+  * @return void
+  */
+static void PPS_Flag_Unlock()
+{
+	g_regs[STATUS_0_REG] |= STATUS_PPS_UNLOCK;
+	g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+}
+
+/**
+  * @brief Starts PLL acquisition from a PPS second edge
+  *
+  * @param edge Raw timer value of the edge (1/256 us)
+  *
+  * @param seconds UTC seconds starting at the edge
   *
   * @return void
   *
-  * This function should be periodically called as part of the firmware housekeeping process
- **/
-void Timer_Check_PPS_Unlock()
+  * The microsecond timestamp restarts at the edge. The previous rate correction
+  * is kept until a full period has been measured.
+  */
+static void PPS_Acquire(uint64_t edge, uint32_t seconds)
 {
-	/* If microsecond timestamp is greater than 1,100,000 (1.1 seconds) then unlock has occurred */
-	if(Timer_Get_Microsecond_Timestamp() > 1100000)
+	PPS_State = PPS_STATE_ACQUIRE;
+	PPS_LastEdge = edge;
+	SetBase(edge, Base_Period, seconds);
+}
+
+/**
+  * @brief Runs the PPS PLL for a PPS second edge
+  *
+  * @param edge Raw timer value of the edge (1/256 us)
+  *
+  * @param seconds UTC seconds starting at the edge
+  *
+  * @return void
+  *
+  * Second order loop. The next edge is predicted from the previous edge estimate
+  * and the period estimate (raw timer ticks per second, i.e. the crystal drift).
+  * The prediction error steers the edge estimate by 1/4 and the period by 1/64,
+  * which averages out the interrupt latency jitter on the measured edges. The
+  * edge estimate becomes the microsecond timestamp base and the period sets the
+  * rate correction. Edges more than 10ms (1%) from the prediction restart
+  * acquisition and flag a PPS unlock.
+  */
+static void PPS_Update_PLL(uint64_t edge, uint32_t seconds)
+{
+	int64_t err, period;
+	uint64_t pred;
+
+	if(PPS_State == PPS_STATE_TRACK)
 	{
-		g_regs[STATUS_0_REG] |= STATUS_PPS_UNLOCK;
-		g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
+		pred = Base_Time + PPS_Period;
+		err = (int64_t) (edge - pred);
+		if((err > PPS_MAX_PHASE_ERROR) || (err < -PPS_MAX_PHASE_ERROR))
+		{
+			PPS_Flag_Unlock();
+			PPS_Acquire(edge, seconds);
+			return;
+		}
+
+		PPS_Period += err >> PPS_FREQ_GAIN_SHIFT;
+		if(PPS_Period > PPS_NOMINAL_PERIOD + PPS_MAX_PHASE_ERROR)
+			PPS_Period = PPS_NOMINAL_PERIOD + PPS_MAX_PHASE_ERROR;
+		if(PPS_Period < PPS_NOMINAL_PERIOD - PPS_MAX_PHASE_ERROR)
+			PPS_Period = PPS_NOMINAL_PERIOD - PPS_MAX_PHASE_ERROR;
+		SetBase(pred + (err >> PPS_PHASE_GAIN_SHIFT), PPS_Period, seconds);
+
+		/* Phase error in 1/16 us, drift in 1/16 ppm (1us per second is 1ppm) */
+		g_regs[PPS_PHASE_REG] = Saturate16(err >> (PPS_FRAC_BITS - 4));
+		g_regs[PPS_DRIFT_REG] = Saturate16((PPS_Period - PPS_NOMINAL_PERIOD) >> (PPS_FRAC_BITS - 4));
+	}
+	else if(PPS_State == PPS_STATE_ACQUIRE)
+	{
+		/* First full period measurement seeds the frequency estimate */
+		period = (int64_t) (edge - PPS_LastEdge);
+		if((period > PPS_NOMINAL_PERIOD + PPS_MAX_PHASE_ERROR) ||
+		   (period < PPS_NOMINAL_PERIOD - PPS_MAX_PHASE_ERROR))
+		{
+			PPS_Flag_Unlock();
+			PPS_Acquire(edge, seconds);
+			return;
+		}
+
+		PPS_Period = period;
+		PPS_State = PPS_STATE_TRACK;
+		SetBase(edge, period, seconds);
+		g_regs[PPS_PHASE_REG] = 0;
+		g_regs[PPS_DRIFT_REG] = Saturate16((PPS_Period - PPS_NOMINAL_PERIOD) >> (PPS_FRAC_BITS - 4));
+	}
+	else
+	{
+		PPS_Acquire(edge, seconds);
 	}
 }
 
 /**
-  * @brief Increment PPS timestamp by 1
+  * @brief Handles a PPS tick
+  *
+  * @param edge Raw timer value (us) latched at the tick
   *
   * @return void
   *
-  * This function should be called whenever a PPS interrupt is generated. It
-  * handles PPS tick count incrementation, and resetting the microsecond timestamp
-  * every time one second has elapsed.
+  * Every PPS_MaxTickCount ticks, advances the UTC seconds and runs the PPS
+  * PLL. The PLL publishes the new second together with the new base.
   */
-void Timer_Increment_PPS_Time()
+static void PPS_Tick(uint64_t edge)
 {
-	uint32_t internalTime, startTime;
+	uint32_t startTime;
 
 	/* Increment tick count and check if one second has passed */
 	PPS_TickCount++;
-	if(PPS_TickCount >= PPS_MaxTickCount)
+	if(PPS_TickCount < PPS_MaxTickCount)
+		return;
+
+	/* Reset tick count for next second */
+	PPS_TickCount = 0;
+
+	/* Get starting PPS timestamp and increment */
+	startTime = GetUtcRegs();
+	startTime++;
+
+	/* Steer the microsecond timestamp to the new second */
+	PPS_Update_PLL(edge << PPS_FRAC_BITS, startTime);
+}
+
+/**
+  * @brief PPS GPIO interrupt handler (core 0)
+  *
+  * @return void
+  *
+  * Raw GPIO handler, so it can share the bank interrupt with the capture
+  * interrupts on core 1. The timer is latched first to keep the edge
+  * timestamp jitter down to the interrupt entry latency.
+  */
+static void PPS_IRQ_Handler()
+{
+	uint64_t now = time_us_64();
+
+	if(gpio_get_irq_event_mask(PIN_PPS) & PPS_IrqEvent)
 	{
-		/* Get the internal timestamp for period measurement */
-		internalTime = Timer_Get_Microsecond_Timestamp();
+		gpio_acknowledge_irq(PIN_PPS, PPS_IrqEvent);
+		PPS_Tick(now);
+	}
+}
+
+/**
+  * @brief Enables the PPS input
+  *
+  * @return void
+  *
+  * Uses the PPS polarity and frequency settings in DIO_INPUT_CONFIG. The
+  * first PPS edge after enabling starts a new second, and the PLL locks after
+  * the second one.
+  */
+void Timer_Enable_PPS()
+{
+	/* PPS_FREQ: 1Hz, 10Hz, 100Hz, 1000Hz */
+	static const uint16_t ticksPerSec[4] = {1, 10, 100, 1000};
+	static bool handlerAdded = false;
+	uint32_t config = g_regs[DIO_INPUT_CONFIG_REG];
 
-		/* Clear microsecond tick counter */
-		Timer_Clear_Microsecond_Timer();
+	Timer_Disable_PPS();
 
-		/* Reset tick count for next second */
-		PPS_TickCount = 0;
+	PPS_MaxTickCount = ticksPerSec[(config & PPS_FREQ_BITM) >> PPS_FREQ_BITP];
+	PPS_TickCount = PPS_MaxTickCount - 1;
+	PPS_State = PPS_STATE_IDLE;
+	PPS_IrqEvent = (config & PPS_POLARITY_BITM) ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
 
-		/* Get starting PPS timestamp and increment */
-		startTime = Timer_Get_PPS_Timestamp();
-		startTime++;
-		g_regs[UTC_TIMESTAMP_LWR_REG] = startTime & 0xFFFF;
-		g_regs[UTC_TIMESTAMP_UPR_REG] = (startTime >> 16);
+	gpio_init(PIN_PPS);
+	gpio_set_dir(PIN_PPS, GPIO_IN);
+	gpio_pull_down(PIN_PPS);
 
-		/* Check for unlock: If the PPS period is outside of 1 second +- 10ms (1%) then flag PPS unlock error */
-		if((internalTime > 1010000) || (internalTime < 990000))
-		{
-			g_regs[STATUS_0_REG] |= STATUS_PPS_UNLOCK;
-			g_regs[STATUS_1_REG] = g_regs[STATUS_0_REG];
-		}
+	if(!handlerAdded)
+	{
+		gpio_add_raw_irq_handler(PIN_PPS, PPS_IRQ_Handler);
+		handlerAdded = true;
 	}
+	gpio_acknowledge_irq(PIN_PPS, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+	gpio_set_irq_enabled(PIN_PPS, PPS_IrqEvent, true);
+	irq_set_enabled(IO_IRQ_BANK0, true);
+
+	PPS_Enabled = true;
+}
+
+/**
+  * @brief Disables the PPS input
+  *
+  * @return void
+  *
+  * The last rate correction is kept, so the microsecond timestamp holds over
+  * with the last drift estimate.
+  */
+void Timer_Disable_PPS()
+{
+	gpio_set_irq_enabled(PIN_PPS, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, false);
+	PPS_Enabled = false;
+	PPS_State = PPS_STATE_IDLE;
+}
+
+/**
+  * @brief Applies DIO_INPUT_CONFIG changes to the PPS input, if it is enabled
+  *
+  * @return void
+  */
+void Timer_Update_PPS_Config()
+{
+	if(PPS_Enabled)
+		Timer_Enable_PPS();
+}
+
+/**
+  * @brief Check if the PPS signal is unlocked (greater than 1100ms since last PPS strobe)
+  *
+  * @return void
+  *
+  * This function should be periodically called as part of the firmware housekeeping process
+ **/
+void Timer_Check_PPS_Unlock()
+{
+	if(!PPS_Enabled)
+		return;
+
+	/* If microsecond timestamp is greater than 1,100,000 (1.1 seconds) then unlock has occurred */
+	if(Timer_Get_Microsecond_Timestamp() > 1100000)
+	{
+		PPS_Flag_Unlock();
+	}
+}
+
+/**
+  * @brief Increment PPS timestamp by 1
+  *
+  * @return void
+  *
+  * Software PPS tick (CLI inc command). Handled the same as a PPS input edge
+  * at the current time.
+  */
+void Timer_Increment_PPS_Time()
+{
+	PPS_Tick(time_us_64());
 }
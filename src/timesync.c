@@ -0,0 +1,238 @@
+/**
+  * @file timesync.c
+  * @brief Host clock offset / skew estimator
+  *
+  * The host runs NTP style exchanges with the CLI tsync command: host send
+  * time t1, device receive / transmit times t2 / t3, host receive time t4.
+  * The host passes t4 back with the next exchange. Device time is the buffer
+  * entry time (UTC seconds * 1000000 + microseconds) and host time is the
+  * host monotonic clock in us, both modulo 2^32.
+  *
+  * Each exchange gives a host - device offset measurement, which a second
+  * order loop (same structure as the PPS PLL in timer.c) filters into an
+  * offset and skew estimate. Exchanges with a long round trip are discarded,
+  * since their offset error is up to half the round trip.
+  */
+
+#include "reg.h"
+#include "timer.h"
+#include "timesync.h"
+
+/** Fractional bits used for the offset (1/256 us) */
+#define TSYNC_FRAC_BITS			8
+
+/** Offset is modulo 2^32 us, plus the fraction */
+#define TSYNC_OFFSET_BITS		(32 + TSYNC_FRAC_BITS)
+#define TSYNC_OFFSET_MASK		((1ULL << TSYNC_OFFSET_BITS) - 1)
+
+/** Loop gains, as shifts. Offset gain 1/8, skew gain 1/64 */
+#define TSYNC_OFFSET_GAIN_SHIFT	3
+#define TSYNC_SKEW_GAIN_SHIFT	6
+
+/** Minimum round trip rise rate, as a shift (1/64 of the excess per exchange) */
+#define TSYNC_MIN_DELAY_SHIFT	6
+
+/** Estimator states */
+#define TSYNC_STATE_IDLE		0
+#define TSYNC_STATE_TRACK		1
+
+static uint32_t TSync_State = TSYNC_STATE_IDLE;
+
+/** Device time of the offset estimate (us) */
+static uint32_t TSync_Ref;
+
+/** Host - device offset at TSync_Ref (1/256 us, modulo 2^32 us) */
+static uint64_t TSync_Offset;
+
+/** Host clock rate relative to the device clock, minus 1 (Q32) */
+static int32_t TSync_Skew;
+
+/** Minimum round trip seen (us), slowly relaxed upwards */
+static uint32_t TSync_MinDelay;
+
+/**
+  * @brief Saturates a signed value to a 16-bit register
+  *
+  * @param value Value to saturate
+  *
+  * @return Two's complement register value
+  */
+static uint16_t Saturate16(int64_t value)
+{
+	if(value > INT16_MAX)
+		return INT16_MAX;
+	if(value < INT16_MIN)
+		return (uint16_t) INT16_MIN;
+	return (uint16_t) value;
+}
+
+/**
+  * @brief Gets the estimated offset at a device time
+  *
+  * @param deviceTime Device time (us)
+  *
+  * @return Host - device offset (1/256 us, modulo 2^32 us)
+  */
+static uint64_t PredictOffset(uint32_t deviceTime)
+{
+	int64_t dt = (int32_t) (deviceTime - TSync_Ref);
+	return (TSync_Offset + ((dt * TSync_Skew) >> (32 - TSYNC_FRAC_BITS))) & TSYNC_OFFSET_MASK;
+}
+
+/**
+  * @brief Updates the published skew and delay registers
+  *
+  * @param delay Round trip of the last accepted exchange (us)
+  *
+  * @return void
+  */
+static void UpdateRegs(uint32_t delay)
+{
+	/* Skew in 1/16 ppm */
+	g_regs[TSYNC_SKEW_REG] = Saturate16(((int64_t) TSync_Skew * 16000000) >> 32);
+	g_regs[TSYNC_DELAY_REG] = (delay > 0xFFFF) ? 0xFFFF : delay;
+}
+
+/**
+  * @brief Clears the estimator. The next exchange restarts it
+  *
+  * @return void
+  */
+void TimeSync_Reset()
+{
+	TSync_State = TSYNC_STATE_IDLE;
+	TSync_Skew = 0;
+	g_regs[TSYNC_OFFSET_LWR_REG] = 0;
+	g_regs[TSYNC_OFFSET_UPR_REG] = 0;
+	g_regs[TSYNC_SKEW_REG] = 0;
+	g_regs[TSYNC_DELAY_REG] = 0;
+}
+
+/**
+  * @brief Gets the device time, in the same base as the buffer entry timestamps
+  *
+  * @return UTC seconds * 1000000 + microsecond timestamp, modulo 2^32
+  */
+uint32_t TimeSync_Get_Device_Time()
+{
+	uint32_t seconds, microseconds;
+
+	microseconds = Timer_Get_Timestamp(&seconds);
+	return seconds * 1000000 + microseconds;
+}
+
+/**
+  * @brief Converts a raw timer value to device time
+  *
+  * @param raw Lower 32 bits of the hardware timer (TIMERAWL), from the last 71 minutes
+  *
+  * @return UTC seconds * 1000000 + microsecond timestamp, modulo 2^32
+  */
+uint32_t TimeSync_Raw_To_Device_Time(uint32_t raw)
+{
+	uint32_t seconds, microseconds;
+
+	microseconds = Timer_Raw_To_Timestamp(raw, &seconds);
+	return seconds * 1000000 + microseconds;
+}
+
+/**
+  * @brief Runs the estimator for one sync exchange
+  *
+  * @param t1 Host send time (us)
+  *
+  * @param t2 Device receive time (us)
+  *
+  * @param t3 Device transmit time (us)
+  *
+  * @param t4 Host receive time (us)
+  *
+  * @return void
+  */
+void TimeSync_Update(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4)
+{
+	uint32_t delay;
+	uint64_t measured, pred;
+	int64_t err, dt;
+
+	/* Round trip, less the device turnaround */
+	delay = (t4 - t1) - (t3 - t2);
+	if((int32_t) delay < 0)
+		return;
+
+	/* Offset assuming a symmetric path */
+	measured = (((uint64_t) (t1 - t2) << TSYNC_FRAC_BITS) + ((uint64_t) delay << (TSYNC_FRAC_BITS - 1))) & TSYNC_OFFSET_MASK;
+
+	if(TSync_State == TSYNC_STATE_IDLE)
+	{
+		TSync_MinDelay = delay;
+		TSync_Offset = measured;
+		TSync_Ref = t2;
+		TSync_Skew = 0;
+		TSync_State = TSYNC_STATE_TRACK;
+		UpdateRegs(delay);
+		return;
+	}
+
+	/* Discard exchanges delayed on the way. The minimum creeps up, so a
+	 * path which got slower is accepted again after a while */
+	if(delay <= TSync_MinDelay)
+	{
+		TSync_MinDelay = delay;
+	}
+	else
+	{
+		TSync_MinDelay += (delay - TSync_MinDelay) >> TSYNC_MIN_DELAY_SHIFT;
+		if(delay > TSync_MinDelay + TSYNC_DELAY_SLACK)
+			return;
+	}
+
+	/* Prediction error, sign extended from the modulo offset width */
+	pred = PredictOffset(t2);
+	err = (int64_t) ((measured - pred) << (64 - TSYNC_OFFSET_BITS)) >> (64 - TSYNC_OFFSET_BITS);
+	dt = (int32_t) (t2 - TSync_Ref);
+
+	if((err > ((int64_t) TSYNC_MAX_ERROR << TSYNC_FRAC_BITS)) ||
+	   (err < -((int64_t) TSYNC_MAX_ERROR << TSYNC_FRAC_BITS)) ||
+	   (dt < 0))
+	{
+		/* Clock step (e.g. UTC time written) or a bad exchange. Start over */
+		TSync_State = TSYNC_STATE_IDLE;
+		TimeSync_Update(t1, t2, t3, t4);
+		return;
+	}
+
+	if(dt < TSYNC_MIN_INTERVAL)
+	{
+		/* Too close to the previous exchange for a skew update */
+		TSync_Offset = (pred + (err >> TSYNC_OFFSET_GAIN_SHIFT)) & TSYNC_OFFSET_MASK;
+	}
+	else
+	{
+		TSync_Skew += (int32_t) (((err * (1LL << (32 - TSYNC_FRAC_BITS))) / dt) >> TSYNC_SKEW_GAIN_SHIFT);
+		TSync_Offset = (pred + (err >> TSYNC_OFFSET_GAIN_SHIFT)) & TSYNC_OFFSET_MASK;
+	}
+	TSync_Ref = t2;
+	UpdateRegs(delay);
+}
+
+/**
+  * @brief Latches the current host - device offset into the offset registers
+  *
+  * @return The lower offset word
+  *
+  * Called on read of TSYNC_OFFSET_LWR. The offset is evaluated at the current
+  * device time, and the upper word holds until the next latch. Host time for
+  * an entry is device time + offset, plus skew * (entry time - read time).
+  */
+uint16_t TimeSync_Latch_Offset()
+{
+	uint32_t offset = 0;
+
+	if(TSync_State != TSYNC_STATE_IDLE)
+		offset = (uint32_t) (PredictOffset(TimeSync_Get_Device_Time()) >> TSYNC_FRAC_BITS);
+
+	g_regs[TSYNC_OFFSET_LWR_REG] = offset & 0xFFFF;
+	g_regs[TSYNC_OFFSET_UPR_REG] = offset >> 16;
+	return g_regs[TSYNC_OFFSET_LWR_REG];
+}
@@ -1,8 +1,13 @@
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/structs/usb.h"
+#include "tusb.h"
 #include "usb.h"
 #include "script.h"
 #include "reg.h"
+#include "timer.h"
 
 /** Current command string */
 static uint8_t CurrentCommand[64];
@@ -13,13 +18,168 @@ static uint8_t OutputBuffer[512];
 /** Script object (parsed from current command) */
 static script scr = {};
 
+/** Batched CLI output, and number of bytes queued */
+static uint8_t TxBuf[USB_TX_BUF_SIZE];
+static uint32_t TxCount = 0;
+
+/** Time the batched output must be sent by */
+static absolute_time_t TxDeadline;
+
+/** Last USB start of frame: frame number and entry timestamp (UTC seconds, us) */
+static volatile uint32_t SofFrame;
+static volatile uint32_t SofSeconds;
+static volatile uint32_t SofMicroseconds;
+
+/** Number of start of frames timestamped */
+static volatile uint32_t SofCount = 0;
+
+/** Timer latched on entry to a USB interrupt with a SOF pending, and if it is set */
+static uint32_t SofRaw;
+static bool SofLatched = false;
+
+/** BUFF_STATUS bit of the CDC OUT endpoint (OUT buffers are the odd bits) */
+#define CDC_OUT_BUF_BIT		(1u << (2 * (USB_CDC_EP_OUT & 0x0F) + 1))
+
+/** Timer latched when the last CLI packet landed (USB interrupt), when TinyUSB
+ * passed it to the CDC FIFO, and when the last command line was completed */
+static volatile uint32_t CdcRxRaw;
+static uint32_t CdcRxFifoRaw;
+static uint32_t CommandRxRaw;
+
+/** Set while a command from the CLI (not a stored script) is running */
+static bool CommandFromUsb = false;
+
+/**
+  * @brief USB controller interrupt handler, runs before the TinyUSB device handler
+  *
+  * @return void
+  *
+  * Latches the timer on entry if a SOF is pending, or a CLI packet has
+  * landed. Only reads INTS and BUFF_STATUS, so the interrupts are left for
+  * the TinyUSB device handler to clear and report.
+  */
+static void USB_SOF_Latch_Handler()
+{
+	uint32_t raw = time_us_32();
+	uint32_t ints = usb_hw->ints;
+
+	if(ints & USB_INTS_DEV_SOF_BITS)
+	{
+		SofRaw = raw;
+		SofLatched = true;
+	}
+	if((ints & USB_INTS_BUFF_STATUS_BITS) && (usb_hw->buf_status & CDC_OUT_BUF_BIT))
+		CdcRxRaw = raw;
+}
+
+/**
+  * @brief TinyUSB CDC receive callback (runs in tud_task)
+  *
+  * @param itf CDC interface
+  *
+  * @return void
+  *
+  * Keeps the arrival time of the packet whose data just reached the CDC FIFO,
+  * so a command is stamped when it arrived rather than when it was parsed.
+  * Replaces the pico_stdio_usb callback (PICO_STDIO_USB_SUPPORT_CHARS_AVAILABLE_CALLBACK
+  * is off in CMakeLists.txt).
+  */
+void tud_cdc_rx_cb(uint8_t itf)
+{
+	(void) itf;
+	CdcRxFifoRaw = CdcRxRaw;
+}
+
+/**
+  * @brief USB controller interrupt handler, runs after the TinyUSB device handler
+  *
+  * @return void
+  *
+  * Pairs the timer latched on entry with the frame number of that SOF. The
+  * TinyUSB handler has already read SOF_RD (clearing the interrupt), and it
+  * holds the same frame number until the next SOF.
+  */
+static void USB_SOF_Stamp_Handler()
+{
+	uint32_t seconds;
+
+	if(!SofLatched)
+		return;
+	SofLatched = false;
+
+	SofFrame = usb_hw->sof_rd & USB_SOF_RD_BITS;
+	SofMicroseconds = Timer_Raw_To_Timestamp(SofRaw, &seconds);
+	SofSeconds = seconds;
+	SofCount++;
+}
+
+/**
+  * @brief Start timestamping USB start of frame (SOF) packets
+  *
+  * @return void
+  *
+  * Must be called after tusb_init(). The SOF interrupt enable stays under
+  * TinyUSB control (turned off while suspended, for example); this only asks
+  * it to keep SOF on. The timestamp handlers run either side of the TinyUSB
+  * device handler, so it still sees every SOF.
+  */
+void USB_SOF_Init()
+{
+	irq_add_shared_handler(USBCTRL_IRQ, USB_SOF_Latch_Handler, PICO_SHARED_IRQ_HANDLER_HIGHEST_ORDER_PRIORITY);
+	irq_add_shared_handler(USBCTRL_IRQ, USB_SOF_Stamp_Handler, PICO_SHARED_IRQ_HANDLER_LOWEST_ORDER_PRIORITY);
+	tud_sof_cb_enable(true);
+}
+
+/**
+  * @brief Get the most recent start of frame timestamp
+  *
+  * @param frame Returns the 11-bit USB frame number
+  *
+  * @param seconds Returns the UTC seconds at the SOF
+  *
+  * @param microseconds Returns the microsecond timestamp at the SOF
+  *
+  * @return Number of SOFs timestamped so far (0 if none, and the outputs are not set)
+  *
+  * The host sees the same frame numbers, so each (frame, timestamp) pair maps
+  * the buffer entry time base to the host USB clock.
+  */
+uint32_t USB_Get_SOF_Stamp(uint16_t* frame, uint32_t* seconds, uint32_t* microseconds)
+{
+	uint32_t count, irq;
+
+	irq = save_and_disable_interrupts();
+	count = SofCount;
+	*frame = SofFrame;
+	*seconds = SofSeconds;
+	*microseconds = SofMicroseconds;
+	restore_interrupts(irq);
+
+	return count;
+}
+
+/**
+  * @brief Get the arrival time of the command being run from the CLI
+  *
+  * @param raw Returns the raw timer value (TIMERAWL) latched in the USB interrupt
+  * for the packet which completed the command line
+  *
+  * @return false if the running command did not come from the CLI (stored script)
+  */
+bool USB_Get_Command_Rx_Time(uint32_t* raw)
+{
+	*raw = CommandRxRaw;
+	return CommandFromUsb;
+}
+
 /**
   * @brief Handler for received USB data
   *
   * @return void
   *
   * This function should be called periodically from
-  * the main loop to check if new USB data has been received
+  * the main loop to check if new USB data has been received.
+  * It also finishes a command waiting on queued IMU register access.
   */
 void USB_Rx_Handler()
 {
@@ -29,6 +189,10 @@ void USB_Rx_Handler()
 	uint32_t bufIndex;
 	uint32_t numBytes;
 
+	/* Leave characters queued until the last command has finished */
+	if(!Script_Element_Done())
+		return;
+
 	/* Iterate over all available characters */
 	for (int c = getchar_timeout_us(0);
 		 c != PICO_ERROR_TIMEOUT;
@@ -56,10 +220,14 @@ void USB_Rx_Handler()
 			}
 			/* Place a string terminator */
 			CurrentCommand[commandIndex] = 0;
+			/* Arrival time of the packet holding the end of the command */
+			CommandRxRaw = CdcRxFifoRaw;
 			/* Parse command */
 			Script_Parse_Element(CurrentCommand, &scr);
 			/* Execute command */
+			CommandFromUsb = true;
 			Script_Run_Element(&scr, OutputBuffer);
+			CommandFromUsb = false;
 
 			/* Clear command buffer */
 			for(int i = 0; i < sizeof(CurrentCommand); i++) {
@@ -96,14 +264,119 @@ void USB_Rx_Handler()
   *
   * This function is called by the script execution
   * routines, when a script object is executed
-  * from a USB CLI context.
+  * from a USB CLI context. Writes are batched in
+  * TxBuf, and sent once USB_TX_SIZE bytes are
+  * queued, or USB_TX_DEADLINE microseconds after
+  * the first queued byte (see USB_Tx_Check_Deadline).
   */
 void USB_Tx_Handler(const uint8_t* buf, uint32_t count)
 {
+	uint32_t threshold = g_regs[USB_TX_SIZE_REG];
+
 	if(count == 0)
 		return;
-	fwrite(buf, count, 1, stdout);
+
+	if(threshold > USB_TX_BUF_SIZE)
+		threshold = USB_TX_BUF_SIZE;
+
+	/* Make room, or send directly if it can never fit */
+	if((TxCount + count) > USB_TX_BUF_SIZE)
+	{
+		USB_Tx_Flush();
+		if(count > USB_TX_BUF_SIZE)
+		{
+			fwrite(buf, count, 1, stdout);
+			fflush(stdout);
+			return;
+		}
+	}
+
+	/* Deadline runs from the first byte queued */
+	if(TxCount == 0)
+		TxDeadline = make_timeout_time_us(g_regs[USB_TX_DEADLINE_REG]);
+
+	memcpy(&TxBuf[TxCount], buf, count);
+	TxCount += count;
+
+	if(TxCount >= threshold)
+		USB_Tx_Flush();
+}
+
+/**
+  * @brief Send all batched USB CLI output
+  *
+  * @return void
+  */
+void USB_Tx_Flush()
+{
+	if(TxCount == 0)
+		return;
+	fwrite(TxBuf, TxCount, 1, stdout);
 
 	/* Put the stdout buffer in a known empty state */
 	fflush(stdout);
+	TxCount = 0;
+}
+
+/**
+  * @brief Send batched USB CLI output once its deadline has passed
+  *
+  * @return void
+  *
+  * This function should be called periodically from the main loop
+  */
+void USB_Tx_Check_Deadline()
+{
+	if(TxCount && time_reached(TxDeadline))
+		USB_Tx_Flush();
+}
+
+/**
+  * @brief USB vendor bulk endpoint write handler
+  *
+  * @param buf Buffer containing data to write
+  *
+  * @param count Number of bytes to write
+  *
+  * @return Number of bytes queued. Less than count if the host stopped reading
+  *
+  * Data is queued to the vendor interface TX FIFO, which sends full 64 byte
+  * packets as they fill. Call USB_Bulk_Flush() to send a final short
+  * packet. If no host has the interface open, or the FIFO makes no
+  * progress for USB_BULK_TIMEOUT_US, the remaining data is dropped so the
+  * main loop (and watchdog) keep running.
+  */
+uint32_t USB_Bulk_Tx(const uint8_t* buf, uint32_t count)
+{
+	uint32_t sent = 0;
+	uint32_t written;
+	absolute_time_t timeout = make_timeout_time_us(USB_BULK_TIMEOUT_US);
+
+	while(sent < count && tud_vendor_mounted())
+	{
+		/* Frees the FIFO as packets complete. Same as the stdio CDC output path */
+		tud_task();
+		written = tud_vendor_write(buf + sent, count - sent);
+		if(written)
+		{
+			sent += written;
+			timeout = make_timeout_time_us(USB_BULK_TIMEOUT_US);
+		}
+		else if(absolute_time_diff_us(get_absolute_time(), timeout) < 0)
+		{
+			break;
+		}
+	}
+	return sent;
+}
+
+/**
+  * @brief Send any partial packet queued on the vendor bulk endpoint
+  *
+  * @return void
+  */
+void USB_Bulk_Flush()
+{
+	if(tud_vendor_mounted())
+		tud_vendor_write_flush();
 }
@@ -0,0 +1,140 @@
+/**
+  * @file usb_descriptors.c
+  * @brief USB descriptors for the composite CDC + vendor bulk device
+  *
+  * Replaces the pico_stdio_usb descriptors (they are only built when the
+  * application does not link tinyusb_device itself). Interface 0/1 is the
+  * CDC port used by stdio and the CLI, interface 2 is a vendor class
+  * interface whose bulk IN endpoint carries the binary buffer stream.
+  */
+
+#include "tusb.h"
+#include "pico/unique_id.h"
+#include "usb.h"
+
+/** pid.codes test vendor / product ID (private use). Must not reuse the
+ * pico_stdio_usb ID (2E8A:000A): hosts bind that to a lone CDC interface.
+ * Replace with an allocated ID before distributing boards */
+#define USBD_VID				0x1209
+#define USBD_PID				0x0001
+
+/** Device release. Bumped from the stdio-only device so hosts re-read the descriptors */
+#define USBD_BCD_DEVICE			0x0101
+
+#define USBD_MAX_POWER_MA		250
+
+/** Interface numbers */
+#define USBD_ITF_CDC			0
+#define USBD_ITF_VENDOR			2
+#define USBD_ITF_MAX			3
+
+/** Endpoints */
+#define USBD_CDC_EP_CMD			0x81
+#define USBD_CDC_EP_OUT			USB_CDC_EP_OUT
+#define USBD_CDC_EP_IN			0x82
+#define USBD_CDC_CMD_MAX_SIZE	8
+#define USBD_CDC_IN_OUT_MAX_SIZE	64
+#define USBD_VENDOR_EP_OUT		0x03
+#define USBD_VENDOR_EP_IN		0x83
+
+/** String indices */
+#define USBD_STR_0				0
+#define USBD_STR_MANUF			1
+#define USBD_STR_PRODUCT		2
+#define USBD_STR_SERIAL			3
+#define USBD_STR_CDC			4
+#define USBD_STR_VENDOR			5
+
+#define USBD_DESC_LEN			(TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN)
+
+/** Device descriptor. Misc class / IAD, since the CDC function has two interfaces */
+static const tusb_desc_device_t usbd_desc_device = {
+	.bLength = sizeof(tusb_desc_device_t),
+	.bDescriptorType = TUSB_DESC_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = TUSB_CLASS_MISC,
+	.bDeviceSubClass = MISC_SUBCLASS_COMMON,
+	.bDeviceProtocol = MISC_PROTOCOL_IAD,
+	.bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+	.idVendor = USBD_VID,
+	.idProduct = USBD_PID,
+	.bcdDevice = USBD_BCD_DEVICE,
+	.iManufacturer = USBD_STR_MANUF,
+	.iProduct = USBD_STR_PRODUCT,
+	.iSerialNumber = USBD_STR_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+/* Stream output relies on a second packet filling while the first is on the bus */
+_Static_assert(CFG_TUD_VENDOR_TX_BUFSIZE >= 2 * CFG_TUD_VENDOR_EPSIZE, "Vendor TX FIFO must hold two packets");
+
+/** Configuration descriptor */
+static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
+	TUD_CONFIG_DESCRIPTOR(1, USBD_ITF_MAX, USBD_STR_0, USBD_DESC_LEN,
+		0, USBD_MAX_POWER_MA),
+
+	TUD_CDC_DESCRIPTOR(USBD_ITF_CDC, USBD_STR_CDC, USBD_CDC_EP_CMD,
+		USBD_CDC_CMD_MAX_SIZE, USBD_CDC_EP_OUT, USBD_CDC_EP_IN,
+		USBD_CDC_IN_OUT_MAX_SIZE),
+
+	TUD_VENDOR_DESCRIPTOR(USBD_ITF_VENDOR, USBD_STR_VENDOR, USBD_VENDOR_EP_OUT,
+		USBD_VENDOR_EP_IN, CFG_TUD_VENDOR_EPSIZE),
+};
+
+/** Serial number string, filled from the flash unique ID */
+static char usbd_serial_str[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
+
+/** String descriptors (index 0 is the language ID, handled separately) */
+static const char *const usbd_desc_str[] = {
+	[USBD_STR_MANUF] = "Raspberry Pi",
+	[USBD_STR_PRODUCT] = "pico16470",
+	[USBD_STR_SERIAL] = usbd_serial_str,
+	[USBD_STR_CDC] = "pico16470 CLI",
+	[USBD_STR_VENDOR] = "pico16470 Stream",
+};
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+	return (const uint8_t *) &usbd_desc_device;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+	(void) index;
+	return usbd_desc_cfg;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	/* Max string length plus the header */
+	static uint16_t desc_str[33];
+	uint8_t len;
+	(void) langid;
+
+	if(!usbd_serial_str[0])
+	{
+		pico_get_unique_board_id_string(usbd_serial_str, sizeof(usbd_serial_str));
+	}
+
+	if(index == 0)
+	{
+		/* English (US) */
+		desc_str[1] = 0x0409;
+		len = 1;
+	}
+	else
+	{
+		const char *str;
+		if(index >= TU_ARRAY_SIZE(usbd_desc_str) || !usbd_desc_str[index])
+			return NULL;
+		str = usbd_desc_str[index];
+		for(len = 0; len < 32 && str[len]; len++)
+		{
+			desc_str[1 + len] = str[len];
+		}
+	}
+
+	/* First word is the length (bytes, including the header) and type */
+	desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * len + 2);
+	return desc_str;
+}
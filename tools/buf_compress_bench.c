@@ -0,0 +1,231 @@
+/**
+  * @file buf_compress_bench.c
+  * @brief Host benchmark for the delta compressed buffer mode
+  *
+  * Builds the firmware buffer.c as is and loads it with a recorded capture
+  * (readbuf text output: one buffer entry per line, 4 timestamp words, the
+  * signature word, then the data words, in hex. Lines starting with # are
+  * skipped). The recording is replayed, repeating as needed, until the buffer
+  * is full, once with fixed size entries and once with BUF_CFG_COMPRESS set.
+  * Reports the capacity ratio, the average record size, and the encode
+  * (Buffer_Commit_Element) and decode (Buffer_Take_Span / Buffer_Release_Span)
+  * cost per entry on the host, then checks that every entry decodes exactly.
+  *
+  * The buffer size is fixed at the RP2040 boot allocation (about 200 KB).
+  * Host timings only rank changes to the codec; the Cortex-M0+ cost is
+  * several times higher.
+  *
+  * Build: cc -O2 -I../include -Ihost -o buf_compress_bench buf_compress_bench.c ../src/buffer.c
+  *
+  * Usage: buf_compress_bench [recording = imu_sample_2khz.txt]
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "reg.h"
+#include "buffer.h"
+
+/** Max entries read from the recording */
+#define MAX_ENTRIES			100000
+
+/** Words per entry ahead of the data (timestamp, signature) */
+#define HEADER_WORDS		5
+
+/** Stand-in for the RP2040 heap: about 200 KB of free SRAM past the reserve */
+__asm__(".data\n"
+		".globl __end__\n"
+		"__end__:\n"
+		".skip 0x36000\n"
+		".globl __StackLimit\n"
+		"__StackLimit:\n"
+		".byte 0\n"
+		".text\n");
+
+/** Firmware globals used by buffer.c */
+volatile uint16_t g_regs[NUM_REG_PAGES * REG_PER_PAGE];
+volatile uint32_t g_update_flags;
+
+/** Recorded entries, in buffer memory layout (BUF_MAX_ENTRY + 10 bytes apart) */
+static uint8_t Recording[MAX_ENTRIES][BUF_MAX_ENTRY + 10];
+
+/** Number of recorded entries */
+static uint32_t NumRecorded;
+
+/** Watermark pin updates are not under test */
+void Dio_Update_Watermark()
+{
+}
+
+/**
+  * @brief Get a monotonic time, in ns
+  */
+static uint64_t NowNs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+  * @brief Load a readbuf text recording
+  *
+  * @param file Open recording
+  *
+  * @return BUF_LEN of the recording (bytes of data per entry), or 0 on error
+  */
+static uint32_t LoadRecording(FILE* file)
+{
+	char line[1024];
+	uint16_t words[(BUF_MAX_ENTRY >> 1) + HEADER_WORDS];
+	uint32_t numWords, len = 0;
+	char* ptr;
+	char* end;
+
+	while(NumRecorded < MAX_ENTRIES && fgets(line, sizeof(line), file))
+	{
+		if(line[0] == '#')
+			continue;
+
+		numWords = 0;
+		ptr = line;
+		while(*ptr && numWords < (sizeof(words) / sizeof(words[0])))
+		{
+			if(!isxdigit((unsigned char) *ptr))
+			{
+				ptr++;
+				continue;
+			}
+			words[numWords++] = strtoul(ptr, &end, 16);
+			ptr = end;
+		}
+
+		/* Not a buffer entry */
+		if(numWords <= HEADER_WORDS)
+			continue;
+
+		/* All entries in a recording have the same length */
+		if(len == 0)
+			len = (numWords - HEADER_WORDS) << 1;
+		if(((numWords - HEADER_WORDS) << 1) != len)
+			continue;
+
+		memcpy(Recording[NumRecorded++], words, numWords << 1);
+	}
+	return len;
+}
+
+/**
+  * @brief Fill the buffer from the recording until it is full
+  *
+  * @param encodeNs Receives the total time spent in Buffer_Commit_Element()
+  *
+  * @return Number of entries stored
+  */
+static uint32_t FillBuffer(uint64_t* encodeNs)
+{
+	uint32_t count = 0;
+	uint32_t entrySize = g_regs[BUF_LEN_REG] + 10;
+	uint64_t start;
+
+	*encodeNs = 0;
+	while(Buffer_Can_Add_Element())
+	{
+		memcpy(Buffer_Add_Element(), Recording[count % NumRecorded], entrySize);
+		start = NowNs();
+		Buffer_Commit_Element();
+		*encodeNs += NowNs() - start;
+		count++;
+	}
+	return count;
+}
+
+/**
+  * @brief Drain the buffer and check every entry against the recording
+  *
+  * @param count Number of entries stored
+  *
+  * @param decodeNs Receives the total time spent taking and releasing spans
+  *
+  * @return Number of mismatched entries
+  */
+static uint32_t DrainBuffer(uint32_t count, uint64_t* decodeNs)
+{
+	uint32_t entrySize = g_regs[BUF_LEN_REG] + 10;
+	uint32_t index = 0, errors = 0, spanCount;
+	uint8_t* entry;
+	uint64_t start, takeNs;
+
+	*decodeNs = 0;
+	while(index < count)
+	{
+		start = NowNs();
+		Buffer_Take_Span(count - index, &entry, &spanCount);
+		takeNs = NowNs() - start;
+		if(spanCount == 0)
+			break;
+		for(uint32_t i = 0; i < spanCount; i++)
+		{
+			if(memcmp(entry, Recording[index % NumRecorded], entrySize) != 0)
+				errors++;
+			entry += g_bufNumWords32 << 2;
+			index++;
+		}
+		start = NowNs();
+		Buffer_Release_Span(spanCount);
+		*decodeNs += takeNs + (NowNs() - start);
+	}
+	return errors + (count - index);
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = (argc > 1) ? argv[1] : "imu_sample_2khz.txt";
+	FILE* file = fopen(path, "r");
+	uint32_t len, rawCount, compCount, errors;
+	uint64_t rawNs, encodeNs, decodeNs;
+
+	if(!file)
+	{
+		perror(path);
+		return 2;
+	}
+	len = LoadRecording(file);
+	fclose(file);
+	if(len == 0 || len > BUF_MAX_ENTRY)
+	{
+		fprintf(stderr, "%s: no usable buffer entries\n", path);
+		return 2;
+	}
+
+	Buffer_Init();
+	g_regs[BUF_LEN_REG] = len;
+	g_regs[BUF_MAX_SIZE_REG] = 0;
+
+	/* Fixed size entries */
+	g_regs[BUF_CONFIG_REG] = 0;
+	Buffer_Reset();
+	rawCount = FillBuffer(&rawNs);
+
+	/* Delta compressed records */
+	g_regs[BUF_CONFIG_REG] = BUF_CFG_COMPRESS;
+	Buffer_Reset();
+	compCount = FillBuffer(&encodeNs);
+	errors = DrainBuffer(compCount, &decodeNs);
+
+	printf("%s: %u entries, BUF_LEN %u, %u KB buffer\n", path, NumRecorded, len, g_regs[BUF_SIZE_REG]);
+	printf("fixed size:  %6u entries (%u bytes each)\n", rawCount, g_bufNumWords32 << 2);
+	printf("compressed:  %6u entries (%.1f bytes avg incl. wrap slack)\n", compCount,
+		(double) (g_regs[BUF_SIZE_REG] << 10) / compCount);
+	printf("ratio:       %.2fx\n", (double) compCount / rawCount);
+	printf("encode:      %.0f ns/entry (fixed size commit %.0f ns/entry)\n",
+		(double) encodeNs / compCount, (double) rawNs / rawCount);
+	printf("decode:      %.0f ns/entry\n", (double) decodeNs / compCount);
+	printf("round trip:  %u mismatched entries\n", errors);
+
+	return errors ? 1 : 0;
+}
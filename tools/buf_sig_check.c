@@ -0,0 +1,136 @@
+/**
+  * @file buf_sig_check.c
+  * @brief Host side reference for the buffer entry signature
+  *
+  * Reads ReadBuf command output (one buffer entry per line: 4 timestamp
+  * words, the signature word, then the data words, in hex) from stdin and
+  * checks the signature of every entry.
+  *
+  * By default the signature is the CRC the DMA sniffer computes: CRC-16-CCITT
+  * (polynomial 0x1021, seed 0xFFFF, no reflection, no output XOR) over the
+  * data bytes in buffer order (low byte of each 16-bit word first). With -s
+  * the legacy signature (16-bit sum of the timestamp and data words, selected
+  * by BUF_CFG_SUM_SIG) is checked instead.
+  *
+  * Build: cc -O2 -o buf_sig_check buf_sig_check.c
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+/** Timestamp words at the start of each entry */
+#define TIMESTAMP_WORDS		4
+
+/** Max words per entry (64 byte BUF_LEN + header) */
+#define MAX_WORDS			64
+
+/**
+  * @brief Calculate the CRC-16-CCITT of a buffer entry's data
+  *
+  * @param data Data words
+  *
+  * @param count Number of data words
+  *
+  * @return CRC, matching the DMA sniffer result
+  */
+uint16_t Entry_CRC(const uint16_t* data, uint32_t count)
+{
+	uint16_t crc = 0xFFFF;
+	uint8_t bytes[2];
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		bytes[0] = data[i] & 0xFF;
+		bytes[1] = data[i] >> 8;
+		for(int j = 0; j < 2; j++)
+		{
+			crc ^= (uint16_t) bytes[j] << 8;
+			for(int bit = 0; bit < 8; bit++)
+			{
+				if(crc & 0x8000)
+					crc = (crc << 1) ^ 0x1021;
+				else
+					crc <<= 1;
+			}
+		}
+	}
+	return crc;
+}
+
+/**
+  * @brief Calculate the legacy (sum) signature of a buffer entry
+  *
+  * @param words Entry words, starting with the timestamp
+  *
+  * @param count Number of entry words, excluding the signature
+  *
+  * @return 16-bit sum of the timestamp and data words
+  */
+uint16_t Entry_Sum(const uint16_t* words, uint32_t count)
+{
+	uint32_t sum = 0;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		/* Skip the signature word */
+		sum += words[i + (i >= TIMESTAMP_WORDS ? 1 : 0)];
+	}
+	return sum & 0xFFFF;
+}
+
+int main(int argc, char** argv)
+{
+	char line[1024];
+	uint16_t words[MAX_WORDS];
+	uint32_t numWords, entries = 0, errors = 0;
+	uint16_t expected;
+	int legacy = (argc > 1) && (strcmp(argv[1], "-s") == 0);
+	char* ptr;
+	char* end;
+
+	/* Check value for the CRC parameters ("12345678") */
+	const uint16_t check[] = {0x3231, 0x3433, 0x3635, 0x3837};
+	if(Entry_CRC(check, 4) != 0xA12B)
+	{
+		fprintf(stderr, "CRC self test failed\n");
+		return 2;
+	}
+
+	while(fgets(line, sizeof(line), stdin))
+	{
+		numWords = 0;
+		ptr = line;
+		while(*ptr && numWords < MAX_WORDS)
+		{
+			if(!isxdigit((unsigned char) *ptr))
+			{
+				ptr++;
+				continue;
+			}
+			words[numWords++] = strtoul(ptr, &end, 16);
+			ptr = end;
+		}
+
+		/* Not a buffer entry */
+		if(numWords <= TIMESTAMP_WORDS + 1)
+			continue;
+
+		if(legacy)
+			expected = Entry_Sum(words, numWords - 1);
+		else
+			expected = Entry_CRC(&words[TIMESTAMP_WORDS + 1], numWords - TIMESTAMP_WORDS - 1);
+
+		entries++;
+		if(expected != words[TIMESTAMP_WORDS])
+		{
+			errors++;
+			printf("entry %u: signature 0x%04X, expected 0x%04X\n", entries, words[TIMESTAMP_WORDS], expected);
+		}
+	}
+
+	printf("%u entries, %u signature errors\n", entries, errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+/**
+  * @file buf_stress.c
+  * @brief Host stress test for the lock-free SPSC sample buffer
+  *
+  * Builds the firmware buffer.c as is, then runs a producer thread (standing
+  * in for the core 1 capture path: Buffer_Add_Element() / Buffer_Commit_Element())
+  * against a consumer thread (standing in for the main loop readbuf / stream
+  * output: Buffer_Take_Span() / Buffer_Span_Intact() / Buffer_Release_Span()).
+  *
+  * Every entry carries its sequence number in the timestamp words, data words
+  * derived from it and a CRC signature, so the consumer can check that each
+  * entry it accepts is intact. Stop mode and compressed mode must deliver every
+  * entry exactly once and in order. Replace oldest mode may drop entries, but
+  * must never deliver a torn one. Each mode is run for a few entry lengths, at
+  * the smallest buffer size so the ring wraps often.
+  *
+  * Build: cc -O2 -pthread -I../include -Ihost -o buf_stress buf_stress.c ../src/buffer.c
+  *
+  * Usage: buf_stress [entries per run]
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "reg.h"
+#include "buffer.h"
+
+/** Default number of entries produced per run */
+#define DEFAULT_ENTRIES		200000
+
+/** Max entries taken per span (same as a full binary packet of small entries) */
+#define SPAN_MAX			64
+
+/** Entries committed by the producer between yields */
+#define PRODUCER_BURST		32
+
+/** Stand-in for the RP2040 heap: free SRAM seen by Buffer_Init() is 32 KB past the reserve */
+__asm__(".data\n"
+		".globl __end__\n"
+		"__end__:\n"
+		".skip 0xC000\n"
+		".globl __StackLimit\n"
+		"__StackLimit:\n"
+		".byte 0\n"
+		".text\n");
+
+/** Firmware globals used by buffer.c */
+volatile uint16_t g_regs[NUM_REG_PAGES * REG_PER_PAGE];
+volatile uint32_t g_update_flags;
+
+/** Number of entries to produce in the current run */
+static uint32_t NumEntries;
+
+/** Set by the producer once all entries are committed */
+static volatile uint32_t ProducerDone;
+
+/** Number of entries committed by the producer */
+static uint32_t ProducerCommitted;
+
+/** Watermark pin updates are not under test */
+void Dio_Update_Watermark()
+{
+}
+
+/**
+  * @brief Fill a buffer entry from its sequence number
+  *
+  * @param entry Entry to fill
+  *
+  * @param seq Sequence number
+  *
+  * @param len Data length, in bytes (BUF_LEN)
+  *
+  * @return void
+  */
+static void FillEntry(uint8_t* entry, uint32_t seq, uint32_t len)
+{
+	uint32_t* ts = (uint32_t *) entry;
+	uint16_t* data = (uint16_t *) (entry + 10);
+	uint16_t sig;
+
+	ts[0] = seq;
+	ts[1] = ~seq;
+	for(uint32_t i = 0; i < (len >> 1); i++)
+	{
+		data[i] = (seq * 0x9E37u + i * 0x1F1Fu) & 0xFFFF;
+	}
+	sig = Buffer_Calc_CRC(entry + 10, len);
+	memcpy(entry + 8, &sig, 2);
+}
+
+/**
+  * @brief Check a buffer entry copy
+  *
+  * @param entry Entry copy
+  *
+  * @param len Data length, in bytes (BUF_LEN)
+  *
+  * @param seq Receives the entry sequence number
+  *
+  * @return 1 if the entry is intact, 0 if it is torn
+  */
+static int CheckEntry(const uint8_t* entry, uint32_t len, uint32_t* seq)
+{
+	uint8_t expected[BUF_MAX_ENTRY + 12];
+
+	memcpy(seq, entry, 4);
+	FillEntry(expected, *seq, len);
+	return memcmp(expected, entry, len + 10) == 0;
+}
+
+/**
+  * @brief Producer thread. Stands in for the core 1 capture path
+  */
+static void* Producer(void* arg)
+{
+	uint32_t len = g_regs[BUF_LEN_REG];
+	uint32_t seq = 0;
+	(void) arg;
+
+	while(seq < NumEntries)
+	{
+		if(!Buffer_Can_Add_Element())
+		{
+			sched_yield();
+			continue;
+		}
+		FillEntry(Buffer_Add_Element(), seq, len);
+		Buffer_Commit_Element();
+		seq++;
+		/* Hand the CPU over now and then, so single core hosts interleave too */
+		if((seq % PRODUCER_BURST) == 0)
+			sched_yield();
+	}
+	ProducerCommitted = seq;
+	__atomic_store_n(&ProducerDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+  * @brief Run one producer / consumer pass
+  *
+  * @param config BUF_CONFIG value
+  *
+  * @param len BUF_LEN value
+  *
+  * @return Number of errors found
+  */
+static uint32_t RunTest(uint16_t config, uint16_t len)
+{
+	pthread_t producer;
+	uint8_t copy[BUF_MAX_ENTRY + 12];
+	uint8_t* entry;
+	uint32_t spanCount, seq, expectedSeq = 0, received = 0, dropped = 0, errors = 0;
+	uint32_t replace = config & BUF_CFG_REPLACE_OLDEST;
+	uint32_t pass = 0;
+	int done;
+
+	g_regs[BUF_CONFIG_REG] = config;
+	g_regs[BUF_LEN_REG] = len;
+	g_regs[BUF_MAX_SIZE_REG] = BUF_MIN_SIZE >> 10;
+	Buffer_Reset();
+	ProducerDone = 0;
+
+	pthread_create(&producer, NULL, Producer, NULL);
+
+	do
+	{
+		/* Sample done before draining, so nothing committed after it is missed */
+		done = __atomic_load_n(&ProducerDone, __ATOMIC_ACQUIRE);
+		Buffer_Take_Span(SPAN_MAX, &entry, &spanCount);
+		for(uint32_t i = 0; i < spanCount; i++)
+		{
+			memcpy(copy, entry, len + 10);
+			/* Stand in for slow USB output, so replace mode gets lapped mid span */
+			if(replace && ((pass + i) % 7) == 0)
+				sched_yield();
+			if(!Buffer_Span_Intact(i))
+			{
+				dropped++;
+			}
+			else if(!CheckEntry(copy, len, &seq))
+			{
+				errors++;
+			}
+			else
+			{
+				/* Stop and compressed mode deliver every entry, replace mode may skip */
+				if(replace ? (seq < expectedSeq) : (seq != expectedSeq))
+				{
+					errors++;
+				}
+				received++;
+				expectedSeq = seq + 1;
+			}
+			entry += g_bufNumWords32 << 2;
+		}
+		Buffer_Release_Span(spanCount);
+		pass++;
+	} while(!done || spanCount);
+
+	pthread_join(producer, NULL);
+
+	if(!replace && received != ProducerCommitted)
+	{
+		errors++;
+	}
+
+	printf("config 0x%02X len %2u: %u produced, %u received, %u lapped, %u errors\n",
+		config, len, ProducerCommitted, received, dropped, errors);
+	return errors;
+}
+
+int main(int argc, char** argv)
+{
+	const uint16_t configs[] = {0, BUF_CFG_REPLACE_OLDEST, BUF_CFG_COMPRESS};
+	const uint16_t lens[] = {BUF_MIN_ENTRY, 0x16, BUF_MAX_ENTRY};
+	uint32_t errors = 0;
+
+	NumEntries = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ENTRIES;
+
+	Buffer_Init();
+	for(uint32_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+	{
+		for(uint32_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+		{
+			errors += RunTest(configs[c], lens[l]);
+		}
+	}
+
+	printf("%s\n", errors ? "FAIL" : "PASS");
+	return errors ? 1 : 0;
+}
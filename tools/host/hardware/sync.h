@@ -0,0 +1,18 @@
+/**
+  * @file sync.h
+  * @brief Host stand-in for the Pico SDK hardware/sync.h
+  *
+  * Only provides what buffer.c uses, so the buffer can be built and
+  * exercised on the host (see buf_stress.c). The data memory barrier
+  * maps to a full compiler and CPU fence.
+  */
+
+#ifndef HOST_HARDWARE_SYNC_H_
+#define HOST_HARDWARE_SYNC_H_
+
+static inline void __dmb(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif /* HOST_HARDWARE_SYNC_H_ */